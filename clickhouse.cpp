@@ -5,14 +5,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <math.h>
+#include <ctype.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sched.h>
 #include <algorithm>
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
 #include <vector>
+#include <thread>
+#include <string_view>
+#include <unordered_map>
 
 /* -------------------------------------------------- */
-/*  To compile:  g++ clickhouse.cpp -o clickhouse
+/*  To compile:  g++ -O2 -pthread clickhouse.cpp -o clickhouse
 /* -------------------------------------------------- */
 
 /*  Globals for the user options */
@@ -23,6 +38,38 @@
 #define SORT_TYPE_DESCENDING    0
 #define SORT_TYPE_ASCENDING     1
 
+/*  Types of the value column.  Each value is parsed into an   */
+/*  order-preserving key in LongValue (and HighValue for the   */
+/*  128-bit type), so that plain signed integer comparisons    */
+/*  rank any of these types, and it's only decoded back when   */
+/*  the results are printed.                                   */
+#define VALUE_TYPE_I64          0
+#define VALUE_TYPE_U64          1
+#define VALUE_TYPE_F64          2
+#define VALUE_TYPE_I128         3
+#define VALUE_TYPE_DECIMAL      4
+#define VALUE_TYPE_COUNT        5
+
+/*  Layouts of the input lines  */
+#define INPUT_FORMAT_TEXT       0   // URL value [columns...]
+#define INPUT_FORMAT_JSON       1   // JSON Lines, one object per line
+#define INPUT_FORMAT_COMBINED   2   // nginx / Apache access logs
+#define INPUT_FORMAT_ARROW      3   // Arrow IPC file or stream
+#define INPUT_FORMAT_COUNT      4
+
+/*  Ways to order the candidates of a batch, see PlanSelection()  */
+#define SELECT_ENGINE_AUTO      0
+#define SELECT_ENGINE_SORT      1   // sort all of them
+#define SELECT_ENGINE_MERGE     2   // sort the new ones, merge with the kept results
+#define SELECT_ENGINE_SELECT    3   // nth_element to the Nth, sort the top N only
+#define SELECT_ENGINE_COUNT     4
+
+/*  Fields of an access log line that can be the value  */
+#define COMBINED_FIELD_BYTES    0
+#define COMBINED_FIELD_STATUS   1
+#define COMBINED_FIELD_TIME     2   // seconds since the epoch
+#define COMBINED_FIELD_COUNT    3
+
 char*   InputFileName           = NULL;
 long    BatchSize               = 1000;
 char    SelectionType           = SELECTION_TYPE_NORMAL;
@@ -33,14 +80,299 @@ char*   OutputFileName          = NULL;  // if generating a test data file
 long    NumLinesToGenerate      = 0; 
 long    BucketCount             = 4;
 bool    Verbose                 = false;
+char*   CacheDirectory          = NULL;   // enables the result cache
+char*   IncrementalStateFile    = NULL;   // enables incremental mode
+bool    NormalizeURLs           = false;
+char*   BlockListFileName       = NULL;   // URLs to exclude
+char*   AllowListFileName       = NULL;   // only URLs to include
+char*   URLListTextFileName     = NULL;   // if building a URL list image
+char*   URLListImageFileName    = NULL;
+char*   JoinFileName            = NULL;   // dimension file to join with
+char*   JoinFilterValue         = NULL;   // only URLs with this attribute
+long    JoinGroupColumn         = 0;      // group by this attribute column
+int     ValueType               = VALUE_TYPE_I64;
+long    DecimalScale            = 2;      // digits after the point
+char*   RankExpressionText      = NULL;   // rank by this expression
+char*   MetricsOptionText       = NULL;   // top-N for each of these columns
+long    TieCap                  = -1;     // --with-ties, extra tied items kept
+bool    ShowLengthStats         = false;  // --length-stats
+long    MemoryLimit             = 0;      // bytes, 0 for no limit
+long    ThreadCountOption       = 0;      // --threads, 0 to size automatically
+char*   KernelsOption           = NULL;   // --kernels, force a CPU variant
+bool    ReadAhead               = true;   // read the next chunk on a thread
+bool    DistinctURLs            = false;  // --distinct, each URL at most once
+bool    PresortedInput          = false;  // --presorted, stop once sorted input can't qualify
+int     InputFormat             = INPUT_FORMAT_TEXT;
+const char* URLFieldName        = "url";    // fields of a JSON line or Arrow input
+const char* ValueFieldName      = "value";
+int     CombinedValueField      = COMBINED_FIELD_BYTES;
+char*   ArrowOutputFileName     = NULL;   // --arrow-output, results as Arrow IPC
+char*   SortOutputFileName      = NULL;   // --sort-output, every line ordered by value
+bool    DeferURLs               = false;  // candidates keep the URL's file offset, not a copy
+int     SelectEngine            = SELECT_ENGINE_AUTO;   // --engine, force one for benchmarking
+
+/*  Branch hints for the per-line hot path  */
+#define LIKELY(x)               __builtin_expect( !!(x), 1 )
+#define UNLIKELY(x)             __builtin_expect( !!(x), 0 )
+
+/*  Column separators in the input file  */
+#define IS_DELIMITER(c)         (( c == ' '  ) || ( c == '\n' ) || \
+                                 ( c == '\t' ) || ( c == '\r' ))
+
+/*  Results of parsing one input line.  Malformed lines are  */
+/*  skipped and counted per type instead of ending the scan  */
+#define PARSE_OK                    0
+#define PARSE_ERROR_MISSING_COLUMN  1
+#define PARSE_ERROR_NOT_URL         2
+#define PARSE_ERROR_BAD_VALUE       3
+#define PARSE_ERROR_VALUE_RANGE     4
+#define PARSE_ERROR_BAD_UTF8        5
+#define PARSE_ERROR_EXPRESSION_NAN  6
+#define PARSE_ERROR_BAD_RECORD      7
+#define PARSE_FILTERED              8   // not an error, see URL lists
+#define PARSE_STATUS_COUNT          9
+
+const char* ParseStatusNames[ PARSE_STATUS_COUNT ] = 
+{
+    "OK",
+    "Missing column",
+    "URL column not a URL",
+    "Value not a number",
+    "Value out of range",
+    "URL not valid UTF-8",
+    "Expression not a number",
+    "Malformed record",
+    "Filtered by URL list"
+};
+
+long    ParseErrorCounts    [ PARSE_STATUS_COUNT ]  = { 0 };
+long    ExtraColumnLineCount                        = 0;
+
+/*  Histograms of the URL and line lengths, in log2 buckets:  */
+/*  bucket B counts lengths from 2^(B-1) to 2^B - 1, bucket 0 */
+/*  the empty ones, and the last bucket everything longer.    */
+#define LENGTH_BUCKETS      17
+
+typedef struct _LENGTH_HISTOGRAM
+{
+    long    Counts  [ LENGTH_BUCKETS ];
+    long    Count;
+    long    TotalLength;
+    long    MaxLength;
+}   LENGTH_HISTOGRAM;
+
+LENGTH_HISTOGRAM    URLLengths      = { { 0 } };
+LENGTH_HISTOGRAM    LineLengths     = { { 0 } };
 
 /*  Basic struct to use for the input data  */
 typedef struct  _DATA_ITEM
 {
     char*  URL;
     long   LongValue;
+    long   HighValue;   // upper half of a 128-bit value
+
+    /*  Attributes from the --join dimension file, these  */
+    /*  point into the dimension list and aren't copied   */
+    const char*     Attributes;
+    unsigned int    AttributesLength;
+
+    /*  Until URL is read back from the input, where it is  */
+    /*  there, see DeferURLs                                 */
+    unsigned int    URLLength;
+    long            URLOffset;
 }   DATA_ITEM;
 
+/*  Items tied with the Nth result that were over the  */
+/*  --with-ties cap, counted but not kept, and the     */
+/*  value of the Nth result they are tied with         */
+long        TieOverflowCount                        = 0;
+DATA_ITEM   TieBoundary                             = { 0 };
+
+/* Running totals of the values read, reported with the results */
+/* so each result can be shown as a share of the total.  Sum is  */
+/* exact for the integer and decimal types, f64 values are added */
+/* up in FloatSum instead.  Min and Max are kept as keys, like   */
+/* the results.  The mean and variance come from sums of the     */
+/* values and their squares, taken relative to the first value   */
+/* so a large mean with a small spread doesn't lose precision.   */
+typedef struct _VALUE_TOTALS
+{
+    long        Count;
+    __int128    Sum;
+    double      FloatSum;
+    bool        SumOverflow;    // only possible with i128 values
+    DATA_ITEM   Min;
+    DATA_ITEM   Max;
+    double      Shift;          // first value, the sums are relative to it
+    double      ShiftedSum;
+    double      ShiftedSquares;
+}   VALUE_TOTALS;
+
+VALUE_TOTALS    ValueTotals     = { 0 };
+bool            TotalsPerRow    = false;  // the reader totals each row it uses, not the block
+
+/* Ranking expressions (--rank-by) are compiled into a small   */
+/* stack program.  Column operands refer to input columns      */
+/* $2..$9, parsed as doubles, or to the URL length in slot 0.  */
+/* The program runs over a whole batch of lines at a time, one */
+/* op per pass over the batch, so the interpretation overhead  */
+/* is paid once per batch and the inner loops are plain array  */
+/* arithmetic the compiler can vectorize.                      */
+
+#define EXPRESSION_URL_LENGTH       0
+#define EXPRESSION_MAX_COLUMN       9
+#define EXPRESSION_MAX_OPS          64
+#define EXPRESSION_MAX_STACK        16
+
+#define EXPRESSION_OP_COLUMN        0
+#define EXPRESSION_OP_CONSTANT      1
+#define EXPRESSION_OP_ADD           2
+#define EXPRESSION_OP_SUBTRACT      3
+#define EXPRESSION_OP_MULTIPLY      4
+#define EXPRESSION_OP_DIVIDE        5
+#define EXPRESSION_OP_NEGATE        6
+
+typedef struct _EXPRESSION_OP
+{
+    int     Code;
+    int     Column;
+    double  Constant;
+}   EXPRESSION_OP;
+
+typedef struct _EXPRESSION
+{
+    EXPRESSION_OP   Ops [ EXPRESSION_MAX_OPS ];
+    int             OpCount;
+    int             StackDepth;     // deepest the stack gets
+    unsigned int    ColumnMask;     // bit per column used
+    int             MaxColumn;      // highest input column used
+}   EXPRESSION;
+
+EXPRESSION*         RankExpression  = NULL;
+
+/* Multi-metric mode (--metrics) keeps an independent top-N   */
+/* for each of several value columns, from one read of the     */
+/* file.  A batch of lines is parsed into one array per metric */
+/* plus a pool of the URL bytes, and each metric picks its     */
+/* candidates from the batch with nth_element over row         */
+/* indexes.  A URL kept by several metrics is copied out of    */
+/* the pool once, into a METRIC_URL shared by reference count. */
+
+#define MAX_METRICS                 8
+
+typedef struct _METRIC_URL
+{
+    long    RefCount;
+    char    URL[1];     // allocated to fit the URL
+}   METRIC_URL;
+
+typedef struct _METRIC_ENTRY
+{
+    long            Value;
+    METRIC_URL*     URL;
+}   METRIC_ENTRY;
+
+int     MetricColumns   [ MAX_METRICS ];
+int     MetricCount                                 = 0;
+int     MetricMaxColumn                             = 0;
+
+/*  Metric index + 1 of each input column, 0 if not a metric  */
+int     MetricSlots     [ EXPRESSION_MAX_COLUMN + 1 ] = { 0 };
+
+/* CPU kernel variants, see SelectKernels()  */
+#define KERNELS_SCALAR          0
+#define KERNELS_SSE2            1
+#define KERNELS_AVX2            2
+#define KERNELS_AVX512          3
+#define KERNELS_COUNT           4
+
+typedef struct _KERNELS
+{
+    const char*     Name;
+
+    /*  Offset of the first space, tab, CR or LF  */
+    size_t  ( *FindDelimiter )          ( const char* Data, size_t Length );
+
+    /*  Offset of the first '?' or '#'  */
+    size_t  ( *FindQueryOrFragment )    ( const char* Data, size_t Length );
+
+    /*  Offset of the first '"' or '\\'  */
+    size_t  ( *FindQuoteOrEscape )      ( const char* Data, size_t Length );
+
+    /*  Lowercases A-Z in place  */
+    void    ( *LowercaseASCII )         ( char* Data, size_t Length );
+
+    /*  Offset of the first byte >= 0x80  */
+    size_t  ( *FindNonASCII )           ( const unsigned char* Data, size_t Length );
+}   KERNELS;
+
+KERNELS*    Kernels     = NULL;
+
+/* The columns of one input line, as parsed in place.  */
+/* URL points into the line buffer, it is not a copy.  */
+typedef struct _PARSED_LINE
+{
+    char*   URL;
+    size_t  URLLength;
+    long    LongValue;
+    long    HighValue;
+    bool    ExtraColumns;
+
+    /*  Attributes from the --join dimension file  */
+    const char*     Attributes;
+    size_t          AttributesLength;
+
+    /*  Inputs of the --rank-by expression  */
+    double          Columns [ EXPRESSION_MAX_COLUMN + 1 ];
+
+    /*  Value keys of the --metrics columns  */
+    long            Metrics [ MAX_METRICS ];
+}   PARSED_LINE;
+
+/*  A block of input lines, parsed into one array per column.  The  */
+/*  file is read in big chunks, and the lines are parsed in place,  */
+/*  so each URL is an offset into Buffer instead of a copy.  Lines  */
+/*  that didn't parse are rows too, with their PARSE_* status, and  */
+/*  the consumers skip them.  The arrays are reused block to block. */
+#define RECORD_BLOCK_READ_SIZE      ( 1 << 20 )
+
+typedef struct _RECORD_BLOCK
+{
+    char*           Buffer;
+    size_t          BufferSize;
+    size_t          Length;         // bytes in Buffer
+    size_t          Parsed;         // bytes of whole lines, the rest is carried over
+    long            FileOffset;     // of Buffer in the input file, for line input
+    long            LineCount;      // lines parsed, in all blocks so far
+
+    long            RowCount;
+    long            NextRow;        // for the row at a time readers
+
+    /*  The next chunk of the file, being read on ReadThread  */
+    /*  while this block is parsed and consumed               */
+    std::thread     ReadThread;
+    char*           NextChunk;
+    size_t          NextChunkLength;
+    bool            ReadPending;
+
+    std::vector<long>           LongValues;
+    std::vector<long>           HighValues;
+    std::vector<unsigned int>   URLOffsets;
+    std::vector<unsigned int>   URLLengths;
+    std::vector<long>           LineNumbers;
+    std::vector<unsigned char>  Status;
+    std::vector<const char*>    Attributes;
+    std::vector<size_t>         AttributesLengths;
+
+    /*  Only the columns the --rank-by expression uses, and  */
+    /*  the first MetricCount metrics, are filled in         */
+    std::vector<double>         Columns [ EXPRESSION_MAX_COLUMN + 1 ];
+    std::vector<long>           Metrics [ MAX_METRICS ];
+}   RECORD_BLOCK;
+
+/*  The block that all the readers of the input file share  */
+RECORD_BLOCK    InputBlock;
+
 /* Wrapper struct for the R-Algorithm selection   */
 /* that preserves the original index from where   */
 /* it came from in the reservoir / data-stream,   */
@@ -60,12 +392,196 @@ typedef struct _BUCKET
     long MaxValue;
 } BUCKET;
 
+/* Identity of an input file + query, used as the key for the  */
+/* on-disk result cache.  The file identity fields come from    */
+/* stat(), and ContentHash is a hash of a few sampled blocks    */
+/* of the file, so that a file rewritten in-place with the same */
+/* size and mtime is still detected.  QueryHash is the hash of  */
+/* the query signature string (all options that affect results) */
+typedef struct _CACHE_KEY
+{
+    unsigned long   Device;
+    unsigned long   Inode;
+    unsigned long   FileSize;
+    unsigned long   ModifiedTimeSec;
+    unsigned long   ModifiedTimeNsec;
+    unsigned long   ContentHash;
+    unsigned long   QueryHash;
+}   CACHE_KEY;
+
+/* Header of the incremental state file.  It records how far    */
+/* into the input file we got, plus a hash of the bytes just      */
+/* before that offset so we can tell if the file was truncated,   */
+/* rotated or rewritten since, rather than only appended to.      */
+/* The result items themselves follow the header in the file.     */
+typedef struct _INCREMENTAL_STATE
+{
+    unsigned long   Device;
+    unsigned long   Inode;
+    long            ProcessedOffset;
+    unsigned long   TailHash;
+    unsigned long   QueryHash;
+    long            TotalLinesRead;
+    long            ItemCount;
+    VALUE_TOTALS    Totals;
+    long            TieOverflowCount;
+    long            TieBoundaryValue;
+    long            TieBoundaryHigh;
+}   INCREMENTAL_STATE;
+
+/* URL lists for the --blocklist / --allowlist filters.        */
+/* A list is one contiguous image: this header, then a blocked */
+/* Bloom filter, then an open-addressing hash set, then the    */
+/* pool of URL bytes the hash set points into.  All references */
+/* are offsets, so a prebuilt image can be mmap()ed directly.  */
+/*                                                             */
+/* Both the Bloom filter and the hash set are split into       */
+/* partitions by the top bits of the URL hash, which lets the  */
+/* build run one thread per group of partitions without locks. */
+/* The Bloom filter blocks are 64 bytes (one cache line) so a  */
+/* lookup of a URL that isn't in the list touches one line.    */
+
+#define URL_LIST_PARTITION_BITS     6
+#define URL_LIST_BLOOM_BLOCK_WORDS  8
+#define URL_LIST_BLOOM_PROBES       6
+#define URL_LIST_MAX_URL_LENGTH     0xFFFF
+
+typedef struct _URL_LIST_HEADER
+{
+    char            Magic[8];
+    unsigned long   EntryCount;
+    unsigned long   PartitionShift;
+    unsigned long   SlotsPerPartition;          // power of two
+    unsigned long   BloomBlocksPerPartition;
+    unsigned long   Normalized;                 // built with --normalize-urls
+    unsigned long   ContentHash;
+    unsigned long   BloomOffset;
+    unsigned long   SlotsOffset;
+    unsigned long   PoolOffset;
+    unsigned long   ImageSize;
+}   URL_LIST_HEADER;
+
+/* Hash set slot, also used for the entries during the build.  */
+/* Hash 0 marks an empty slot.  The URL is at Pool + Offset,   */
+/* where OffsetAndLength = ( Offset << 16 ) | Length.          */
+typedef struct _URL_LIST_SLOT
+{
+    unsigned long   Hash;
+    unsigned long   OffsetAndLength;
+}   URL_LIST_SLOT;
+
+typedef struct _URL_LIST
+{
+    URL_LIST_HEADER*    Header;
+    unsigned long*      Bloom;
+    URL_LIST_SLOT*      Slots;
+    char*               Pool;
+    bool                Mapped;     // image is mmap()ed from a file
+}   URL_LIST;
+
+URL_LIST*   BlockList       = NULL;
+URL_LIST*   AllowList       = NULL;
+URL_LIST*   DimensionList   = NULL;   // URL list with attributes
+
 /* typedef of a sort compare function  */
 typedef bool ( *SORT_COMPARE_FUNCTION ) ( DATA_ITEM*, DATA_ITEM* ); 
 
+/* typedef of a value column parser, one per VALUE_TYPE, picked  */
+/* once at startup like the comparators, instead of switching on */
+/* the type for every line                                       */
+typedef int ( *VALUE_PARSE_FUNCTION ) ( const char* Token, 
+                                        long* LongValue, 
+                                        long* HighValue );
+
+template <int TYPE> 
+int             ParseValue              ( const char* Token, long* LongValue,
+                                          long* HighValue );
+
+const char* ValueTypeNames[ VALUE_TYPE_COUNT ] = 
+{
+    "i64", "u64", "f64", "i128", "decimal"
+};
+
+VALUE_PARSE_FUNCTION ValueParsers[ VALUE_TYPE_COUNT ] = 
+{
+    ParseValue<VALUE_TYPE_I64>,
+    ParseValue<VALUE_TYPE_U64>,
+    ParseValue<VALUE_TYPE_F64>,
+    ParseValue<VALUE_TYPE_I128>,
+    ParseValue<VALUE_TYPE_DECIMAL>
+};
+
+VALUE_PARSE_FUNCTION    ParseValueFunction  = ParseValue<VALUE_TYPE_I64>;
+
+/* typedef of an input line parser, one per INPUT_FORMAT, also  */
+/* picked once at startup                                       */
+typedef int ( *LINE_PARSE_FUNCTION ) ( char* Line, 
+                                       size_t LineLength, 
+                                       PARSED_LINE* Parsed );
+
+int             ParseDataLine           ( char* Line, size_t LineLength,
+                                          PARSED_LINE* Parsed );
+int             ParseJSONLine           ( char* Line, size_t LineLength,
+                                          PARSED_LINE* Parsed );
+int             ParseCombinedLogLine    ( char* Line, size_t LineLength,
+                                          PARSED_LINE* Parsed );
+
+const char* InputFormatNames[ INPUT_FORMAT_COUNT ] = 
+{
+    "text", "json", "combined", "arrow"
+};
+
+LINE_PARSE_FUNCTION LineParsers[ INPUT_FORMAT_COUNT ] = 
+{
+    ParseDataLine,
+    ParseJSONLine,
+    ParseCombinedLogLine,
+    NULL                    // not line-based, see ReadArrowRows()
+};
+
+const char* SelectEngineNames[ SELECT_ENGINE_COUNT ] = 
+{
+    "auto", "sort", "merge", "select"
+};
+
+const char* CombinedFieldNames[ COMBINED_FIELD_COUNT ] = 
+{
+    "bytes", "status", "time"
+};
+
+LINE_PARSE_FUNCTION     ParseLineFunction   = ParseDataLine;
+
 /*  Function declarations  */
 
 DATA_ITEM*      GetNextDataItem         ( FILE** FilePtr );
+bool            ReadParsedLine          ( FILE** FilePtr, PARSED_LINE* Parsed );
+bool            ReadRecordBlock         ( FILE** FilePtr, RECORD_BLOCK* Block );
+long            NextRecordRow           ( FILE** FilePtr, RECORD_BLOCK* Block );
+void            StopReadAhead           ( RECORD_BLOCK* Block );
+DATA_ITEM*      NewBlockDataItem        ( RECORD_BLOCK* Block, long Row );
+bool            ReuseBlockDataItem      ( DATA_ITEM* Item, RECORD_BLOCK* Block, long Row );
+bool            MaterializeURLs         ( std::vector<DATA_ITEM*> *DataVector,
+                                          FILE* DataFile );
+static int      ParseURLColumn          ( PARSED_LINE* Parsed );
+static int      ParseRecordValue        ( const char* Value, size_t ValueLength,
+                                          PARSED_LINE* Parsed );
+static int      ParseExpressionColumn   ( const char* Token, int Column,
+                                          PARSED_LINE* Parsed );
+void            FormatValue             ( DATA_ITEM* Item, char* Buffer,
+                                          size_t BufferSize );
+static inline void AccumulateValue      ( VALUE_TOTALS* Totals, long LongValue,
+                                          long HighValue );
+void            PrintValueTotals        ( VALUE_TOTALS* Totals );
+EXPRESSION*     CompileExpression       ( const char* Text );
+long            EvaluateExpressionBlock ( RECORD_BLOCK* Block );
+SORT_COMPARE_FUNCTION GetCompareFunction ();
+int             NormalizeURL            ( char* URL, size_t* URLLength );
+size_t          FindQueryOrFragment     ( const char* Data, size_t Length );
+void            LowercaseASCII          ( char* Data, size_t Length );
+bool            IsValidUTF8             ( const unsigned char* Data, size_t Length );
+void            PrintParseErrorSummary  ();
+bool            SelectKernels           ();
+void            PrintLengthStats        ();
 bool            GenerateAlgorithmR      ( FILE** FilePtr );
 void            PrintHistogramSummary   ( SAMPLE_ITEM** Reservoir, 
                                           long ItemsRead );
@@ -73,10 +589,80 @@ bool            CompareAscending        ( DATA_ITEM* Item1,
                                           DATA_ITEM* Item2 );
 bool            CompareDescending       ( DATA_ITEM* Item1,
                                           DATA_ITEM* Item2 );
+bool            CompareAscending128     ( DATA_ITEM* Item1,
+                                          DATA_ITEM* Item2 );
+bool            CompareDescending128    ( DATA_ITEM* Item1,
+                                          DATA_ITEM* Item2 );
 bool            PrintVectorData         ( std::vector<DATA_ITEM*> *DataVector );
+bool            WriteArrowFile          ( const char* FileName,
+                                          std::vector<DATA_ITEM*>* DataVector );
+size_t          GetKeepCount            ( std::vector<DATA_ITEM*> *DataVector,
+                                          SORT_COMPARE_FUNCTION CompareFunction );
+int             PlanSelection           ( long Sorted, long New );
+void            PrintTieSummary         ( std::vector<DATA_ITEM*> *DataVector,
+                                          SORT_COMPARE_FUNCTION CompareFunction );
 bool            GenerateTestData        ( const char* Filename, long NumLines );
+unsigned long   HashBytes               ( const void* Data, size_t Length,
+                                          unsigned long Seed );
+bool            BuildQuerySignature     ( char* Buffer, size_t BufferSize );
+bool            BuildCacheKey           ( const char* Filename,
+                                          const char* Signature,
+                                          CACHE_KEY* CacheKey );
+bool            BuildCacheFileName      ( CACHE_KEY* CacheKey,
+                                          char* Buffer, size_t BufferSize );
+bool            WriteDataItems          ( FILE* File,
+                                          std::vector<DATA_ITEM*> *DataVector );
+bool            ReadDataItems           ( FILE* File, long ItemCount,
+                                          std::vector<DATA_ITEM*> *DataVector );
+bool            LoadCachedResults       ( CACHE_KEY* CacheKey,
+                                          const char* Signature,
+                                          std::vector<DATA_ITEM*> *DataVector,
+                                          long* TotalLinesRead );
+bool            StoreCachedResults      ( CACHE_KEY* CacheKey,
+                                          const char* Signature,
+                                          std::vector<DATA_ITEM*> *DataVector,
+                                          long TotalLinesRead );
+bool            HashFileTail            ( FILE* File, long Offset,
+                                          unsigned long* Hash );
+bool            LoadIncrementalState    ( FILE* DataFile,
+                                          const char* Signature,
+                                          std::vector<DATA_ITEM*> *DataVector,
+                                          std::vector<long> *SampleIndexes,
+                                          long* TotalLinesRead );
+bool            SaveIncrementalState    ( FILE* DataFile,
+                                          const char* Signature,
+                                          std::vector<DATA_ITEM*> *DataVector,
+                                          std::vector<long> *SampleIndexes,
+                                          long TotalLinesRead );
+URL_LIST*       LoadURLList             ( const char* Filename );
+URL_LIST*       BuildURLList            ( const char* Filename );
+bool            SaveURLList             ( URL_LIST* List, const char* Filename );
+void            FreeURLList             ( URL_LIST* List );
+bool            URLListContains         ( URL_LIST* List, const char* URL,
+                                          size_t Length );
+URL_LIST_SLOT*  URLListFind             ( URL_LIST* List, const char* URL,
+                                          size_t Length );
+const char*     URLListAttributes       ( URL_LIST* List, URL_LIST_SLOT* Slot,
+                                          size_t* Length );
+const char*     GetAttributeColumn      ( const char* Attributes, size_t Length,
+                                          long Column, size_t* TokenLength );
+static bool     HasAttribute            ( const char* Attributes, size_t Length,
+                                          const char* Value );
+bool            GenerateMultiMetric     ( FILE** FilePtr );
+bool            GenerateJoinGroups      ( FILE** FilePtr,
+                                          std::vector<DATA_ITEM*> *DataVector,
+                                          long* TotalLinesRead );
+bool            GenerateSortedFile      ( FILE** FilePtr );
+long            GetThreadCount          ();
+const char*     GetThreadTopology       ();
+void            GetCgroupDirectory      ( char* Directory, size_t DirectorySize );
+long            GetCgroupMemoryLimit    ();
+long            GetResidentBytes        ();
+void            EnforceMemoryLimit      ( long* BatchSizePtr );
+void            PrintPeakMemory         ();
 bool            ParseArgs               ( int argc, char *argv[] );
 long            GetCurrentTimeMs        ();
+long            GetCurrentTimeUs        ();
 void            PrintHelp               ();
 
 
@@ -108,30 +694,80 @@ bool GenerateAlgorithmR( FILE** FilePtr )
     long            StartSamplingTs  = 0;
     long            EndSamplingTs    = 0;
     long            ReplacedCount    = 0;
+    long            ResumedLinesRead = 0;
+    char            QuerySignature   [ 512 ] = { 0 };
+
+    /*  Reservoir contents carried over from a previous run  */
+    /*  in incremental mode, plus their SampleIndex values   */
+    std::vector<DATA_ITEM*> ResumedItems;
+    std::vector<long>       ResumedSampleIndexes;
     
     /* this is a short-term hack only used for printing results  */
     /* not used in actual reading of the file or processing data */
     std::vector<DATA_ITEM*> TmpVector;
     
     if ( !Reservoir ) return ( false );
-    memset( Reservoir, '\0', sizeof( SAMPLE_ITEM** ));
+    memset( Reservoir, '\0', ReservoirSize );
     
     /* First, populate the Reservoir with an initial set    */  
     /* of data samples from the stream.                    */
     long ReservoirIndex = 0;
     long SampleIndex = 0;
+
+    /*  In incremental mode, start from the reservoir saved by  */
+    /*  the previous run, and continue sampling where it left   */
+    /*  off.  The file pointer is moved to the saved offset.    */
+    if (( IncrementalStateFile ) &&
+        ( BuildQuerySignature( QuerySignature, sizeof( QuerySignature ))) &&
+        ( LoadIncrementalState( *FilePtr, 
+                                QuerySignature, 
+                                &ResumedItems, 
+                                &ResumedSampleIndexes, 
+                                &ResumedLinesRead ))) {
+
+        for ( ReservoirIndex = 0; 
+              ReservoirIndex < ResumedItems.size();
+              ReservoirIndex += 1 ) {
+
+            SAMPLE_ITEM*  SampleItem = ( SAMPLE_ITEM* ) 
+                                        malloc( sizeof ( SAMPLE_ITEM ));
+            if ( !SampleItem ) goto Failed;
+
+            SampleItem -> DataItem      = ResumedItems[ ReservoirIndex ];
+            SampleItem -> SampleIndex   = ResumedSampleIndexes[ ReservoirIndex ];
+            Reservoir[ ReservoirIndex ] = SampleItem;
+        }
+        
+        printf("Resumed Reservoir with %lu items, %ld lines already read\n", 
+                ReservoirIndex, ResumedLinesRead);
+    }
     
     printf("Populating Reservoir with %lu items\n", ResultCount);
     
     /*  In this stage, ReservoirIndex == SampleIndex because we are just  */
     /*  filling Reservoir with the first ResultCount items from the file */
-    for (   ReservoirIndex = 0; 
-            ReservoirIndex < ResultCount;
+    for ( ; ReservoirIndex < ResultCount;
             ReservoirIndex += 1) {
                     
         /*  Retrieve an item of data from the data stream.  */
         DataItem = GetNextDataItem( FilePtr );
         
+        /*  In incremental mode, a file shorter than the reservoir   */
+        /*  is not an error, it just hasn't grown enough yet.  Save  */
+        /*  what we have so the next run continues filling it.       */
+        if (( !DataItem ) && ( IncrementalStateFile )) {
+            ResumedSampleIndexes.resize( ReservoirIndex );
+            for ( long Index = 0; Index < ReservoirIndex; Index += 1 ) {
+                TmpVector.push_back( Reservoir[Index]->DataItem );
+                ResumedSampleIndexes[Index] = Reservoir[Index]->SampleIndex;
+            }
+            SaveIncrementalState( *FilePtr, QuerySignature, &TmpVector,
+                                  &ResumedSampleIndexes, ReservoirIndex );
+            printf("Reservoir partially populated with %lu items, "
+                   "state saved for the next run\n", ReservoirIndex);
+            goto Success;
+        }
+
         /*  Abort if we get an invalid data item */
         if ( !DataItem ) goto Failed;
         
@@ -160,7 +796,8 @@ bool GenerateAlgorithmR( FILE** FilePtr )
     /*  The SampleIndex number is a counter that increments as we read         */
     /*  new data items from the data stream.                                   */
     ReservoirSize = ReservoirIndex;
-    SampleIndex = ReservoirSize - 1;
+    SampleIndex = ( ResumedLinesRead > ReservoirSize ) ?
+                  ( ResumedLinesRead - 1 ) : ( ReservoirSize - 1 );
     srand( time(0) );
     DataItem = NULL;
     StartSamplingTs = GetCurrentTimeMs();
@@ -169,11 +806,12 @@ bool GenerateAlgorithmR( FILE** FilePtr )
     printf("\nReading data + selecting samples from input file\n");
     while ( true )
     {
-        /*  Get next data item from file stream */
-        DataItem = GetNextDataItem( FilePtr );
+        /*  Get the next line from the file stream.  It stays in   */
+        /*  the input block, and only a selected one is copied out */
+        long Row = NextRecordRow( FilePtr, &InputBlock );
         
-        /*  If we get a NULL DataItem it means end of file (or failure)  */
-        if ( !DataItem ) break;  
+        /*  A negative Row means end of file (or failure)  */
+        if ( Row < 0 ) break;  
         
         /* Increment the sample index counter  */
         SampleIndex += 1;
@@ -201,6 +839,9 @@ bool GenerateAlgorithmR( FILE** FilePtr )
             if ( Verbose ) printf("Selected item SampleIndex=%lu "
                                   "to replace Reservoir[%lu]\n",
                                   SampleIndex, RandomValue );
+
+            DataItem = NewBlockDataItem( &InputBlock, Row );
+            if ( !DataItem ) goto Failed;
                     
             SAMPLE_ITEM*  SampleItem = ( SAMPLE_ITEM* ) 
                                         malloc( sizeof ( SAMPLE_ITEM ));
@@ -243,6 +884,19 @@ bool GenerateAlgorithmR( FILE** FilePtr )
     printf("Reservoir replacements = %lu \n", 
             ReplacedCount);
 
+    PrintParseErrorSummary();
+    if ( ShowLengthStats ) PrintLengthStats();
+
+    /*  Save the reservoir + file position for the next run  */
+    if ( IncrementalStateFile ) {
+        ResumedSampleIndexes.resize( ResultCount );
+        for (int i = 0; i < ResultCount; i++) {
+            TmpVector.push_back( Reservoir[i]->DataItem );
+            ResumedSampleIndexes[i] = Reservoir[i]->SampleIndex; }
+        SaveIncrementalState( *FilePtr, QuerySignature, &TmpVector,
+                              &ResumedSampleIndexes, SampleIndex+1 );
+        TmpVector.clear();
+    }
 
     /*  Stuffing results into a vector for the moment because */
     /*  my summary function currently only takes vectors */
@@ -250,6 +904,9 @@ bool GenerateAlgorithmR( FILE** FilePtr )
     TmpVector.push_back( Reservoir[i]->DataItem ); } 
     printf("\nRandomly Selected Samples (ResultCount = %lu): \n", ResultCount);
     PrintVectorData( &TmpVector );
+    if ( ArrowOutputFileName )
+        WriteArrowFile( ArrowOutputFileName, &TmpVector );
+    PrintValueTotals( &ValueTotals );
     PrintHistogramSummary( Reservoir, SampleIndex+1 );
     printf("\n");
     
@@ -267,6 +924,307 @@ bool GenerateAlgorithmR( FILE** FilePtr )
         return(Status);
 }
 
+/*  Aggregates LongValue per dimension attribute, for example   */
+/*  the owner or service of each URL from the --join file, and  */
+/*  returns the top ResultCount groups as DATA_ITEMs whose URL  */
+/*  is the group name.  URLs not in the dimension file are put  */
+/*  in the "(unmatched)" group.  The group names point into the */
+/*  dimension list, so the map doesn't copy any strings.        */
+
+typedef struct _GROUP_TOTAL
+{
+    long    Sum;
+    long    Count;
+}   GROUP_TOTAL;
+
+bool GenerateJoinGroups( FILE**                     FilePtr,
+                         std::vector<DATA_ITEM*>*   DataVector,
+                         long*                      TotalLinesRead )
+{
+    std::unordered_map<std::string_view, GROUP_TOTAL>   Groups;
+    SORT_COMPARE_FUNCTION   CompareFunction = NULL;
+    const char*             GroupName       = NULL;
+    size_t                  GroupLength     = 0;
+    long                    Value           = 0;
+
+    if (( !FilePtr ) || ( !DataVector )) return ( false );
+
+    CompareFunction = GetCompareFunction();
+
+    /*  A block at a time, straight from its columns  */
+    while ( ReadRecordBlock( FilePtr, &InputBlock ))
+    {
+        for ( long Row = 0; Row < InputBlock.RowCount; Row += 1 )
+        {
+            if ( InputBlock.Status[Row] != PARSE_OK ) continue;
+
+            GroupName = NULL;
+            if ( InputBlock.Attributes[Row] )
+                GroupName = GetAttributeColumn( InputBlock.Attributes[Row],
+                                                InputBlock.AttributesLengths[Row],
+                                                JoinGroupColumn,
+                                                &GroupLength );
+            if ( !GroupName ) {
+                GroupName   = "(unmatched)";
+                GroupLength = strlen( GroupName ); }
+
+            /*  Saturate instead of wrapping around on overflow  */
+            Value = InputBlock.LongValues[Row];
+            GROUP_TOTAL& Group = Groups[ std::string_view( GroupName, GroupLength ) ];
+            if ( __builtin_add_overflow( Group.Sum, Value, &Group.Sum ))
+                Group.Sum = ( Value > 0 ) ? LONG_MAX : LONG_MIN;
+            Group.Count += 1;
+
+            *TotalLinesRead += 1;
+        }
+    }
+
+    printf("Aggregated %lu groups by attribute column %ld\n", 
+            Groups.size(), JoinGroupColumn );
+
+    for ( auto& Group : Groups )
+    {
+        DATA_ITEM*  Item    = ( DATA_ITEM* ) calloc( 1, sizeof( DATA_ITEM ));
+        char*       Name    = ( char* ) malloc( Group.first.size() + 1 );
+
+        if (( !Item ) || ( !Name )) {
+            free( Item );
+            free( Name );
+            return ( false ); }
+
+        memcpy( Name, Group.first.data(), Group.first.size() );
+        Name[ Group.first.size() ] = '\0';
+
+        Item -> URL         = Name;
+        Item -> LongValue   = Group.second.Sum;
+        DataVector->push_back( Item );
+    }
+
+    sort( DataVector->begin(), DataVector->end(), CompareFunction );
+
+    size_t Keep = GetKeepCount( DataVector, CompareFunction );
+    while ( DataVector->size() > Keep ) {
+        free( DataVector->back()->URL );
+        free( DataVector->back() );
+        DataVector->pop_back(); }
+
+    if ( DataVector->size() < (size_t) ResultCount )
+        ResultCount = DataVector->size();
+
+    return ( true );
+}
+
+
+/*  Drops one reference to a shared result URL  */
+
+static void ReleaseMetricURL( METRIC_URL* URL )
+{
+    if ( --URL->RefCount == 0 )
+        free( URL );
+}
+
+static bool CompareMetricsAscending( const METRIC_ENTRY& Entry1, 
+                                     const METRIC_ENTRY& Entry2 )
+{
+    return ( Entry1.Value < Entry2.Value );
+}
+
+static bool CompareMetricsDescending( const METRIC_ENTRY& Entry1, 
+                                      const METRIC_ENTRY& Entry2 )
+{
+    return ( Entry1.Value > Entry2.Value );
+}
+
+/*  Selects and prints the top ResultCount URLs for each of the  */
+/*  --metrics columns, reading the file once.  Lines are read    */
+/*  in batches of BatchSize into columnar arrays.  For each      */
+/*  metric, only the rows that beat its current Nth value are    */
+/*  candidates, and nth_element picks at most ResultCount of     */
+/*  them, so a batch costs one pass per metric plus a small sort */
+/*  of the survivors.  URLs are only copied out of the batch     */
+/*  pool when some metric keeps them.                            */
+
+bool GenerateMultiMetric( FILE** FilePtr )
+{
+    std::vector<long>           Values      [ MAX_METRICS ];
+    std::vector<METRIC_ENTRY>   Results     [ MAX_METRICS ];
+    std::vector<char>           URLPool;
+    std::vector<size_t>         URLOffsets;
+    std::vector<METRIC_URL*>    RowURLs;
+    std::vector<long>           Rows;
+    std::vector<DATA_ITEM*>     TmpVector;
+    VALUE_TOTALS                Totals      [ MAX_METRICS ];
+    PARSED_LINE                 Parsed;
+    bool                        Descending      = ( ResultSortType == SORT_TYPE_DESCENDING );
+    bool                        Status          = false;
+    long                        BatchLinesRead  = 0;
+    long                        TotalLinesRead  = 0;
+    long                        StartTs         = 0;
+    long                        EndTs           = 0;
+
+    bool ( *CompareEntries )( const METRIC_ENTRY&, const METRIC_ENTRY& ) =
+        Descending ? CompareMetricsDescending : CompareMetricsAscending;
+
+    if ( !FilePtr ) return ( false );
+
+    memset( Totals, 0, sizeof( Totals ));
+    StartTs = GetCurrentTimeMs();
+
+    while ( true )
+    {
+        EnforceMemoryLimit( &BatchSize );
+
+        /*  Parse a batch of lines into the columns  */
+        BatchLinesRead = 0;
+        URLPool.clear();
+        URLOffsets.clear();
+
+        /*  Size the pool for a batch of URLs of the mean  */
+        /*  length seen so far, instead of growing it       */
+        if ( URLLengths.Count )
+            URLPool.reserve( BatchSize * ( URLLengths.TotalLength / URLLengths.Count + 2 ));
+        for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+            Values[ Metric ].clear();
+
+        while (( BatchLinesRead < BatchSize ) && 
+               ( ReadParsedLine( FilePtr, &Parsed ))) {
+
+            URLOffsets.push_back( URLPool.size() );
+            URLPool.insert( URLPool.end(), 
+                            Parsed.URL, 
+                            Parsed.URL + Parsed.URLLength + 1 );
+
+            for ( int Metric = 0; Metric < MetricCount; Metric += 1 ) {
+                Values[ Metric ].push_back( Parsed.Metrics[ Metric ] );
+                AccumulateValue( &Totals[ Metric ], Parsed.Metrics[ Metric ], 0 ); }
+
+            BatchLinesRead += 1;
+        }
+
+        if ( !BatchLinesRead ) break;
+        TotalLinesRead += BatchLinesRead;
+        RowURLs.assign( BatchLinesRead, NULL );
+
+        for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+        {
+            std::vector<METRIC_ENTRY>&  Result  = Results[ Metric ];
+            const long*                 Column  = Values[ Metric ].data();
+            bool                        Full    = ( Result.size() >= (size_t) ResultCount );
+            long                        Bound   = Full ? Result.back().Value : 0;
+
+            /*  Rows that would make it into the current top-N  */
+            Rows.clear();
+            for ( long Row = 0; Row < BatchLinesRead; Row += 1 )
+                if (( !Full ) || 
+                    ( Descending ? ( Column[ Row ] > Bound ) : ( Column[ Row ] < Bound )))
+                    Rows.push_back( Row );
+
+            if ( Rows.size() > (size_t) ResultCount ) {
+                std::nth_element( Rows.begin(), 
+                                  Rows.begin() + ResultCount, 
+                                  Rows.end(),
+                                  [ Column, Descending ]( long Row1, long Row2 ) {
+                                      return ( Descending ? ( Column[ Row1 ] > Column[ Row2 ] ) :
+                                                            ( Column[ Row1 ] < Column[ Row2 ] )); } );
+                Rows.resize( ResultCount ); }
+
+            if ( Rows.empty() ) continue;
+
+            /*  Copy out the URLs that made it, once per row.  The  */
+            /*  batch holds a reference of its own until every      */
+            /*  metric is done, so a URL that one metric trims      */
+            /*  stays valid for the next metric to keep             */
+            for ( long Row : Rows ) {
+                if ( !RowURLs[ Row ] ) {
+                    const char* URL     = &URLPool[ URLOffsets[ Row ]];
+                    size_t      Length  = strlen( URL );
+
+                    RowURLs[ Row ] = ( METRIC_URL* ) malloc( sizeof( METRIC_URL ) + Length );
+                    if ( !RowURLs[ Row ] ) goto Failed;
+                    RowURLs[ Row ]->RefCount = 1;
+                    memcpy( RowURLs[ Row ]->URL, URL, Length + 1 ); }
+
+                RowURLs[ Row ]->RefCount += 1;
+                Result.push_back( { Column[ Row ], RowURLs[ Row ] } );
+            }
+
+            sort( Result.begin(), Result.end(), CompareEntries );
+
+            while ( Result.size() > (size_t) ResultCount ) {
+                ReleaseMetricURL( Result.back().URL );
+                Result.pop_back(); }
+        }
+
+        for ( METRIC_URL* URL : RowURLs )
+            if ( URL ) ReleaseMetricURL( URL );
+        RowURLs.clear();
+
+        if ( Verbose )
+            printf("Finished batch. BatchLinesRead = %lu, TotalLinesRead = %lu\n",
+                    BatchLinesRead, TotalLinesRead );
+    }
+
+    EndTs = GetCurrentTimeMs();
+
+    printf("\n");
+    printf("Processed %ld items for %d metrics in %ldms from file: %s\n",
+            TotalLinesRead, 
+            MetricCount,
+            (EndTs-StartTs), 
+            InputFileName );
+
+    PrintParseErrorSummary();
+    if ( ShowLengthStats ) PrintLengthStats();
+
+    /*  Print through the usual function, with DATA_ITEMs  */
+    /*  that borrow the shared URLs                         */
+    for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+    {
+        printf("\nTop %lu Results for column %d (%s):\n",
+                Results[ Metric ].size(),
+                MetricColumns[ Metric ],
+                Descending ? "DESCENDING" : "ASCENDING" );
+
+        for ( METRIC_ENTRY& Entry : Results[ Metric ] ) {
+            DATA_ITEM* Item = ( DATA_ITEM* ) calloc( 1, sizeof( DATA_ITEM ));
+            if ( !Item ) goto Failed;
+            Item -> URL       = Entry.URL->URL;
+            Item -> LongValue = Entry.Value;
+            TmpVector.push_back( Item ); }
+
+        /*  PrintVectorData() shows the shares of ValueTotals  */
+        ValueTotals = Totals[ Metric ];
+        PrintVectorData( &TmpVector );
+        PrintValueTotals( &Totals[ Metric ] );
+
+        for ( DATA_ITEM* Item : TmpVector )
+            free( Item );
+        TmpVector.clear();
+    }
+
+    goto Success;
+
+    Success:
+        Status = true;
+        goto Cleanup;
+    Failed:
+        printf("Failed to allocate result URL\n");
+        Status = false;
+        goto Cleanup;
+    Cleanup:
+        for ( DATA_ITEM* Item : TmpVector )
+            free( Item );
+        for ( METRIC_URL* URL : RowURLs )
+            if ( URL ) ReleaseMetricURL( URL );
+        for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+            for ( METRIC_ENTRY& Entry : Results[ Metric ] )
+                ReleaseMetricURL( Entry.URL );
+        goto Exit;
+    Exit:
+        return ( Status );
+}
+
+
 void PrintHistogramSummary( SAMPLE_ITEM** Reservoir, long ItemsRead )
 {
     if ( !Reservoir ) return;
@@ -327,449 +1285,6393 @@ void PrintHistogramSummary( SAMPLE_ITEM** Reservoir, long ItemsRead )
     return;
 }
 
-/*  This function reads a single line from the input      */
-/*  text file, parses the columns into data fields        */
-/*  into a heap-allocated DATA_ITEM struct, and returns     */
-/*  it to the caller, or NULL if we reached EOF or error  */
+/*  This function parses one line of input, in place, into    */
+/*  the PARSED_LINE fields.  The URL points into the line      */
+/*  buffer, so nothing is allocated here.  It returns PARSE_OK */
+/*  or one of the PARSE_ERROR codes for a malformed line.      */
+/*  Error paths only return a code, the caller counts them,    */
+/*  so bad lines cost no more than good ones.                  */
 
-DATA_ITEM* GetNextDataItem(FILE** FilePtr)
+int ParseDataLine( char* Line, size_t LineLength, PARSED_LINE* Parsed )
 {
-    DATA_ITEM*  NewDataItem     = NULL;
-    char*       InputLine       = NULL;
-    char*       TokenLine       = NULL;
-    char*       URL             = NULL;
-    size_t      Length          = 0;
-    long        LongValue       = 0;
-    size_t      BufferSize      = 0;
-    ssize_t     BytesRead       = 0;
+    char*       Cursor          = Line;
+    char*       LineEnd         = Line + LineLength;
     char*       Token           = NULL;
-    char        Delims[]        = { ' ', '\n', '\0' };   
     short       Column          = 0;
-    bool        Status          = false;
-    bool        HaveURL         = false;
-    bool        HaveValue       = false;
-    
-    if ( !FilePtr ) return ( NULL );
-    
-    /* Read the next line from the file pointer  */
-    /* the caller provided                       */
-    BytesRead = getline(  &InputLine, 
-                          &BufferSize, 
-                          *FilePtr );
-    
-    if ( BytesRead < 0 ) return ( NULL );
-                
-    /* Tokenize the lines from the input file        */
-    /* We are making the assumption that the first   */
-    /* column of data is a URL string, and the 2nd   */
-    /* column is a long integer type, separated by   */
-    /* whitespace */
-    
-    TokenLine = strdup( InputLine );
-    
-    /*  Loop through the tokens from the line       */    
-    for (  Token   = strtok( TokenLine, Delims );
-           Token  != NULL;
-           Token   = strtok( NULL, Delims ))
-    {               
+    int         ValueStatus     = PARSE_OK;
+
+    /* Tokenize the line from the input file          */
+    /* We are making the assumption that the first    */
+    /* column of data is a URL string, and the 2nd    */
+    /* column is a long integer type, separated by    */
+    /* whitespace.  The tokens are NUL-terminated in  */
+    /* place, the line buffer has room for the last.  */
+
+    Parsed -> ExtraColumns      = false;
+    Parsed -> Attributes        = NULL;
+    Parsed -> AttributesLength  = 0;
+
+    while ( true )
+    {
+        while (( Cursor < LineEnd ) && ( IS_DELIMITER( *Cursor )))
+            Cursor += 1;
+
+        if ( Cursor >= LineEnd ) break;
+
+        Token   = Cursor;
+        Cursor += Kernels->FindDelimiter( Cursor, LineEnd - Cursor );
+        *Cursor = '\0';
+
         Column  +=  1;
         switch ( Column )
         {
             case 1:
-            
-                /* First column should be the URL.           */
-                /* We are only doing a very basic check for  */
-                /* whether it really is a URL string.        */
 
-                if ( strcasestr( Token, "http" )) { 
+                /* First column should be the URL  */
 
-                    /* Allocate memory from the heap        */
-                    /* to store the URL string, which       */
-                    /* will be added to a DATA_ITEM struct  */
+                Parsed -> URL       = Token;
+                Parsed -> URLLength = Cursor - Token;
 
-                    Length = strlen( Token );
-                    
-                    URL = ( char* ) malloc( 
-                                    sizeof ( char ) * 
-                                    ( Length + 1 ));
+                ValueStatus = ParseURLColumn( Parsed );
+                if ( UNLIKELY( ValueStatus != PARSE_OK ))
+                    return ( ValueStatus );
+                break;
 
-                    if ( !URL ) {
-                        printf("Failed to allocate URL\n");
-                        goto Failed;
-                    }
-                    
-                    memset( URL, '\0', sizeof (char) * (Length + 1));
-                    strcpy( URL, Token );
-                    HaveURL = true;
+ 
+            case 2:
 
-                } else {
+                /*  With --rank-by, the numeric columns are  */
+                /*  inputs of the expression instead         */
+                if ( RankExpression ) {
+                    ValueStatus = ParseExpressionColumn( Token, Column, Parsed );
+                    if ( UNLIKELY( ValueStatus != PARSE_OK ))
+                        return ( ValueStatus );
+                    break; }
 
-                    printf("Token string is not a URL\n");
-                    goto Failed;
-                }
-                
+                /*  Second column should be the value, of  */
+                /*  the type picked with --value-type      */
+                ValueStatus = ParseValueFunction( Token, 
+                                                  &Parsed->LongValue,
+                                                  &Parsed->HighValue );
+                if ( UNLIKELY( ValueStatus != PARSE_OK ))
+                    return ( ValueStatus );
+
+                if ( MetricSlots[2] )
+                    Parsed->Metrics[ MetricSlots[2] - 1 ] = Parsed->LongValue;
                 break;
-                
-            case 2:
-            
-                /*  Second column should be the long value          */
-                /*  Just using the stdlib number conversion         */
-                /*  functions.  First check if we need to handle    */
-                /*  the "0" special case.                           */
 
-                if  (( strlen( Token )  ==  1 )   && 
-                     ( Token[0]  == '0' )){
+            default:
 
-                    LongValue = 0;
+                /*  A --metrics column, of the same type as the value  */
+                if (( Column <= EXPRESSION_MAX_COLUMN ) && ( MetricSlots[ Column ] )) {
+                    long HighValue = 0;
+                    ValueStatus = ParseValueFunction( Token, 
+                                                      &Parsed->Metrics[ MetricSlots[ Column ] - 1 ],
+                                                      &HighValue );
+                    if ( UNLIKELY( ValueStatus != PARSE_OK ))
+                        return ( ValueStatus );
+                    break; }
 
-            } else {
-                
-                /* Convert from string to long */
-                LongValue = strtol( Token, NULL, 10 );
+                if (( RankExpression ) && 
+                    ( RankExpression->ColumnMask & ( 1u << std::min( (int) Column, 31 )))) {
+                    ValueStatus = ParseExpressionColumn( Token, Column, Parsed );
+                    if ( UNLIKELY( ValueStatus != PARSE_OK ))
+                        return ( ValueStatus );
+                    break; }
 
-                /*  It potentially sets any error conditions */
-                /*  to one of these values     */
+                /*  Unexpected extra data.  Don't fail, the  */
+                /*  caller just makes a note of it           */
+                Parsed -> ExtraColumns = true;
+                break;
+        }
 
-                if  (( LongValue == LONG_MIN )    ||
-                     ( LongValue == LONG_MAX )    ||
-                     ( LongValue == 0        ))   {
+        Cursor += 1;
+    }
 
-                    printf( "Failed to convert token "
-                            "to long value: %s\n", Token);
+    /*  If we don't have all the data, the line is malformed  */
+    if ( UNLIKELY(( Column < 2 ) || ( Column < MetricMaxColumn )))
+        return ( PARSE_ERROR_MISSING_COLUMN );
 
-                    goto Failed;
-                }
-            }
-            
-            HaveValue = true;  
-            break;   
-            
-        default:
+    if ( RankExpression ) {
+        if ( UNLIKELY( Column < RankExpression->MaxColumn ))
+            return ( PARSE_ERROR_MISSING_COLUMN );
+        Parsed->Columns[ EXPRESSION_URL_LENGTH ] = Parsed->URLLength;
+    }
 
-            // Nothing to do here, only if there is unexpected 
-            // extra data will this get executed. Don't fail,
-            // just make a note of it
-            printf("File has more than 3 columns of data: %s\n", Token);
-            break;
-            
-        }   /* End column switch */
-    }  // End processing line
+    return ( PARSE_OK );
+}
 
-    /*  If we don't have all the data, fail + cleanup */
-    if  (( !HaveURL ) || ( !HaveValue )) 
-        goto Failed;
-    
-    /*  Allocate new struct from the heap to store the data */
-    NewDataItem = ( DATA_ITEM* )
-                    malloc( sizeof( DATA_ITEM ));
 
-    if  ( !NewDataItem ) {
-            printf("Failed to allocate DATA_ITEM\n");
-            goto Failed; }
-
-    memset( NewDataItem, '\0', sizeof( DATA_ITEM ));
-    
-    /*  Fill in the new struct  */
-    NewDataItem->URL        = URL;
-    NewDataItem->LongValue  = LongValue;
+/*  Checks the URL of a line, which is NUL-terminated in place,  */
+/*  and filters + joins it.  We are only doing a very basic      */
+/*  check for whether it really is a URL string, unless the URLs */
+/*  are being normalized, which checks the scheme properly.      */
 
-    /*  We are success              */
-    /*  Cleanup before returning    */
-    goto Success;
-    
-    Success:
-        Status = true;
-        goto Cleanup;
+static int ParseURLColumn( PARSED_LINE* Parsed )
+{
+    /*  A request path from an access log has no scheme or host,  */
+    /*  normalizing it only drops the query and fragment          */
+    if (( InputFormat == INPUT_FORMAT_COMBINED ) && ( *Parsed->URL == '/' )) {
+        if ( NormalizeURLs ) {
+            Parsed->URLLength = FindQueryOrFragment( Parsed->URL, Parsed->URLLength );
+            Parsed->URL[ Parsed->URLLength ] = '\0';
+            if ( UNLIKELY( !IsValidUTF8(( const unsigned char* ) Parsed->URL, 
+                                        Parsed->URLLength )))
+                return ( PARSE_ERROR_BAD_UTF8 ); }
+    }
+    else if ( NormalizeURLs ) {
+        int URLStatus = NormalizeURL( Parsed->URL, 
+                                      &Parsed->URLLength );
+        if ( UNLIKELY( URLStatus != PARSE_OK ))
+            return ( URLStatus );
+    }
+    else if ( UNLIKELY( !strcasestr( Parsed->URL, "http" )))
+        return ( PARSE_ERROR_NOT_URL );
 
-    Failed:
-        Status = false;
-        /*  URL should not be released under   */
-        /*  successful executions              */
-        if ( URL )
-            free ( URL );
-        goto Cleanup;
+    /*  Drop blocked / not allowed URLs before we go  */
+    /*  any further with the line                     */
+    if ((( BlockList ) && 
+         ( URLListContains( BlockList, 
+                            Parsed->URL, 
+                            Parsed->URLLength ))) ||
+        (( AllowList ) && 
+         ( !URLListContains( AllowList, 
+                             Parsed->URL, 
+                             Parsed->URLLength ))))
+        return ( PARSE_FILTERED );
 
-    Cleanup:
-        /* Free the memory that getline + strdup allocated */
-        if ( InputLine )
-            free( InputLine );
-        if ( TokenLine )
-            free ( TokenLine );
-        InputLine = NULL;
-        TokenLine = NULL;
-        BufferSize = 0;
-        goto Exit;
+    /*  Join with the dimension file, and apply the  */
+    /*  attribute filter, if there is one            */
+    if ( DimensionList ) {
+        URL_LIST_SLOT*  Slot = URLListFind( DimensionList, 
+                                            Parsed->URL, 
+                                            Parsed->URLLength );
+        if ( Slot )
+            Parsed->Attributes = URLListAttributes( DimensionList, 
+                                                    Slot,
+                                                    &Parsed->AttributesLength );
         
-    Exit:
-        /*  Return the DATA_ITEM struct to the caller   */
-        /*  which will either be a valid one, or NULL   */
-        return(NewDataItem);
+        if (( JoinFilterValue ) &&
+            (( !Parsed->Attributes ) ||
+             ( !HasAttribute( Parsed->Attributes, 
+                              Parsed->AttributesLength, 
+                              JoinFilterValue ))))
+            return ( PARSE_FILTERED );
+    }
+
+    return ( PARSE_OK );
 }
-    
 
-/*  main  */
-int main( int argc, char *argv[] )
+
+/*  JSON Lines input is parsed on demand, the way simdjson does  */
+/*  it: nothing is built for the object, the top level is just   */
+/*  walked to find the two fields we want.  Strings are skipped  */
+/*  with the FindQuoteOrEscape kernel, which jumps over the       */
+/*  bytes that can't end them a vector at a time.                */
+
+#define IS_JSON_SPACE(c)        (( c == ' '  ) || ( c == '\t' ) || \
+                                 ( c == '\r' ) || ( c == '\n' ))
+
+/*  Returns the closing quote of the string whose contents start  */
+/*  at Cursor, or NULL if it isn't closed on this line            */
+
+static inline char* SkipJSONString( char* Cursor, char* End )
 {
-    printf("\nClickHouse TakeHome v0.1\n\n");
-    if ( !ParseArgs( argc, argv )) {
-          PrintHelp();
-          return (1); }
-    
-    SORT_COMPARE_FUNCTION   CompareFunction = NULL;
-    std::vector             <DATA_ITEM*> DataVector;
-    DATA_ITEM*              DataItem        = NULL;
-    FILE*                   DataFile        = NULL;
-    bool                    Status          = false;
-    long                    BeforeLoadTs    = 0;
-    long                    AfterLoadTs     = 0;
-    long                    BatchLinesRead  = 0;
-    long                    BatchesRead     = 0;
-    long                    TotalLinesRead  = 0;
-    
-    CompareFunction = ( ResultSortType == SORT_TYPE_DESCENDING ) ? 
-                        CompareDescending : CompareAscending; 
+    while ( Cursor < End )
+    {
+        Cursor += Kernels->FindQuoteOrEscape( Cursor, End - Cursor );
+        if ( Cursor >= End ) break;
+        if ( *Cursor == '"' ) return ( Cursor );
+        Cursor += 2;    // the escaped byte can't end the string
+    }
 
-    /*  Generate a test data file if requested */
-    if ( GenerateTestDataFile ) { GenerateTestData(
-                                  OutputFileName, 
-                                  NumLinesToGenerate ); 
-                                { printf("\n"); return(0);}}
+    return ( NULL );
+}
 
-    /*  Make sure we have an input file specified */
-    if ( !InputFileName ) {
-        printf("\nIf you want to load an input file, "
-               "please specify: -i <Filename> \n\n");
-        return (1);
+/*  Returns the byte after the value that starts at Cursor, or  */
+/*  NULL if it's cut short.  Objects and arrays are skipped by  */
+/*  counting brackets, minding the strings inside them.         */
+
+static char* SkipJSONValue( char* Cursor, char* End )
+{
+    int     Depth   = 0;
+
+    if ( *Cursor == '"' ) {
+        Cursor = SkipJSONString( Cursor + 1, End );
+        return ( Cursor ? Cursor + 1 : NULL ); }
+
+    if (( *Cursor == '{' ) || ( *Cursor == '[' )) {
+        for ( ; Cursor < End; Cursor += 1 ) {
+            if ( *Cursor == '"' ) {
+                Cursor = SkipJSONString( Cursor + 1, End );
+                if ( !Cursor ) return ( NULL ); }
+            else if (( *Cursor == '{' ) || ( *Cursor == '[' ))
+                Depth += 1;
+            else if ((( *Cursor == '}' ) || ( *Cursor == ']' )) && ( --Depth == 0 ))
+                return ( Cursor + 1 );
+        }
+        return ( NULL );
     }
 
-    /* Attempt to open the input file  */
-    DataFile = fopen( InputFileName, "r" );
-    if ( !DataFile ) {
-        printf("Failed to open input file: %s\n", 
-                InputFileName );
-        goto Failed; }
-    
-    /* Record the time prior to loading file */
-    BeforeLoadTs  =  GetCurrentTimeMs();
-    printf( "Loading data from input file: %s\n", InputFileName );
-    
-    if ( SelectionType == SELECTION_TYPE_RANDOM ) {
-        GenerateAlgorithmR( &DataFile );
-        goto Exit; }
-    
-    /*  Begin loading + processing data in batches */
-    while ( DataFile )
+    /*  A number, true, false or null  */
+    char* Start = Cursor;
+    while (( Cursor < End ) && ( *Cursor != ',' ) && ( *Cursor != '}' ) && 
+           ( *Cursor != ']' ) && ( !IS_JSON_SPACE( *Cursor )))
+        Cursor += 1;
+    return (( Cursor > Start ) ? Cursor : NULL );
+}
+
+/*  Reads the 4 hex digits of a \uXXXX escape, all 4 of them  */
+
+static inline bool ParseJSONHex4( const char* Text, unsigned long* CodePoint )
+{
+    *CodePoint = 0;
+
+    for ( int Digit = 0; Digit < 4; Digit += 1 ) {
+        if ( !isxdigit(( unsigned char ) Text[ Digit ] )) return ( false );
+        *CodePoint = ( *CodePoint << 4 ) | 
+                     ( isdigit(( unsigned char ) Text[ Digit ] ) ? ( Text[ Digit ] - '0' ) :
+                                                                   (( Text[ Digit ] | 0x20 ) - 'a' + 10 )); }
+
+    return ( true );
+}
+
+/*  Decodes the escapes of a JSON string in place.  It can only  */
+/*  get shorter, a \uXXXX of up to 6 bytes becomes at most 3,    */
+/*  and a surrogate pair of 12 becomes 4.  Returns the new       */
+/*  length, or -1 for a bad escape.                              */
+
+static long UnescapeJSONString( char* Data, size_t Length )
+{
+    char*           Read        = Data;
+    char*           Write       = Data;
+    char*           End         = Data + Length;
+    unsigned long   CodePoint   = 0;
+    unsigned long   Low         = 0;
+
+    while ( Read < End )
     {
-        BatchLinesRead = 0;
-        if ( Verbose ) printf("Start of batch. "
-                              "BatchLinesRead = %lu, "
-                              "TotalLinesRead = %lu, "
-                              "DataVector.size() = %lu\n", 
-                               BatchLinesRead, 
-                               TotalLinesRead, 
-                               DataVector.size());
-                               
-        /*  Keep reading more lines until we fill   */
-        /*  DataVector with a BatchSize amount of   */
-        /*  DataItem structs, or if we reached the  */
-        /*  end of file and we get a NULL DataItem  */
-        while (( DataItem = GetNextDataItem( &DataFile )))
+        if ( *Read != '\\' ) {
+            *Write++ = *Read++;
+            continue; }
+
+        if ( Read + 1 >= End ) return ( -1 );
+        Read += 2;
+
+        switch ( Read[-1] )
         {
-            BatchLinesRead += 1;
-            TotalLinesRead += 1;
+            case '"':   *Write++ = '"';     break;
+            case '\\':  *Write++ = '\\';    break;
+            case '/':   *Write++ = '/';     break;
+            case 'b':   *Write++ = '\b';    break;
+            case 'f':   *Write++ = '\f';    break;
+            case 'n':   *Write++ = '\n';    break;
+            case 'r':   *Write++ = '\r';    break;
+            case 't':   *Write++ = '\t';    break;
 
-            /* Add new DATA_ITEM to the DataVector */
-            DataVector.push_back ( DataItem );
+            case 'u':
+                if (( End - Read < 4 ) || ( !ParseJSONHex4( Read, &CodePoint )))
+                    return ( -1 );
+                Read += 4;
 
-            if ( Verbose ) 
-                printf("Finished line. "
-                       " BatchLinesRead = %lu, "
-                       " TotalLinesRead = %lu, "
-                       " DataVector.size() = %lu\n", 
-                       BatchLinesRead, 
-                       TotalLinesRead, 
-                       DataVector.size());
-            
-            /*  We've reached the max batch size  */
-            /*  so break out of loop              */
-            if ( BatchLinesRead == BatchSize )
+                /*  A high surrogate needs the low one after it  */
+                if (( CodePoint >= 0xD800 ) && ( CodePoint <= 0xDBFF )) {
+                    if (( End - Read < 6 ) || ( Read[0] != '\\' ) || ( Read[1] != 'u' ) ||
+                        ( !ParseJSONHex4( Read + 2, &Low )) ||
+                        ( Low < 0xDC00 ) || ( Low > 0xDFFF ))
+                        return ( -1 );
+                    Read     += 6;
+                    CodePoint = 0x10000 + (( CodePoint - 0xD800 ) << 10 ) + ( Low - 0xDC00 ); }
+
+                if ( CodePoint < 0x80 )
+                    *Write++ = CodePoint;
+                else if ( CodePoint < 0x800 ) {
+                    *Write++ = 0xC0 | ( CodePoint >> 6 );
+                    *Write++ = 0x80 | ( CodePoint & 0x3F ); }
+                else if ( CodePoint < 0x10000 ) {
+                    *Write++ = 0xE0 | ( CodePoint >> 12 );
+                    *Write++ = 0x80 | (( CodePoint >> 6 ) & 0x3F );
+                    *Write++ = 0x80 | ( CodePoint & 0x3F ); }
+                else {
+                    *Write++ = 0xF0 | ( CodePoint >> 18 );
+                    *Write++ = 0x80 | (( CodePoint >> 12 ) & 0x3F );
+                    *Write++ = 0x80 | (( CodePoint >> 6 ) & 0x3F );
+                    *Write++ = 0x80 | ( CodePoint & 0x3F ); }
                 break;
-    
-        }  /* End Reading Batch */
-        
-        /*  If we are no longer getting DATA_ITEM   */
-        /*  data then break out of loop             */ 
-        if ( !BatchLinesRead )    
-            break;
-        
-        BatchesRead += 1;
-        
-        printf("\n");
-        printf( "Loaded Batch %lu: "
-                "LinesRead = %lu, "
-                "TotalRead = %lu, "
-                "DataVector.size() = %lu\n", 
-                BatchesRead, 
-                BatchLinesRead, 
-                TotalLinesRead, 
-                DataVector.size());
-        
-        /*  Sort the contents of the data vector which now      */
-        /*  contains the addition of a new batch of data.       */        
-        /*  Use the default sorting mechanism in C++ with       */
-        /*  custom comparator function because our sort key     */
-        /*  is a field in a C struct.                           */
-    
-        /*  It will either the Desc/Asc comparator              */ 
-        /*  using function ptr                                  */
-        
-        sort(   DataVector.begin (), 
-                DataVector.end   (), 
-                CompareFunction  ); 
 
-        printf("Finished Sorting DataVector\n");
-        
-        /*  Now trim the DataVector.                        */
-        /*  Only keep the ResultCount amount of data        */ 
-        /*  in resident Vector memory.                      */
-        /*  Start from the tail, freeing struct memory      */
-        /*  and removing from DataVector.                   */
-        
-        if ( DataVector.size() < ResultCount )
-            ResultCount = DataVector.size();
-        
-        for ( long Index = DataVector.size() - 1; 
-                   Index > ResultCount - 1;
-                   Index -= 1 ){
+            default:
+                return ( -1 );
+        }
+    }
+
+    return ( Write - Data );
+}
+
+
+/*  Parses one line of JSON Lines input: an object with the URL   */
+/*  in the URLFieldName string field and the value in the         */
+/*  ValueFieldName field, a number or a string with a number in   */
+/*  it.  Other fields, nested or not, are skipped over.           */
+
+int ParseJSONLine( char* Line, size_t LineLength, PARSED_LINE* Parsed )
+{
+    char*       Cursor          = Line;
+    char*       LineEnd         = Line + LineLength;
+    char*       Key             = NULL;
+    char*       ValueStart      = NULL;
+    char*       ValueEnd        = NULL;
+    char*       URL             = NULL;
+    char*       URLEnd          = NULL;
+    char*       Value           = NULL;
+    size_t      KeyLength       = 0;
+    size_t      ValueLength     = 0;
+    long        URLLength       = 0;
+    int         Status          = PARSE_OK;
+
+    Parsed -> ExtraColumns      = false;
+    Parsed -> Attributes        = NULL;
+    Parsed -> AttributesLength  = 0;
+
+    #define SKIP_JSON_SPACES()  while (( Cursor < LineEnd ) && ( IS_JSON_SPACE( *Cursor ))) \
+                                    Cursor += 1
+
+    SKIP_JSON_SPACES();
+    if (( Cursor >= LineEnd ) || ( *Cursor != '{' ))
+        return ( PARSE_ERROR_BAD_RECORD );
+    Cursor += 1;
+    SKIP_JSON_SPACES();
+
+    while (( Cursor < LineEnd ) && ( *Cursor != '}' ))
+    {
+        /*  "Key" :  */
+        if ( *Cursor != '"' ) return ( PARSE_ERROR_BAD_RECORD );
+        Key     = Cursor + 1;
+        Cursor  = SkipJSONString( Key, LineEnd );
+        if ( !Cursor ) return ( PARSE_ERROR_BAD_RECORD );
+        KeyLength = Cursor - Key;
+        Cursor += 1;
+
+        SKIP_JSON_SPACES();
+        if (( Cursor >= LineEnd ) || ( *Cursor != ':' ))
+            return ( PARSE_ERROR_BAD_RECORD );
+        Cursor += 1;
+        SKIP_JSON_SPACES();
+        if ( Cursor >= LineEnd ) return ( PARSE_ERROR_BAD_RECORD );
+
+        /*  The value, which we only look into for our fields  */
+        ValueStart  = Cursor;
+        ValueEnd    = SkipJSONValue( Cursor, LineEnd );
+        if ( !ValueEnd ) return ( PARSE_ERROR_BAD_RECORD );
+
+        if (( !URL ) && 
+            ( strncmp( Key, URLFieldName, KeyLength ) == 0 ) && 
+            ( URLFieldName[ KeyLength ] == '\0' )) {
+            if ( *ValueStart != '"' ) return ( PARSE_ERROR_NOT_URL );
+            URL     = ValueStart + 1;
+            URLEnd  = ValueEnd - 1; }
+        else if (( !Value ) && 
+                 ( strncmp( Key, ValueFieldName, KeyLength ) == 0 ) && 
+                 ( ValueFieldName[ KeyLength ] == '\0' )) {
+            Value       = ValueStart;
+            ValueLength = ValueEnd - ValueStart;
+            if ( *Value == '"' ) {
+                Value       += 1;
+                ValueLength -= 2; }
+        }
+
+        Cursor = ValueEnd;
+        SKIP_JSON_SPACES();
+        if (( Cursor < LineEnd ) && ( *Cursor == ',' )) {
+            Cursor += 1;
+            SKIP_JSON_SPACES();
+            if (( Cursor < LineEnd ) && ( *Cursor == '}' ))
+                return ( PARSE_ERROR_BAD_RECORD ); }
+        else if (( Cursor >= LineEnd ) || ( *Cursor != '}' ))
+            return ( PARSE_ERROR_BAD_RECORD );
+    }
+
+    /*  Past the closing brace there can only be spaces  */
+    if ( Cursor >= LineEnd ) return ( PARSE_ERROR_BAD_RECORD );
+    Cursor += 1;
+    SKIP_JSON_SPACES();
+    if ( Cursor < LineEnd ) return ( PARSE_ERROR_BAD_RECORD );
+
+    #undef SKIP_JSON_SPACES
+    if (( !URL ) || ( !Value )) return ( PARSE_ERROR_MISSING_COLUMN );
+
+    /*  The object has been walked, so the URL can now be  */
+    /*  unescaped and NUL-terminated where it is           */
+    URLLength = URLEnd - URL;
+    if ( memchr( URL, '\\', URLLength ))
+        URLLength = UnescapeJSONString( URL, URLLength );
+    if ( URLLength < 0 ) return ( PARSE_ERROR_BAD_RECORD );
+    URL[ URLLength ] = '\0';
+
+    Parsed->URL         = URL;
+    Parsed->URLLength   = URLLength;
+    Status = ParseURLColumn( Parsed );
+    if ( UNLIKELY( Status != PARSE_OK ))
+        return ( Status );
+
+    return ( ParseRecordValue( Value, ValueLength, Parsed ));
+}
+
+
+/*  Parses the value of a JSON or access log record, which isn't  */
+/*  NUL-terminated, so it is copied out first.  It is $2 of a     */
+/*  --rank-by expression.                                         */
+
+static int ParseRecordValue( const char* Value, size_t ValueLength, PARSED_LINE* Parsed )
+{
+    char        ValueToken      [ 64 ];
+
+    if ( ValueLength >= sizeof( ValueToken ))
+        return ( PARSE_ERROR_BAD_VALUE );
+    memcpy( ValueToken, Value, ValueLength );
+    ValueToken[ ValueLength ] = '\0';
+
+    if ( RankExpression ) {
+        Parsed->Columns[ EXPRESSION_URL_LENGTH ] = Parsed->URLLength;
+        return ( ParseExpressionColumn( ValueToken, 2, Parsed )); }
+
+    return ( ParseValueFunction( ValueToken, &Parsed->LongValue, &Parsed->HighValue ));
+}
+
+
+/*  Reads exactly Count decimal digits, no signs or spaces  */
+
+static inline bool ParseFixedDigits( const char* Text, int Count, long* Value )
+{
+    *Value = 0;
+
+    for ( int Digit = 0; Digit < Count; Digit += 1 ) {
+        if (( Text[ Digit ] < '0' ) || ( Text[ Digit ] > '9' )) return ( false );
+        *Value = ( *Value * 10 ) + ( Text[ Digit ] - '0' ); }
+
+    return ( true );
+}
+
+
+/*  Converts an access log timestamp, 10/Oct/2000:13:55:36 -0700,  */
+/*  to seconds since the epoch.  Returns false if it isn't one,    */
+/*  including fields out of range like the 31st of April.          */
+
+static bool ParseLogTimestamp( const char* Time, size_t Length, long* Seconds )
+{
+    static const char   Months[]    = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static const int    MonthDays[] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    const char*         Month       = NULL;
+    long                Day, Year, Hour, Minute, Second, ZoneHours, ZoneMinutes, Zone;
+    long                Era, YearOfEra, DayOfYear, DayOfEra, Days;
+    char                MonthName   [ 4 ] = { 0 };
+
+    if (( Length != 26 ) ||
+        ( Time[2] != '/' ) || ( Time[6] != '/' ) || ( Time[11] != ':' ) ||
+        ( Time[14] != ':' ) || ( Time[17] != ':' ) || ( Time[20] != ' ' ) ||
+        (( Time[21] != '+' ) && ( Time[21] != '-' )) ||
+        ( !ParseFixedDigits( Time,      2, &Day         )) ||
+        ( !ParseFixedDigits( Time + 7,  4, &Year        )) ||
+        ( !ParseFixedDigits( Time + 12, 2, &Hour        )) ||
+        ( !ParseFixedDigits( Time + 15, 2, &Minute      )) ||
+        ( !ParseFixedDigits( Time + 18, 2, &Second      )) ||
+        ( !ParseFixedDigits( Time + 22, 2, &ZoneHours   )) ||
+        ( !ParseFixedDigits( Time + 24, 2, &ZoneMinutes )))
+        return ( false );
+
+    memcpy( MonthName, Time + 3, 3 );
+    if (( !( Month = strstr( Months, MonthName ))) ||
+        (( Month - Months ) % 3 ))
+        return ( false );
+
+    long MonthIndex = ( Month - Months ) / 3 + 1;
+
+    /*  Second 60 is a leap second  */
+    if (( Day < 1 ) || ( Day > MonthDays[ MonthIndex - 1 ] ) ||
+        (( MonthIndex == 2 ) && ( Day == 29 ) &&
+         (( Year % 4 ) || ((( Year % 100 ) == 0 ) && ( Year % 400 )))) ||
+        ( Hour > 23 ) || ( Minute > 59 ) || ( Second > 60 ) ||
+        ( ZoneHours > 23 ) || ( ZoneMinutes > 59 ))
+        return ( false );
+
+    /*  Days since 1970-01-01 of the civil date, with March as  */
+    /*  the first month so the leap day is the last of a year   */
+    Year       -= ( MonthIndex <= 2 );
+    Era         = ( Year >= 0 ? Year : Year - 399 ) / 400;
+    YearOfEra   = Year - Era * 400;
+    DayOfYear   = ( 153 * ( MonthIndex + ( MonthIndex > 2 ? -3 : 9 )) + 2 ) / 5 + Day - 1;
+    DayOfEra    = YearOfEra * 365 + YearOfEra / 4 - YearOfEra / 100 + DayOfYear;
+    Days        = Era * 146097 + DayOfEra - 719468;
+
+    /*  The zone is +hhmm  */
+    Zone        = ( ZoneHours * 3600 + ZoneMinutes * 60 ) * (( Time[21] == '-' ) ? -1 : 1 );
+    *Seconds    = Days * 86400 + Hour * 3600 + Minute * 60 + Second - Zone;
+    return ( true );
+}
+
+
+/*  Parses one line of an nginx / Apache access log, in the       */
+/*  combined format (or the common one, which stops after the     */
+/*  bytes):                                                       */
+/*                                                                */
+/*    host ident user [time] "METHOD /path PROTOCOL" status bytes */
+/*    "referer" "user agent"                                      */
+/*                                                                */
+/*  The request path is the URL, and the value is the bytes, the  */
+/*  status or the time, picked with --value-field.  The quoted    */
+/*  request is skipped like a JSON string, since nginx escapes    */
+/*  its quotes with a backslash, and the fields after the bytes   */
+/*  aren't looked at.                                             */
+
+int ParseCombinedLogLine( char* Line, size_t LineLength, PARSED_LINE* Parsed )
+{
+    char*       Cursor          = Line;
+    char*       LineEnd         = Line + LineLength;
+    char*       Time            = NULL;
+    char*       TimeEnd         = NULL;
+    char*       Request         = NULL;
+    char*       RequestEnd      = NULL;
+    char*       Path            = NULL;
+    char*       PathEnd         = NULL;
+    char*       Field           [ COMBINED_FIELD_COUNT ] = { NULL };
+    size_t      FieldLength     [ COMBINED_FIELD_COUNT ] = { 0 };
+    long        Seconds         = 0;
+    int         Status          = PARSE_OK;
+    char        TimeToken       [ 24 ];
+
+    Parsed -> ExtraColumns      = false;
+    Parsed -> Attributes        = NULL;
+    Parsed -> AttributesLength  = 0;
+
+    #define SKIP_LOG_SPACES()   while (( Cursor < LineEnd ) && ( *Cursor == ' ' )) \
+                                    Cursor += 1
+
+    /*  host, ident and user  */
+    for ( int Column = 0; Column < 3; Column += 1 ) {
+        SKIP_LOG_SPACES();
+        if ( Cursor >= LineEnd ) return ( PARSE_ERROR_MISSING_COLUMN );
+        Cursor += Kernels->FindDelimiter( Cursor, LineEnd - Cursor ); }
+
+    /*  [time]  */
+    SKIP_LOG_SPACES();
+    if (( Cursor >= LineEnd ) || ( *Cursor != '[' ))
+        return ( PARSE_ERROR_BAD_RECORD );
+    Time    = Cursor + 1;
+    TimeEnd = ( char* ) memchr( Time, ']', LineEnd - Time );
+    if ( !TimeEnd ) return ( PARSE_ERROR_BAD_RECORD );
+    Cursor  = TimeEnd + 1;
+
+    /*  "request"  */
+    SKIP_LOG_SPACES();
+    if (( Cursor >= LineEnd ) || ( *Cursor != '"' ))
+        return ( PARSE_ERROR_BAD_RECORD );
+    Request     = Cursor + 1;
+    RequestEnd  = SkipJSONString( Request, LineEnd );
+    if ( !RequestEnd ) return ( PARSE_ERROR_BAD_RECORD );
+    Cursor      = RequestEnd + 1;
+
+    /*  status, then bytes  */
+    for ( int Slot : { COMBINED_FIELD_STATUS, COMBINED_FIELD_BYTES } ) {
+        SKIP_LOG_SPACES();
+        Field[ Slot ]       = Cursor;
+        Cursor             += Kernels->FindDelimiter( Cursor, LineEnd - Cursor );
+        FieldLength[ Slot ] = Cursor - Field[ Slot ];
+        if ( !FieldLength[ Slot ] ) return ( PARSE_ERROR_MISSING_COLUMN ); }
+
+    #undef SKIP_LOG_SPACES
+
+    /*  The path is between the method and the protocol, which  */
+    /*  HTTP/0.9 requests don't have                            */
+    Path = ( char* ) memchr( Request, ' ', RequestEnd - Request );
+    if ( !Path ) return ( PARSE_ERROR_BAD_RECORD );
+    Path   += 1;
+    PathEnd = ( char* ) memchr( Path, ' ', RequestEnd - Path );
+    if ( !PathEnd ) PathEnd = RequestEnd;
+
+    *PathEnd            = '\0';
+    Parsed->URL         = Path;
+    Parsed->URLLength   = PathEnd - Path;
+    Status = ParseURLColumn( Parsed );
+    if ( UNLIKELY( Status != PARSE_OK ))
+        return ( Status );
+
+    /*  A response without a body logs its bytes as "-"  */
+    if (( FieldLength[ COMBINED_FIELD_BYTES ] == 1 ) && ( *Field[ COMBINED_FIELD_BYTES ] == '-' ))
+        Field[ COMBINED_FIELD_BYTES ] = ( char* ) "0";
+
+    if ( CombinedValueField == COMBINED_FIELD_TIME ) {
+        if ( !ParseLogTimestamp( Time, TimeEnd - Time, &Seconds ))
+            return ( PARSE_ERROR_BAD_VALUE );
+        Field[ COMBINED_FIELD_TIME ]        = TimeToken;
+        FieldLength[ COMBINED_FIELD_TIME ]  = snprintf( TimeToken, sizeof( TimeToken ), 
+                                                        "%ld", Seconds ); }
+
+    return ( ParseRecordValue( Field[ CombinedValueField ], 
+                               FieldLength[ CombinedValueField ], 
+                               Parsed ));
+}
+
+
+/*  Parses an input column of the --rank-by expression as a  */
+/*  double, if the expression uses it                        */
+
+static int ParseExpressionColumn( const char* Token, int Column, PARSED_LINE* Parsed )
+{
+    char*   EndPtr  = NULL;
+
+    if ( !( RankExpression->ColumnMask & ( 1u << Column )))
+        return ( PARSE_OK );
+
+    Parsed->Columns[ Column ] = strtod( Token, &EndPtr );
+
+    if ( UNLIKELY(( EndPtr == Token ) || ( *EndPtr != '\0' )))
+        return ( PARSE_ERROR_BAD_VALUE );
+
+    return ( PARSE_OK );
+}
+
+
+/*  Order-preserving key of a double, see ParseValue() below  */
+
+static inline long EncodeDoubleKey( double Double )
+{
+    const unsigned long     TopBit  = 0x8000000000000000UL;
+    unsigned long           Bits    = 0;
+
+    memcpy( &Bits, &Double, sizeof( Bits ));
+    Bits = ( Bits & TopBit ) ? ~Bits : ( Bits | TopBit );
+    return (( long )( Bits ^ TopBit ));
+}
+
+
+/*  Accumulates decimal digits into an unsigned integer,  */
+/*  checking for overflow, and advances Cursor past them  */
+
+template <typename UNSIGNED>
+static inline int ParseDigits( const char** Cursor, UNSIGNED* Value, int* DigitCount )
+{
+    UNSIGNED        Result  = *Value;
+    const char*     Digit   = *Cursor;
+
+    while (( *Digit >= '0' ) && ( *Digit <= '9' )) {
+        if ( UNLIKELY( __builtin_mul_overflow( Result, 10, &Result ) ||
+                       __builtin_add_overflow( Result, *Digit - '0', &Result )))
+            return ( PARSE_ERROR_VALUE_RANGE );
+        Digit += 1;
+    }
+
+    *DigitCount = Digit - *Cursor;
+    *Cursor     = Digit;
+    *Value      = Result;
+    return ( PARSE_OK );
+}
+
+
+/*  Converts a NUL-terminated value token into its order-preserving  */
+/*  key, for the value type TYPE.  After the encoding, comparing     */
+/*  the keys as signed longs (HighValue first, for i128) gives the   */
+/*  same order as comparing the values:                              */
+/*    i64       the value itself                                     */
+/*    u64       the value with its top bit flipped                   */
+/*    f64       the IEEE bits, all flipped for negative numbers,     */
+/*              only the sign bit flipped otherwise, then the top    */
+/*              bit flipped again to compare as signed               */
+/*    i128      the high half signed, and the low half with its top  */
+/*              bit flipped                                          */
+/*    decimal   the value times 10^DecimalScale, as an i64           */
+/*  Trailing garbage like "12abc" is rejected for every type, and    */
+/*  so are f64 values that overflow to infinity, or are infinite.    */
+
+template <int TYPE>
+int ParseValue( const char* Token, long* LongValue, long* HighValue )
+{
+    const unsigned long     TopBit      = 0x8000000000000000UL;
+    const char*             Cursor      = Token;
+    bool                    Negative    = false;
+    int                     DigitCount  = 0;
+    int                     Status      = PARSE_OK;
+
+    *HighValue = 0;
+
+    if constexpr ( TYPE == VALUE_TYPE_F64 )
+    {
+        char*   EndPtr  = NULL;
+        double  Double  = 0;
+
+        errno  = 0;
+        Double = strtod( Token, &EndPtr );
+
+        if ( UNLIKELY(( EndPtr == Token ) || ( *EndPtr != '\0' ) || 
+                      ( Double != Double )))
+            return ( PARSE_ERROR_BAD_VALUE );
+
+        /*  Overflow comes back as +-inf, like "inf" itself  */
+        if ( UNLIKELY( !std::isfinite( Double )))
+            return (( errno == ERANGE ) ? PARSE_ERROR_VALUE_RANGE : PARSE_ERROR_BAD_VALUE );
+
+        *LongValue = EncodeDoubleKey( Double );
+        return ( PARSE_OK );
+    }
+    else
+    {
+        if (( *Cursor == '-' ) && ( TYPE != VALUE_TYPE_U64 )) {
+            Negative = true;
+            Cursor += 1; }
+        else if ( *Cursor == '+' )
+            Cursor += 1;
+
+        if constexpr ( TYPE == VALUE_TYPE_I128 )
+        {
+            unsigned __int128   Magnitude   = 0;
+            const unsigned __int128 Limit   = (( unsigned __int128 ) 1 ) << 127;
+
+            Status = ParseDigits( &Cursor, &Magnitude, &DigitCount );
+            if ( UNLIKELY( Status != PARSE_OK )) return ( Status );
+            if ( UNLIKELY(( DigitCount == 0 ) || ( *Cursor != '\0' )))
+                return ( PARSE_ERROR_BAD_VALUE );
+            if ( UNLIKELY( Magnitude > ( Negative ? Limit : Limit - 1 )))
+                return ( PARSE_ERROR_VALUE_RANGE );
+
+            unsigned __int128 Value = Negative ? ( 0 - Magnitude ) : Magnitude;
+            *HighValue = ( long )( unsigned long )( Value >> 64 );
+            *LongValue = ( long )(( unsigned long ) Value ^ TopBit );
+            return ( PARSE_OK );
+        }
+        else
+        {
+            unsigned long   Magnitude   = 0;
+
+            Status = ParseDigits( &Cursor, &Magnitude, &DigitCount );
+            if ( UNLIKELY( Status != PARSE_OK )) return ( Status );
+
+            /*  Fixed point: scale up the integer digits, and take  */
+            /*  up to DecimalScale digits after the point           */
+            if constexpr ( TYPE == VALUE_TYPE_DECIMAL )
+            {
+                int FractionDigits = 0;
+
+                if ( *Cursor == '.' ) {
+                    Cursor += 1;
+                    while (( *Cursor >= '0' ) && ( *Cursor <= '9' ) &&
+                           ( FractionDigits < DecimalScale )) {
+                        if ( UNLIKELY( __builtin_mul_overflow( Magnitude, 10, &Magnitude ) ||
+                                       __builtin_add_overflow( Magnitude, *Cursor - '0', &Magnitude )))
+                            return ( PARSE_ERROR_VALUE_RANGE );
+                        FractionDigits += 1;
+                        DigitCount += 1;
+                        Cursor += 1;
+                    }
+
+                    /*  More precision than the scale can hold is  */
+                    /*  only accepted if it's trailing zeroes      */
+                    while ( *Cursor == '0' ) Cursor += 1;
+                    if ( UNLIKELY(( *Cursor >= '1' ) && ( *Cursor <= '9' )))
+                        return ( PARSE_ERROR_VALUE_RANGE );
+                }
+
+                for ( ; FractionDigits < DecimalScale; FractionDigits += 1 )
+                    if ( UNLIKELY( __builtin_mul_overflow( Magnitude, 10, &Magnitude )))
+                        return ( PARSE_ERROR_VALUE_RANGE );
+            }
+
+            if ( UNLIKELY(( DigitCount == 0 ) || ( *Cursor != '\0' )))
+                return ( PARSE_ERROR_BAD_VALUE );
+
+            if constexpr ( TYPE == VALUE_TYPE_U64 ) {
+                *LongValue = ( long )( Magnitude ^ TopBit );
+                return ( PARSE_OK ); }
+
+            if ( UNLIKELY( Magnitude > ( Negative ? TopBit : TopBit - 1 )))
+                return ( PARSE_ERROR_VALUE_RANGE );
+
+            *LongValue = Negative ? ( long )( 0 - Magnitude ) : ( long ) Magnitude;
+            return ( PARSE_OK );
+        }
+    }
+}
+
+
+/*  Recursive descent compiler for --rank-by expressions:      */
+/*                                                             */
+/*    Expression  := Term   (( '+' | '-' ) Term )*             */
+/*    Term        := Unary  (( '*' | '/' ) Unary )*            */
+/*    Unary       := '-' Unary | Primary                       */
+/*    Primary     := Number | '$' Digit | "value" |            */
+/*                   "url_length" | "len(url)" |               */
+/*                   '(' Expression ')'                        */
+/*                                                             */
+/*  It emits the ops in postfix order, tracking the stack      */
+/*  depth so the evaluator knows how many arrays it needs.     */
+
+typedef struct _EXPRESSION_COMPILER
+{
+    const char*     Text;
+    const char*     Cursor;
+    EXPRESSION*     Expression;
+    int             Depth;
+    bool            Failed;
+}   EXPRESSION_COMPILER;
+
+static bool CompileExpressionPart( EXPRESSION_COMPILER* Compiler );
+
+static void EmitExpressionOp( EXPRESSION_COMPILER* Compiler, 
+                              int Code, int Column, double Constant )
+{
+    EXPRESSION*     Expression  = Compiler->Expression;
+
+    if ( Expression->OpCount >= EXPRESSION_MAX_OPS ) {
+        Compiler->Failed = true;
+        return; }
+
+    Expression->Ops[ Expression->OpCount ].Code       = Code;
+    Expression->Ops[ Expression->OpCount ].Column     = Column;
+    Expression->Ops[ Expression->OpCount ].Constant   = Constant;
+    Expression->OpCount += 1;
+
+    /*  Operands push, binary operators pop one  */
+    if (( Code == EXPRESSION_OP_COLUMN ) || ( Code == EXPRESSION_OP_CONSTANT ))
+        Compiler->Depth += 1;
+    else if ( Code != EXPRESSION_OP_NEGATE )
+        Compiler->Depth -= 1;
+
+    if ( Compiler->Depth > EXPRESSION_MAX_STACK )
+        Compiler->Failed = true;
+
+    Expression->StackDepth = std::max( Expression->StackDepth, Compiler->Depth );
+}
+
+static void SkipExpressionSpaces( EXPRESSION_COMPILER* Compiler )
+{
+    while (( *Compiler->Cursor == ' ' ) || ( *Compiler->Cursor == '\t' ))
+        Compiler->Cursor += 1;
+}
+
+static bool CompileExpressionPrimary( EXPRESSION_COMPILER* Compiler )
+{
+    const char*     Cursor      = NULL;
+    char*           EndPtr      = NULL;
+    int             Column      = 0;
+
+    SkipExpressionSpaces( Compiler );
+    Cursor = Compiler->Cursor;
+
+    if ( *Cursor == '(' ) {
+        Compiler->Cursor += 1;
+        if ( !CompileExpressionPart( Compiler )) return ( false );
+        SkipExpressionSpaces( Compiler );
+        if ( *Compiler->Cursor != ')' ) return ( false );
+        Compiler->Cursor += 1;
+        return ( true ); }
+
+    if (( *Cursor == '$' ) && ( Cursor[1] >= '2' ) && ( Cursor[1] <= '9' )) {
+        Column = Cursor[1] - '0';
+        Compiler->Cursor += 2; }
+    else if ( strncmp( Cursor, "value", 5 ) == 0 ) {
+        Column = 2;
+        Compiler->Cursor += 5; }
+    else if ( strncmp( Cursor, "url_length", 10 ) == 0 ) {
+        Column = EXPRESSION_URL_LENGTH;
+        Compiler->Cursor += 10; }
+    else if ( strncmp( Cursor, "len(url)", 8 ) == 0 ) {
+        Column = EXPRESSION_URL_LENGTH;
+        Compiler->Cursor += 8; }
+    else {
+        double Constant = strtod( Cursor, &EndPtr );
+        if ( EndPtr == Cursor ) return ( false );
+        Compiler->Cursor = EndPtr;
+        EmitExpressionOp( Compiler, EXPRESSION_OP_CONSTANT, 0, Constant );
+        return ( true ); }
+
+    Compiler->Expression->ColumnMask |= ( 1u << Column );
+    Compiler->Expression->MaxColumn   = std::max( Compiler->Expression->MaxColumn, Column );
+    EmitExpressionOp( Compiler, EXPRESSION_OP_COLUMN, Column, 0 );
+    return ( true );
+}
+
+static bool CompileExpressionUnary( EXPRESSION_COMPILER* Compiler )
+{
+    SkipExpressionSpaces( Compiler );
+
+    if ( *Compiler->Cursor == '-' ) {
+        Compiler->Cursor += 1;
+        if ( !CompileExpressionUnary( Compiler )) return ( false );
+        EmitExpressionOp( Compiler, EXPRESSION_OP_NEGATE, 0, 0 );
+        return ( true ); }
+
+    return ( CompileExpressionPrimary( Compiler ));
+}
+
+static bool CompileExpressionTerm( EXPRESSION_COMPILER* Compiler )
+{
+    if ( !CompileExpressionUnary( Compiler )) return ( false );
+
+    while ( true ) {
+        SkipExpressionSpaces( Compiler );
+        char Operator = *Compiler->Cursor;
+        if (( Operator != '*' ) && ( Operator != '/' )) return ( true );
+
+        Compiler->Cursor += 1;
+        if ( !CompileExpressionUnary( Compiler )) return ( false );
+        EmitExpressionOp( Compiler, ( Operator == '*' ) ? EXPRESSION_OP_MULTIPLY :
+                                                          EXPRESSION_OP_DIVIDE, 0, 0 );
+    }
+}
+
+static bool CompileExpressionPart( EXPRESSION_COMPILER* Compiler )
+{
+    if ( !CompileExpressionTerm( Compiler )) return ( false );
+
+    while ( true ) {
+        SkipExpressionSpaces( Compiler );
+        char Operator = *Compiler->Cursor;
+        if (( Operator != '+' ) && ( Operator != '-' )) return ( true );
+
+        Compiler->Cursor += 1;
+        if ( !CompileExpressionTerm( Compiler )) return ( false );
+        EmitExpressionOp( Compiler, ( Operator == '+' ) ? EXPRESSION_OP_ADD :
+                                                          EXPRESSION_OP_SUBTRACT, 0, 0 );
+    }
+}
+
+EXPRESSION* CompileExpression( const char* Text )
+{
+    EXPRESSION_COMPILER     Compiler;
+    EXPRESSION*             Expression  = ( EXPRESSION* ) calloc( 1, sizeof( EXPRESSION ));
+
+    if ( !Expression ) return ( NULL );
+
+    Compiler.Text       = Text;
+    Compiler.Cursor     = Text;
+    Compiler.Expression = Expression;
+    Compiler.Depth      = 0;
+    Compiler.Failed     = false;
+
+    /*  The value column is always required, even if unused  */
+    Expression->MaxColumn = 2;
+
+    if (( !CompileExpressionPart( &Compiler )) || ( Compiler.Failed ) ||
+        ( SkipExpressionSpaces( &Compiler ), *Compiler.Cursor != '\0' )) {
+        printf("\nInvalid --rank-by expression at position %ld: %s\n\n",
+                (long)( Compiler.Cursor - Text ), Text );
+        free( Expression );
+        return ( NULL ); }
+
+    if ( Verbose )
+        printf("Compiled --rank-by expression into %d ops, stack depth %d\n",
+                Expression->OpCount, Expression->StackDepth );
+
+    return ( Expression );
+}
+
+
+/*  Runs the --rank-by program over a block of lines, using   */
+/*  the input columns ReadRecordBlock() parsed.  Each op is   */
+/*  one loop over the whole block.  The results become the    */
+/*  rows' keys, and rows with a NaN result are marked as      */
+/*  malformed.  Returns how many were.                        */
+
+long EvaluateExpressionBlock( RECORD_BLOCK* Block )
+{
+    static std::vector<double>  Stack   [ EXPRESSION_MAX_STACK ];
+
+    size_t      Rows        = Block->RowCount;
+    int         Top         = -1;
+    long        Dropped     = 0;
+
+    for ( int Level = 0; Level < RankExpression->StackDepth; Level += 1 )
+        Stack[ Level ].resize( Rows );
+
+    for ( int Op = 0; Op < RankExpression->OpCount; Op += 1 )
+    {
+        EXPRESSION_OP*  Instruction = &RankExpression->Ops[ Op ];
+        double*         Target      = NULL;
+        const double*   Source      = NULL;
+
+        switch ( Instruction->Code )
+        {
+            case EXPRESSION_OP_COLUMN:
+                Top += 1;
+                memcpy( Stack[Top].data(), 
+                        Block->Columns[ Instruction->Column ].data(),
+                        Rows * sizeof( double ));
+                break;
+
+            case EXPRESSION_OP_CONSTANT:
+                Top += 1;
+                Target = Stack[Top].data();
+                for ( size_t Row = 0; Row < Rows; Row += 1 )
+                    Target[Row] = Instruction->Constant;
+                break;
+
+            case EXPRESSION_OP_NEGATE:
+                Target = Stack[Top].data();
+                for ( size_t Row = 0; Row < Rows; Row += 1 )
+                    Target[Row] = -Target[Row];
+                break;
+
+            default:
+                Source = Stack[Top].data();
+                Top   -= 1;
+                Target = Stack[Top].data();
+
+                if ( Instruction->Code == EXPRESSION_OP_ADD )
+                    for ( size_t Row = 0; Row < Rows; Row += 1 )
+                        Target[Row] += Source[Row];
+                else if ( Instruction->Code == EXPRESSION_OP_SUBTRACT )
+                    for ( size_t Row = 0; Row < Rows; Row += 1 )
+                        Target[Row] -= Source[Row];
+                else if ( Instruction->Code == EXPRESSION_OP_MULTIPLY )
+                    for ( size_t Row = 0; Row < Rows; Row += 1 )
+                        Target[Row] *= Source[Row];
+                else
+                    for ( size_t Row = 0; Row < Rows; Row += 1 )
+                        Target[Row] /= Source[Row];
+                break;
+        }
+    }
+
+    /*  Store the keys of the rows that parsed  */
+    for ( size_t Row = 0; Row < Rows; Row += 1 )
+    {
+        double      Result  = Stack[0][Row];
+
+        if ( Block->Status[Row] != PARSE_OK ) continue;
+
+        if ( UNLIKELY( Result != Result )) {
+            Block->Status[Row] = PARSE_ERROR_EXPRESSION_NAN;
+            Dropped += 1;
+            continue; }
+
+        Block->LongValues[Row] = EncodeDoubleKey( Result );
+        Block->HighValues[Row] = 0;
+    }
+
+    ParseErrorCounts[ PARSE_ERROR_EXPRESSION_NAN ] += Dropped;
+    return ( Dropped );
+}
+
+
+/*  Decodes the key of an f64 value, see EncodeDoubleKey()  */
+
+static inline double DecodeDoubleKey( long LongValue )
+{
+    const unsigned long     TopBit  = 0x8000000000000000UL;
+    unsigned long           Bits    = ( unsigned long ) LongValue ^ TopBit;
+    double                  Double  = 0;
+
+    Bits = ( Bits & TopBit ) ? ( Bits & ~TopBit ) : ~Bits;
+    memcpy( &Double, &Bits, sizeof( Double ));
+    return ( Double );
+}
+
+/*  Decodes the key of an integer or decimal value.  The i64   */
+/*  and decimal keys are the values themselves, the u64 and    */
+/*  i128 ones have the top bit of the low half flipped.        */
+
+static inline __int128 DecodeIntegerKey( long LongValue, long HighValue )
+{
+    const unsigned long     TopBit  = 0x8000000000000000UL;
+
+    if (( ValueType == VALUE_TYPE_I64 ) || ( ValueType == VALUE_TYPE_DECIMAL ))
+        return ( LongValue );
+
+    return (( __int128 )(((( unsigned __int128 )( unsigned long ) HighValue ) << 64 ) |
+                         (( unsigned long ) LongValue ^ TopBit )));
+}
+
+/*  Prints a 128-bit integer, with a decimal point Scale  */
+/*  digits from the right if Scale isn't 0                */
+
+static void FormatInteger128( __int128 Value, long Scale, 
+                              char* Buffer, size_t BufferSize )
+{
+    unsigned __int128   Magnitude   = ( Value < 0 ) ? 0 - ( unsigned __int128 ) Value :
+                                                      ( unsigned __int128 ) Value;
+    char                Digits      [ 64 ];
+    int                 Count       = 0;
+
+    do {
+        Digits[ Count++ ] = '0' + ( int )( Magnitude % 10 );
+        Magnitude /= 10;
+    } while (( Magnitude ) || ( Count <= Scale ));
+
+    if (( Value < 0 ) && ( BufferSize > 1 )) {
+        *Buffer++ = '-';
+        BufferSize -= 1; }
+    for ( ; ( Count > 0 ) && ( BufferSize > 1 ); BufferSize -= 1 ) {
+        if (( Count == Scale ) && ( BufferSize > 2 )) {
+            *Buffer++ = '.';
+            BufferSize -= 1; }
+        *Buffer++ = Digits[ --Count ]; }
+    *Buffer = '\0';
+}
+
+/*  Adds one value to the running totals.  This is called for   */
+/*  every line that makes it past the parser and filters, so it */
+/*  is kept to a few integer ops and two floating point adds,   */
+/*  the divisions wait until the totals are printed.            */
+
+static inline void AccumulateValue( VALUE_TOTALS* Totals, long LongValue, long HighValue )
+{
+    DATA_ITEM   Item;
+    double      Value   = 0;
+    double      Delta   = 0;
+
+    Item.LongValue = LongValue;
+    Item.HighValue = HighValue;
+
+    if ( UNLIKELY( Totals->Count == 0 ))
+        Totals->Min = Totals->Max = Item;
+    else if ( CompareAscending128( &Item, &Totals->Min ))
+        Totals->Min = Item;
+    else if ( CompareAscending128( &Totals->Max, &Item ))
+        Totals->Max = Item;
+
+    if ( ValueType == VALUE_TYPE_F64 ) {
+        Value = DecodeDoubleKey( LongValue );
+        Totals->FloatSum += Value; }
+    else {
+        __int128 Integer = DecodeIntegerKey( LongValue, HighValue );
+        if ( UNLIKELY( __builtin_add_overflow( Totals->Sum, Integer, &Totals->Sum )))
+            Totals->SumOverflow = true;
+        Value = ( double ) Integer; }
+
+    if ( UNLIKELY( Totals->Count == 0 ))
+        Totals->Shift = Value;
+
+    Totals->Count          += 1;
+    Delta                   = Value - Totals->Shift;
+    Totals->ShiftedSum     += Delta;
+    Totals->ShiftedSquares += Delta * Delta;
+}
+
+/*  Share of one result's value in the total, in percent  */
+
+static double GetShareOfTotal( VALUE_TOTALS* Totals, DATA_ITEM* Item )
+{
+    double  Sum     = 0;
+    double  Value   = 0;
+
+    if ( ValueType == VALUE_TYPE_F64 ) {
+        Sum   = Totals->FloatSum;
+        Value = DecodeDoubleKey( Item->LongValue ); }
+    else {
+        Sum   = ( double ) Totals->Sum;
+        Value = ( double ) DecodeIntegerKey( Item->LongValue, Item->HighValue ); }
+
+    return (( Sum != 0 ) ? ( 100.0 * Value / Sum ) : 0 );
+}
+
+void PrintValueTotals( VALUE_TOTALS* Totals )
+{
+    char    Min     [ 64 ];
+    char    Max     [ 64 ];
+    char    Sum     [ 64 ];
+    double  Unit    = 1;
+    double  Mean    = 0;
+    double  Squares = 0;
+
+    if ( !Totals->Count ) return;
+
+    Mean    = Totals->Shift + ( Totals->ShiftedSum / Totals->Count );
+    Squares = Totals->ShiftedSquares - 
+              ( Totals->ShiftedSum * Totals->ShiftedSum / Totals->Count );
+
+    FormatValue( &Totals->Min, Min, sizeof( Min ));
+    FormatValue( &Totals->Max, Max, sizeof( Max ));
+
+    if ( ValueType == VALUE_TYPE_F64 )
+        snprintf( Sum, sizeof( Sum ), "%.17g", Totals->FloatSum );
+    else if ( Totals->SumOverflow )
+        snprintf( Sum, sizeof( Sum ), "overflow" );
+    else
+        FormatInteger128( Totals->Sum, 
+                          ( ValueType == VALUE_TYPE_DECIMAL ) ? DecimalScale : 0,
+                          Sum, sizeof( Sum ));
+
+    /*  Decimal values are added up scaled to integers  */
+    if ( ValueType == VALUE_TYPE_DECIMAL )
+        for ( long Digit = 0; Digit < DecimalScale; Digit += 1 )
+            Unit *= 10;
+
+    printf( "\nTotals: Count=%ld  Sum=%s  Min=%s  Max=%s  Mean=%.6g  Variance=%.6g\n",
+            Totals->Count, Sum, Min, Max,
+            Mean / Unit,
+            ( Totals->Count > 1 ) ? std::max( 0.0, Squares ) / ( Totals->Count - 1 ) / 
+                                    ( Unit * Unit ) : 0.0 );
+}
+
+
+/*  Decodes the order-preserving key of an item back into its  */
+/*  value, as text.  Only used when printing, so it's fine to  */
+/*  switch on the type here.                                   */
+
+void FormatValue( DATA_ITEM* Item, char* Buffer, size_t BufferSize )
+{
+    const unsigned long     TopBit  = 0x8000000000000000UL;
+    unsigned long           Bits    = ( unsigned long ) Item->LongValue;
+
+    switch ( ValueType )
+    {
+        case VALUE_TYPE_U64:
+            snprintf( Buffer, BufferSize, "%lu", Bits ^ TopBit );
+            break;
+
+        case VALUE_TYPE_F64: {
+            double  Double  = DecodeDoubleKey( Item->LongValue );
+
+            /*  Shortest of these that reads back the same  */
+            snprintf( Buffer, BufferSize, "%.15g", Double );
+            if ( strtod( Buffer, NULL ) != Double )
+                snprintf( Buffer, BufferSize, "%.17g", Double );
+            break; }
+
+        case VALUE_TYPE_I128:
+            FormatInteger128( DecodeIntegerKey( Item->LongValue, Item->HighValue ),
+                              0, Buffer, BufferSize );
+            break;
+
+        case VALUE_TYPE_DECIMAL: {
+            unsigned long   Divisor     = 1;
+            unsigned long   Magnitude   = ( Item->LongValue < 0 ) ? 
+                                          ( 0 - Bits ) : Bits;
+
+            for ( long Digit = 0; Digit < DecimalScale; Digit += 1 )
+                Divisor *= 10;
+
+            if ( DecimalScale > 0 )
+                snprintf( Buffer, BufferSize, "%s%lu.%0*lu",
+                          ( Item->LongValue < 0 ) ? "-" : "",
+                          Magnitude / Divisor, 
+                          ( int ) DecimalScale, 
+                          Magnitude % Divisor );
+            else
+                snprintf( Buffer, BufferSize, "%ld", Item->LongValue );
+            break; }
+
+        default:
+            snprintf( Buffer, BufferSize, "%ld", Item->LongValue );
+            break;
+    }
+}
+
+
+/*  Normalizes a URL in place, so that equivalent spellings of  */
+/*  the same URL compare equal:                                 */
+/*    - the scheme must be http:// or https:// at the start     */
+/*    - the scheme and host are lowercased                      */
+/*    - the query string and fragment are removed               */
+/*    - the default port (:80 / :443) is removed                */
+/*    - the URL must be valid UTF-8                             */
+/*  The URL can only get shorter, so there is no allocation.    */
+/*  The byte scans use SSE2 when available, 16 bytes per step.  */
+
+int NormalizeURL( char* URL, size_t* URLLength )
+{
+    size_t      Length          = *URLLength;
+    size_t      SchemeLength    = 0;
+    size_t      AuthorityStart  = 0;
+    size_t      AuthorityEnd    = 0;
+    size_t      HostStart       = 0;
+    char*       PathStart       = NULL;
+    char*       UserInfoEnd     = NULL;
+
+    /*  Scheme check, only at the start of the token  */
+    if (( Length >= 7 ) && ( strncasecmp( URL, "http://", 7 ) == 0 ))
+        SchemeLength = 4;
+    else if (( Length >= 8 ) && ( strncasecmp( URL, "https://", 8 ) == 0 ))
+        SchemeLength = 5;
+    else
+        return ( PARSE_ERROR_NOT_URL );
+
+    /*  Drop "?query" and "#fragment"  */
+    Length = FindQueryOrFragment( URL, Length );
+
+    /*  The authority is between "://" and the first '/'  */
+    AuthorityStart  = SchemeLength + 3;
+    PathStart       = ( char* ) memchr( URL + AuthorityStart, '/', 
+                                        Length - AuthorityStart );
+    AuthorityEnd    = PathStart ? ( PathStart - URL ) : Length;
+
+    if ( UNLIKELY( AuthorityEnd == AuthorityStart ))
+        return ( PARSE_ERROR_NOT_URL );
+
+    /*  Lowercase the scheme, and the host, but not any  */
+    /*  "user:password@" part, which is case-sensitive   */
+    UserInfoEnd = ( char* ) memchr( URL + AuthorityStart, '@', 
+                                    AuthorityEnd - AuthorityStart );
+    HostStart   = UserInfoEnd ? ( UserInfoEnd + 1 - URL ) : AuthorityStart;
+
+    LowercaseASCII( URL, SchemeLength );
+    LowercaseASCII( URL + HostStart, AuthorityEnd - HostStart );
+
+    /*  Collapse the default port for the scheme  */
+    if ((( SchemeLength == 4 ) && ( AuthorityEnd - HostStart > 3 ) &&
+         ( memcmp( URL + AuthorityEnd - 3, ":80", 3 ) == 0 )) ||
+        (( SchemeLength == 5 ) && ( AuthorityEnd - HostStart > 4 ) &&
+         ( memcmp( URL + AuthorityEnd - 4, ":443", 4 ) == 0 ))) {
+
+        size_t PortLength = SchemeLength - 1;
+        memmove( URL + AuthorityEnd - PortLength, 
+                 URL + AuthorityEnd, 
+                 Length - AuthorityEnd );
+        Length -= PortLength;
+    }
+
+    if ( UNLIKELY( !IsValidUTF8(( const unsigned char* ) URL, Length )))
+        return ( PARSE_ERROR_BAD_UTF8 );
+
+    URL[ Length ] = '\0';
+    *URLLength    = Length;
+    return ( PARSE_OK );
+}
+
+
+/*  CPU kernels.  The byte scanning loops of the parser and    */
+/*  the URL normalization come in scalar, SSE2, AVX2 and       */
+/*  AVX-512 variants.  Each variant is compiled for its own    */
+/*  instruction set with a target attribute, so the one        */
+/*  baseline x86-64 binary still uses the wider vectors on     */
+/*  the CPUs that have them.  SelectKernels() picks the best   */
+/*  variant the CPU supports once at startup, or the one       */
+/*  forced with --kernels, and the callers go through the      */
+/*  Kernels table.  SSE4.2 has nothing these loops need that   */
+/*  SSE2 doesn't: its string instructions are slower than a    */
+/*  compare + movemask here.                                   */
+/*                                                             */
+/*  The variants handle their full vectors and leave the tail  */
+/*  to the scalar loop, so none reads past Length.  They don't */
+/*  call each other for the tail: going from AVX code to the   */
+/*  legacy SSE encoding costs a state transition every call.   */
+
+
+/*  Scalar versions, also the tails of the vector ones  */
+
+static size_t FindDelimiterScalar( const char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    while (( Offset < Length ) && ( !IS_DELIMITER( Data[ Offset ] )))
+        Offset += 1;
+    return ( Offset );
+}
+
+static size_t FindQueryOrFragmentScalar( const char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    while (( Offset < Length ) && ( Data[ Offset ] != '?' ) && ( Data[ Offset ] != '#' ))
+        Offset += 1;
+    return ( Offset );
+}
+
+static size_t FindQuoteOrEscapeScalar( const char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    while (( Offset < Length ) && ( Data[ Offset ] != '"' ) && ( Data[ Offset ] != '\\' ))
+        Offset += 1;
+    return ( Offset );
+}
+
+static void LowercaseASCIIScalar( char* Data, size_t Length )
+{
+    for ( size_t Offset = 0; Offset < Length; Offset += 1 )
+        if (( Data[Offset] >= 'A' ) && ( Data[Offset] <= 'Z' ))
+            Data[Offset] |= 0x20;
+}
+
+static size_t FindNonASCIIScalar( const unsigned char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    while (( Offset < Length ) && ( Data[ Offset ] < 0x80 ))
+        Offset += 1;
+    return ( Offset );
+}
+
+#if defined( __x86_64__ )
+
+/*  SSE2, 16 bytes at a time  */
+
+__attribute__(( target( "sse2" )))
+static size_t FindDelimiterSSE2( const char* Data, size_t Length )
+{
+    const __m128i   Space   = _mm_set1_epi8( ' ' );
+    const __m128i   Tab     = _mm_set1_epi8( '\t' );
+    const __m128i   CR      = _mm_set1_epi8( '\r' );
+    const __m128i   LF      = _mm_set1_epi8( '\n' );
+    size_t          Offset  = 0;
+
+    for ( ; Offset + 16 <= Length; Offset += 16 ) {
+        __m128i Chunk   = _mm_loadu_si128(( const __m128i* )( Data + Offset ));
+        int     Mask    = _mm_movemask_epi8( 
+                            _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( Chunk, Space ),
+                                                        _mm_cmpeq_epi8( Chunk, Tab )),
+                                          _mm_or_si128( _mm_cmpeq_epi8( Chunk, CR ),
+                                                        _mm_cmpeq_epi8( Chunk, LF ))));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindDelimiterScalar( Data + Offset, Length - Offset ));
+}
+
+__attribute__(( target( "sse2" )))
+static size_t FindQueryOrFragmentSSE2( const char* Data, size_t Length )
+{
+    const __m128i   Question    = _mm_set1_epi8( '?' );
+    const __m128i   Hash        = _mm_set1_epi8( '#' );
+    size_t          Offset      = 0;
+
+    for ( ; Offset + 16 <= Length; Offset += 16 ) {
+        __m128i Chunk   = _mm_loadu_si128(( const __m128i* )( Data + Offset ));
+        int     Mask    = _mm_movemask_epi8( 
+                            _mm_or_si128( _mm_cmpeq_epi8( Chunk, Question ),
+                                          _mm_cmpeq_epi8( Chunk, Hash )));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindQueryOrFragmentScalar( Data + Offset, Length - Offset ));
+}
+
+__attribute__(( target( "sse2" )))
+static size_t FindQuoteOrEscapeSSE2( const char* Data, size_t Length )
+{
+    const __m128i   Quote       = _mm_set1_epi8( '"' );
+    const __m128i   Escape      = _mm_set1_epi8( '\\' );
+    size_t          Offset      = 0;
+
+    for ( ; Offset + 16 <= Length; Offset += 16 ) {
+        __m128i Chunk   = _mm_loadu_si128(( const __m128i* )( Data + Offset ));
+        int     Mask    = _mm_movemask_epi8( 
+                            _mm_or_si128( _mm_cmpeq_epi8( Chunk, Quote ),
+                                          _mm_cmpeq_epi8( Chunk, Escape )));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindQuoteOrEscapeScalar( Data + Offset, Length - Offset ));
+}
+
+__attribute__(( target( "sse2" )))
+static void LowercaseASCIISSE2( char* Data, size_t Length )
+{
+    /*  Bytes are compared as signed, so anything >= 0x80 is  */
+    /*  negative and falls outside of the 'A'..'Z' range      */
+    const __m128i   BeforeA     = _mm_set1_epi8( 'A' - 1 );
+    const __m128i   AfterZ      = _mm_set1_epi8( 'Z' + 1 );
+    const __m128i   CaseBit     = _mm_set1_epi8( 0x20 );
+    size_t          Offset      = 0;
+
+    for ( ; Offset + 16 <= Length; Offset += 16 ) {
+        __m128i Chunk   = _mm_loadu_si128(( const __m128i* )( Data + Offset ));
+        __m128i Upper   = _mm_and_si128( _mm_cmpgt_epi8( Chunk, BeforeA ),
+                                         _mm_cmplt_epi8( Chunk, AfterZ ));
+        Chunk = _mm_or_si128( Chunk, _mm_and_si128( Upper, CaseBit ));
+        _mm_storeu_si128(( __m128i* )( Data + Offset ), Chunk );
+    }
+
+    LowercaseASCIIScalar( Data + Offset, Length - Offset );
+}
+
+__attribute__(( target( "sse2" )))
+static size_t FindNonASCIISSE2( const unsigned char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    for ( ; Offset + 16 <= Length; Offset += 16 ) {
+        int Mask = _mm_movemask_epi8( _mm_loadu_si128(( const __m128i* )( Data + Offset )));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindNonASCIIScalar( Data + Offset, Length - Offset ));
+}
+
+/*  AVX2, 32 bytes at a time  */
+
+__attribute__(( target( "avx2" )))
+static size_t FindDelimiterAVX2( const char* Data, size_t Length )
+{
+    const __m256i   Space   = _mm256_set1_epi8( ' ' );
+    const __m256i   Tab     = _mm256_set1_epi8( '\t' );
+    const __m256i   CR      = _mm256_set1_epi8( '\r' );
+    const __m256i   LF      = _mm256_set1_epi8( '\n' );
+    size_t          Offset  = 0;
+
+    for ( ; Offset + 32 <= Length; Offset += 32 ) {
+        __m256i     Chunk   = _mm256_loadu_si256(( const __m256i* )( Data + Offset ));
+        unsigned    Mask    = _mm256_movemask_epi8( 
+                                _mm256_or_si256( _mm256_or_si256( _mm256_cmpeq_epi8( Chunk, Space ),
+                                                                  _mm256_cmpeq_epi8( Chunk, Tab )),
+                                                 _mm256_or_si256( _mm256_cmpeq_epi8( Chunk, CR ),
+                                                                  _mm256_cmpeq_epi8( Chunk, LF ))));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindDelimiterScalar( Data + Offset, Length - Offset ));
+}
+
+__attribute__(( target( "avx2" )))
+static size_t FindQueryOrFragmentAVX2( const char* Data, size_t Length )
+{
+    const __m256i   Question    = _mm256_set1_epi8( '?' );
+    const __m256i   Hash        = _mm256_set1_epi8( '#' );
+    size_t          Offset      = 0;
+
+    for ( ; Offset + 32 <= Length; Offset += 32 ) {
+        __m256i     Chunk   = _mm256_loadu_si256(( const __m256i* )( Data + Offset ));
+        unsigned    Mask    = _mm256_movemask_epi8( 
+                                _mm256_or_si256( _mm256_cmpeq_epi8( Chunk, Question ),
+                                                 _mm256_cmpeq_epi8( Chunk, Hash )));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindQueryOrFragmentScalar( Data + Offset, Length - Offset ));
+}
+
+__attribute__(( target( "avx2" )))
+static size_t FindQuoteOrEscapeAVX2( const char* Data, size_t Length )
+{
+    const __m256i   Quote       = _mm256_set1_epi8( '"' );
+    const __m256i   Escape      = _mm256_set1_epi8( '\\' );
+    size_t          Offset      = 0;
+
+    for ( ; Offset + 32 <= Length; Offset += 32 ) {
+        __m256i     Chunk   = _mm256_loadu_si256(( const __m256i* )( Data + Offset ));
+        unsigned    Mask    = _mm256_movemask_epi8( 
+                                _mm256_or_si256( _mm256_cmpeq_epi8( Chunk, Quote ),
+                                                 _mm256_cmpeq_epi8( Chunk, Escape )));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindQuoteOrEscapeScalar( Data + Offset, Length - Offset ));
+}
+
+__attribute__(( target( "avx2" )))
+static void LowercaseASCIIAVX2( char* Data, size_t Length )
+{
+    const __m256i   BeforeA     = _mm256_set1_epi8( 'A' - 1 );
+    const __m256i   AfterZ      = _mm256_set1_epi8( 'Z' + 1 );
+    const __m256i   CaseBit     = _mm256_set1_epi8( 0x20 );
+    size_t          Offset      = 0;
+
+    for ( ; Offset + 32 <= Length; Offset += 32 ) {
+        __m256i Chunk   = _mm256_loadu_si256(( const __m256i* )( Data + Offset ));
+        __m256i Upper   = _mm256_and_si256( _mm256_cmpgt_epi8( Chunk, BeforeA ),
+                                            _mm256_cmpgt_epi8( AfterZ, Chunk ));
+        Chunk = _mm256_or_si256( Chunk, _mm256_and_si256( Upper, CaseBit ));
+        _mm256_storeu_si256(( __m256i* )( Data + Offset ), Chunk );
+    }
+
+    LowercaseASCIIScalar( Data + Offset, Length - Offset );
+}
+
+__attribute__(( target( "avx2" )))
+static size_t FindNonASCIIAVX2( const unsigned char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    for ( ; Offset + 32 <= Length; Offset += 32 ) {
+        unsigned Mask = _mm256_movemask_epi8( 
+                            _mm256_loadu_si256(( const __m256i* )( Data + Offset )));
+        if ( Mask )
+            return ( Offset + __builtin_ctz( Mask ));
+    }
+
+    return ( Offset + FindNonASCIIScalar( Data + Offset, Length - Offset ));
+}
+
+/*  AVX-512 (BW), 64 bytes at a time, compares give a mask.  */
+/*  The tail is a masked load, which doesn't touch the bytes  */
+/*  past Length, so these don't need a scalar loop.           */
+
+__attribute__(( target( "avx512f,avx512bw" )))
+static inline __m512i LoadTailAVX512( const void* Data, size_t Length, __mmask64* Valid )
+{
+    *Valid = ( Length >= 64 ) ? ~0ULL : (( 1ULL << Length ) - 1 );
+    return ( _mm512_maskz_loadu_epi8( *Valid, Data ));
+}
+
+__attribute__(( target( "avx512f,avx512bw" )))
+static size_t FindDelimiterAVX512( const char* Data, size_t Length )
+{
+    const __m512i   Space   = _mm512_set1_epi8( ' ' );
+    const __m512i   Tab     = _mm512_set1_epi8( '\t' );
+    const __m512i   CR      = _mm512_set1_epi8( '\r' );
+    const __m512i   LF      = _mm512_set1_epi8( '\n' );
+    size_t          Offset  = 0;
+
+    __mmask64       Valid   = 0;
+
+    for ( ; Offset < Length; Offset += 64 ) {
+        __m512i     Chunk   = LoadTailAVX512( Data + Offset, Length - Offset, &Valid );
+        __mmask64   Mask    = Valid & 
+                              ( _mm512_cmpeq_epi8_mask( Chunk, Space ) |
+                                _mm512_cmpeq_epi8_mask( Chunk, Tab )   |
+                                _mm512_cmpeq_epi8_mask( Chunk, CR )    |
+                                _mm512_cmpeq_epi8_mask( Chunk, LF ));
+        if ( Mask )
+            return ( Offset + __builtin_ctzll( Mask ));
+    }
+
+    return ( Length );
+}
+
+__attribute__(( target( "avx512f,avx512bw" )))
+static size_t FindQueryOrFragmentAVX512( const char* Data, size_t Length )
+{
+    const __m512i   Question    = _mm512_set1_epi8( '?' );
+    const __m512i   Hash        = _mm512_set1_epi8( '#' );
+    size_t          Offset      = 0;
+
+    __mmask64       Valid       = 0;
+
+    for ( ; Offset < Length; Offset += 64 ) {
+        __m512i     Chunk   = LoadTailAVX512( Data + Offset, Length - Offset, &Valid );
+        __mmask64   Mask    = Valid &
+                              ( _mm512_cmpeq_epi8_mask( Chunk, Question ) |
+                                _mm512_cmpeq_epi8_mask( Chunk, Hash ));
+        if ( Mask )
+            return ( Offset + __builtin_ctzll( Mask ));
+    }
+
+    return ( Length );
+}
+
+__attribute__(( target( "avx512f,avx512bw" )))
+static size_t FindQuoteOrEscapeAVX512( const char* Data, size_t Length )
+{
+    const __m512i   Quote       = _mm512_set1_epi8( '"' );
+    const __m512i   Escape      = _mm512_set1_epi8( '\\' );
+    size_t          Offset      = 0;
+
+    __mmask64       Valid       = 0;
+
+    for ( ; Offset < Length; Offset += 64 ) {
+        __m512i     Chunk   = LoadTailAVX512( Data + Offset, Length - Offset, &Valid );
+        __mmask64   Mask    = Valid &
+                              ( _mm512_cmpeq_epi8_mask( Chunk, Quote ) |
+                                _mm512_cmpeq_epi8_mask( Chunk, Escape ));
+        if ( Mask )
+            return ( Offset + __builtin_ctzll( Mask ));
+    }
+
+    return ( Length );
+}
+
+__attribute__(( target( "avx512f,avx512bw" )))
+static void LowercaseASCIIAVX512( char* Data, size_t Length )
+{
+    const __m512i   BeforeA     = _mm512_set1_epi8( 'A' - 1 );
+    const __m512i   AfterZ      = _mm512_set1_epi8( 'Z' + 1 );
+    const __m512i   CaseBit     = _mm512_set1_epi8( 0x20 );
+    size_t          Offset      = 0;
+
+    __mmask64       Valid       = 0;
+
+    for ( ; Offset < Length; Offset += 64 ) {
+        __m512i     Chunk   = LoadTailAVX512( Data + Offset, Length - Offset, &Valid );
+        __mmask64   Upper   = _mm512_cmpgt_epi8_mask( Chunk, BeforeA ) &
+                              _mm512_cmplt_epi8_mask( Chunk, AfterZ );
+        Chunk = _mm512_or_si512( Chunk, _mm512_maskz_mov_epi8( Upper, CaseBit ));
+        _mm512_mask_storeu_epi8(( void* )( Data + Offset ), Valid, Chunk );
+    }
+}
+
+__attribute__(( target( "avx512f,avx512bw" )))
+static size_t FindNonASCIIAVX512( const unsigned char* Data, size_t Length )
+{
+    size_t  Offset  = 0;
+
+    __mmask64   Valid   = 0;
+
+    for ( ; Offset < Length; Offset += 64 ) {
+        __mmask64 Mask = _mm512_movepi8_mask( 
+                            LoadTailAVX512( Data + Offset, Length - Offset, &Valid ));
+        if ( Mask )
+            return ( Offset + __builtin_ctzll( Mask ));
+    }
+
+    return ( Length );
+}
+
+#endif  // __x86_64__
+
+KERNELS KernelVariants[ KERNELS_COUNT ] =
+{
+    { "scalar",
+      FindDelimiterScalar, FindQueryOrFragmentScalar, FindQuoteOrEscapeScalar,
+      LowercaseASCIIScalar, FindNonASCIIScalar },
+#if defined( __x86_64__ )
+    { "sse2",
+      FindDelimiterSSE2, FindQueryOrFragmentSSE2, FindQuoteOrEscapeSSE2,
+      LowercaseASCIISSE2, FindNonASCIISSE2 },
+    { "avx2",
+      FindDelimiterAVX2, FindQueryOrFragmentAVX2, FindQuoteOrEscapeAVX2,
+      LowercaseASCIIAVX2, FindNonASCIIAVX2 },
+    { "avx512",
+      FindDelimiterAVX512, FindQueryOrFragmentAVX512, FindQuoteOrEscapeAVX512,
+      LowercaseASCIIAVX512, FindNonASCIIAVX512 },
+#endif
+};
+
+/*  Picks the widest variant this CPU supports, or the one  */
+/*  named by --kernels if it's supported                    */
+
+bool SelectKernels()
+{
+    Kernels = &KernelVariants[ KERNELS_SCALAR ];
+
+    for ( int Variant = KERNELS_COUNT - 1; Variant >= 0; Variant -= 1 )
+    {
+        KERNELS*    Candidate   = &KernelVariants[ Variant ];
+        bool        Supported   = ( Candidate->Name != NULL );
+
+#if defined( __x86_64__ )
+        if ( Variant == KERNELS_SSE2 )
+            Supported = __builtin_cpu_supports( "sse2" );
+        else if ( Variant == KERNELS_AVX2 )
+            Supported = __builtin_cpu_supports( "avx2" );
+        else if ( Variant == KERNELS_AVX512 )
+            Supported = __builtin_cpu_supports( "avx512bw" );
+#endif
+
+        if ( KernelsOption ) {
+            if (( !Candidate->Name ) || ( strcmp( KernelsOption, Candidate->Name ) != 0 )) 
+                continue;
+            if ( !Supported ) {
+                printf("\nThis CPU doesn't support the %s kernels\n\n", KernelsOption );
+                return ( false ); }
+            Kernels = Candidate;
+            break; }
+
+        if ( Supported ) {
+            Kernels = Candidate;
+            break; }
+    }
+
+    if (( KernelsOption ) && ( strcmp( KernelsOption, Kernels->Name ) != 0 )) {
+        printf("\nUnknown --kernels variant: %s\n\n", KernelsOption );
+        return ( false ); }
+
+    if (( Verbose ) || ( KernelsOption ))
+        printf("Using %s kernels\n", Kernels->Name );
+
+    return ( true );
+}
+
+
+/*  Returns the offset of the first '?' or '#', or Length if   */
+/*  there isn't one.                                           */
+
+size_t FindQueryOrFragment( const char* Data, size_t Length )
+{
+    return ( Kernels->FindQueryOrFragment( Data, Length ));
+}
+
+
+/*  Lowercases A-Z in place, leaving every other byte alone  */
+
+void LowercaseASCII( char* Data, size_t Length )
+{
+    Kernels->LowercaseASCII( Data, Length );
+}
+
+
+/*  UTF-8 validation.  Nearly all URLs are plain ASCII, so the  */
+/*  kernel skips ahead to the first byte with the high bit set, */
+/*  and only the sequences from there on are decoded.           */
+
+bool IsValidUTF8( const unsigned char* Data, size_t Length )
+{
+    size_t  Offset  = Kernels->FindNonASCII( Data, Length );
+
+    while ( Offset < Length )
+    {
+        unsigned char   Byte        = Data[ Offset ];
+        size_t          Extra       = 0;
+        unsigned int    CodePoint   = 0;
+
+        if      ( Byte < 0x80 )           { Offset += 1; continue; }
+        else if (( Byte & 0xE0 ) == 0xC0 ) { Extra = 1; CodePoint = Byte & 0x1F; }
+        else if (( Byte & 0xF0 ) == 0xE0 ) { Extra = 2; CodePoint = Byte & 0x0F; }
+        else if (( Byte & 0xF8 ) == 0xF0 ) { Extra = 3; CodePoint = Byte & 0x07; }
+        else return ( false );
+
+        if ( Offset + Extra >= Length ) return ( false );
+
+        for ( size_t Index = 1; Index <= Extra; Index += 1 ) {
+            if (( Data[ Offset + Index ] & 0xC0 ) != 0x80 ) return ( false );
+            CodePoint = ( CodePoint << 6 ) | ( Data[ Offset + Index ] & 0x3F );
+        }
+
+        /*  Reject overlong encodings, surrogates, > U+10FFFF  */
+        if ((( Extra == 1 ) && ( CodePoint < 0x80 ))    ||
+            (( Extra == 2 ) && ( CodePoint < 0x800 ))   ||
+            (( Extra == 3 ) && ( CodePoint < 0x10000 )) ||
+            (( CodePoint >= 0xD800 ) && ( CodePoint <= 0xDFFF )) ||
+            ( CodePoint > 0x10FFFF ))
+            return ( false );
+
+        Offset += Extra + 1;
+    }
+
+    return ( true );
+}
+
+
+/*  This function reads lines from the input text file until    */
+/*  it finds a well-formed one, and returns it to the caller    */
+/*  as a heap-allocated DATA_ITEM struct.  Malformed lines are  */
+/*  skipped and counted in ParseErrorCounts, so NULL is only    */
+/*  returned at EOF (or if we run out of memory).               */
+
+/*  Adds a length to its log2 bucket, one bit scan per line  */
+
+static inline void CountLength( LENGTH_HISTOGRAM* Histogram, size_t Length )
+{
+    int Bucket = Length ? ( 64 - __builtin_clzl( Length )) : 0;
+
+    Histogram->Counts[ std::min( Bucket, LENGTH_BUCKETS - 1 ) ] += 1;
+    Histogram->Count        += 1;
+    Histogram->TotalLength  += Length;
+    if ( UNLIKELY(( long ) Length > Histogram->MaxLength ))
+        Histogram->MaxLength = Length;
+}
+
+/*  Upper bound of the bucket the given fraction of the  */
+/*  lengths fall in, e.g. 0.99 for the 99th percentile   */
+
+static long GetLengthPercentile( LENGTH_HISTOGRAM* Histogram, double Fraction )
+{
+    long    Target  = ( long )( Fraction * Histogram->Count );
+    long    Seen    = 0;
+
+    for ( int Bucket = 0; Bucket < LENGTH_BUCKETS - 1; Bucket += 1 ) {
+        Seen += Histogram->Counts[ Bucket ];
+        if ( Seen >= Target ) 
+            return ( std::min(( 1L << Bucket ) - 1, Histogram->MaxLength )); }
+
+    return ( Histogram->MaxLength );
+}
+
+static void PrintLengthHistogram( const char* Name, LENGTH_HISTOGRAM* Histogram )
+{
+    printf("\n%s lengths: mean %.1f, p50 <= %ld, p99 <= %ld, max %ld\n",
+            Name,
+            ( double ) Histogram->TotalLength / Histogram->Count,
+            GetLengthPercentile( Histogram, 0.50 ),
+            GetLengthPercentile( Histogram, 0.99 ),
+            Histogram->MaxLength );
+
+    for ( int Bucket = 0; Bucket < LENGTH_BUCKETS; Bucket += 1 ) {
+        char    Upper   [ 24 ] = "";
+
+        if ( !Histogram->Counts[ Bucket ] ) continue;
+        if ( Bucket < LENGTH_BUCKETS - 1 )
+            snprintf( Upper, sizeof( Upper ), "%ld", ( 1L << Bucket ) - 1 );
+
+        printf("    %6ld - %-6s %10ld  (%.2f%%)\n",
+                Bucket ? ( 1L << ( Bucket - 1 )) : 0,
+                Upper,
+                Histogram->Counts[ Bucket ],
+                100.0 * Histogram->Counts[ Bucket ] / Histogram->Count );
+    }
+}
+
+/*  Prints the length histograms, and what they mean for the  */
+/*  memory of the candidate set: each kept item is a DATA_ITEM */
+/*  plus its own URL allocation, and the batch being sorted    */
+/*  holds ResultCount + BatchSize of them.                     */
+
+void PrintLengthStats()
+{
+    const long  MallocOverhead  = 16;
+    long        ItemBytes       = 0;
+    long        URLBytes        = 0;
+
+    if ( !LineLengths.Count ) return;
+
+    PrintLengthHistogram( "Line", &LineLengths );
+    if ( !URLLengths.Count ) return;
+    PrintLengthHistogram( "URL", &URLLengths );
+
+    /*  Sized for the 99th percentile URL, rounded up the  */
+    /*  way malloc rounds, to 16 bytes.  Candidates that   */
+    /*  keep the URL's offset only hold one as a result.   */
+    ItemBytes = sizeof( DATA_ITEM ) + sizeof( DATA_ITEM* ) + MallocOverhead;
+    URLBytes  = MallocOverhead + 
+                (( GetLengthPercentile( &URLLengths, 0.99 ) + 1 + 15 ) & ~15L );
+
+    printf("\nEstimated memory: %ld bytes per item, %ld KB for -n %ld, "
+           "%ld KB peak with -b %ld\n",
+            ItemBytes + URLBytes,
+            ( ItemBytes + URLBytes ) * ResultCount / 1024, ResultCount,
+            (( ItemBytes + ( DeferURLs ? 0 : URLBytes )) * ( ResultCount + BatchSize ) +
+             ( DeferURLs ? URLBytes * ResultCount : 0 )) / 1024, BatchSize );
+}
+
+
+/*  Adds a parsed row to the block's columns.  Rows that failed  */
+/*  are kept too, so the line numbers stay dense.                */
+
+static void AppendRecordRow( RECORD_BLOCK* Block, PARSED_LINE* Parsed, int ParseStatus )
+{
+    Block->LineCount += 1;
+
+    if ( LIKELY( ParseStatus == PARSE_OK )) {
+        if ( UNLIKELY( Parsed->ExtraColumns ))
+            ExtraColumnLineCount += 1;
+        CountLength( &URLLengths, Parsed->URLLength ); }
+    else {
+        char* Line = Parsed->URL;
+        ParseErrorCounts[ ParseStatus ] += 1;
+        memset( Parsed, 0, sizeof( PARSED_LINE ));
+        Parsed->URL = Line; }
+
+    Block->LongValues.push_back( Parsed->LongValue );
+    Block->HighValues.push_back( Parsed->HighValue );
+    Block->URLOffsets.push_back( Parsed->URL - Block->Buffer );
+    Block->URLLengths.push_back( Parsed->URLLength );
+    Block->LineNumbers.push_back( Block->LineCount );
+    Block->Status.push_back( ParseStatus );
+    Block->Attributes.push_back( Parsed->Attributes );
+    Block->AttributesLengths.push_back( Parsed->AttributesLength );
+
+    if ( RankExpression )
+        for ( int Column = 0; Column <= EXPRESSION_MAX_COLUMN; Column += 1 )
+            if ( RankExpression->ColumnMask & ( 1u << Column ))
+                Block->Columns[ Column ].push_back( Parsed->Columns[ Column ] );
+
+    for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+        Block->Metrics[ Metric ].push_back( Parsed->Metrics[ Metric ] );
+
+    Block->RowCount += 1;
+}
+
+
+/*  Apache Arrow IPC input and output, without the Arrow library.  */
+/*  The metadata of each IPC message is a FlatBuffer, which is     */
+/*  read and written by hand with the few helpers below, and the   */
+/*  column buffers follow it in the message body.  An input file   */
+/*  is mapped, so the value column is used in place.  Only the     */
+/*  little-endian layout of the hosts we run on is supported, and  */
+/*  only uncompressed record batches.                              */
+
+#define ARROW_CONTINUATION          0xFFFFFFFFu
+#define ARROW_METADATA_V5           4
+#define ARROW_HEADER_SCHEMA         1
+#define ARROW_HEADER_RECORD_BATCH   3
+#define ARROW_TYPE_NULL             1
+#define ARROW_TYPE_INT              2
+#define ARROW_TYPE_FLOATING_POINT   3
+#define ARROW_TYPE_BINARY           4
+#define ARROW_TYPE_UTF8             5
+#define ARROW_TYPE_STRUCT           13
+#define ARROW_TYPE_UNION            14
+#define ARROW_TYPE_FIXED_SIZE_LIST  16
+#define ARROW_TYPE_LARGE_BINARY     19
+#define ARROW_TYPE_LARGE_UTF8       20
+#define ARROW_TYPE_RUN_END_ENCODED  22
+#define ARROW_TYPE_LIST_VIEW        25
+#define ARROW_TYPE_LARGE_LIST_VIEW  26
+#define ARROW_PRECISION_SINGLE      1
+#define ARROW_PRECISION_DOUBLE      2
+#define ARROW_BLOCK_ROWS            65536   // rows per record block
+
+typedef struct _ARROW_COLUMN
+{
+    int     Type;           // ARROW_TYPE_*, 0 if not in the schema
+    int     BitWidth;       // of an Int or FloatingPoint value
+    bool    Signed;
+    long    Node;           // index of its FieldNode in a record batch
+    long    Buffer;         // index of its first buffer, the validity
+}   ARROW_COLUMN;
+
+typedef struct _ARROW_READER
+{
+    const unsigned char*    Map;
+    size_t                  Size;
+    size_t                  Position;       // of the next message
+    bool                    Opened;
+    bool                    HaveSchema;
+
+    ARROW_COLUMN            URLColumn;
+    ARROW_COLUMN            ValueColumn;
+
+    /*  The record batch being read  */
+    long                    RowCount;
+    long                    NextRow;
+    const unsigned char*    URLValidity;    // NULL without nulls
+    const unsigned char*    URLOffsets;     // 32 or 64-bit, by type
+    const char*             URLData;
+    size_t                  URLDataLength;
+    const unsigned char*    ValueValidity;
+    const unsigned char*    Values;
+}   ARROW_READER;
+
+ARROW_READER    ArrowInput;
+
+
+/*  Reads a little-endian scalar of Width bytes  */
+
+static inline unsigned long FlatRead( const unsigned char* Data, size_t Position, int Width )
+{
+    unsigned long   Value   = 0;
+
+    memcpy( &Value, Data + Position, Width );
+    return ( Value );
+}
+
+
+/*  Position of field Field of the table at Table, by way of its  */
+/*  vtable, or 0 if the field is absent or out of bounds.  No     */
+/*  field can be at position 0, which holds the root offset.      */
+
+static size_t FlatField( const unsigned char* Data, size_t Size, 
+                         size_t Table, int Field, int Width )
+{
+    size_t      VTable      = 0;
+    size_t      VTableSize  = 0;
+    size_t      Offset      = 0;
+
+    if (( !Table ) || ( Table + 4 > Size )) return ( 0 );
+
+    /*  A signed offset back to the vtable  */
+    VTable = Table - ( long )( int ) FlatRead( Data, Table, 4 );
+    if ( VTable + 4 > Size ) return ( 0 );
+
+    VTableSize = FlatRead( Data, VTable, 2 );
+    if (( 4 + 2 * ( size_t ) Field + 2 > VTableSize ) || ( VTable + VTableSize > Size )) 
+        return ( 0 );
+
+    Offset = FlatRead( Data, VTable + 4 + 2 * Field, 2 );
+    if (( !Offset ) || ( Table + Offset + Width > Size )) return ( 0 );
+    return ( Table + Offset );
+}
+
+
+/*  A scalar field, or its default if absent  */
+
+static long FlatScalar( const unsigned char* Data, size_t Size, 
+                        size_t Table, int Field, int Width, long Default )
+{
+    size_t      Position    = FlatField( Data, Size, Table, Field, Width );
+
+    return ( Position ? ( long ) FlatRead( Data, Position, Width ) : Default );
+}
+
+
+/*  Follows the offset stored at Position to a table, vector or  */
+/*  string.  Offsets only point forward, so 0 is never a valid    */
+/*  target, and is returned if there is nothing there.            */
+
+static size_t FlatDereference( const unsigned char* Data, size_t Size, size_t Position )
+{
+    size_t      Target      = 0;
+
+    if (( !Position ) || ( Position + 4 > Size )) return ( 0 );
+    Target = Position + FlatRead( Data, Position, 4 );
+    return (( Target > Position ) && ( Target + 4 <= Size ) ? Target : 0 );
+}
+
+
+/*  The vector in field Field of a table, with the element count  */
+/*  checked against the buffer.  Returns the position of the      */
+/*  first element, or 0 if absent.                                */
+
+static size_t FlatVector( const unsigned char* Data, size_t Size, size_t Table, 
+                          int Field, size_t ElementSize, size_t* Count )
+{
+    size_t      Vector      = FlatDereference( Data, Size, 
+                                               FlatField( Data, Size, Table, Field, 4 ));
+
+    *Count = 0;
+    if ( !Vector ) return ( 0 );
+    *Count = FlatRead( Data, Vector, 4 );
+    if ( *Count > ( Size - Vector - 4 ) / ElementSize ) {
+        *Count = 0;
+        return ( 0 ); }
+    return ( Vector + 4 );
+}
+
+
+/*  Counts the FieldNodes and buffers a field and its children take  */
+/*  in a record batch, to find where the columns after it start.     */
+
+static bool CountArrowField( const unsigned char* Data, size_t Size, 
+                             size_t Field, long* Nodes, long* Buffers )
+{
+    long        TypeType    = FlatScalar( Data, Size, Field, 2, 1, 0 );
+    size_t      Children    = 0;
+    size_t      ChildCount  = 0;
+
+    *Nodes += 1;
+
+    /*  A dictionary-encoded field holds its indices, an Int  */
+    if ( FlatField( Data, Size, Field, 4, 4 ))
+        *Buffers += 2;
+    else
+        switch ( TypeType )
+        {
+            case ARROW_TYPE_NULL:
+            case ARROW_TYPE_RUN_END_ENCODED:
+                break;
+
+            case ARROW_TYPE_STRUCT:
+            case ARROW_TYPE_FIXED_SIZE_LIST:
+                *Buffers += 1;
+                break;
+
+            case ARROW_TYPE_BINARY:
+            case ARROW_TYPE_UTF8:
+            case ARROW_TYPE_LARGE_BINARY:
+            case ARROW_TYPE_LARGE_UTF8:
+            case ARROW_TYPE_LIST_VIEW:
+            case ARROW_TYPE_LARGE_LIST_VIEW:
+                *Buffers += 3;
+                break;
+
+            case ARROW_TYPE_UNION: {
+                /*  Sparse unions have type ids only, dense ones offsets too  */
+                size_t Type = FlatDereference( Data, Size, FlatField( Data, Size, Field, 3, 4 ));
+                *Buffers += 1 + ( FlatScalar( Data, Size, Type, 0, 2, 0 ) == 1 );
+                break; }
+
+            default:
+                /*  The views of strings have a variable buffer count  */
+                if (( TypeType < ARROW_TYPE_NULL ) || ( TypeType > ARROW_TYPE_RUN_END_ENCODED ))
+                    return ( false );
+                *Buffers += 2;
+                break;
+        }
+
+    Children = FlatVector( Data, Size, Field, 5, 4, &ChildCount );
+    for ( size_t Child = 0; Child < ChildCount; Child += 1 )
+        if ( !CountArrowField( Data, Size, 
+                               FlatDereference( Data, Size, Children + 4 * Child ),
+                               Nodes, Buffers ))
+            return ( false );
+
+    return ( true );
+}
+
+
+/*  Finds the URL and value columns in a Schema message, by the  */
+/*  --url-field and --value-field names                          */
+
+static bool ReadArrowSchema( ARROW_READER* Reader, const unsigned char* Data, 
+                             size_t Size, size_t Schema )
+{
+    size_t          Fields      = 0;
+    size_t          FieldCount  = 0;
+    size_t          Field       = 0;
+    size_t          Name        = 0;
+    size_t          Type        = 0;
+    size_t          NameLength  = 0;
+    long            Nodes       = 0;
+    long            Buffers     = 0;
+    ARROW_COLUMN*   Column      = NULL;
+
+    memset( &Reader->URLColumn, 0, sizeof( ARROW_COLUMN ));
+    memset( &Reader->ValueColumn, 0, sizeof( ARROW_COLUMN ));
+
+    Fields = FlatVector( Data, Size, Schema, 1, 4, &FieldCount );
+
+    for ( size_t Index = 0; Index < FieldCount; Index += 1 )
+    {
+        Field   = FlatDereference( Data, Size, Fields + 4 * Index );
+        Name    = FlatDereference( Data, Size, FlatField( Data, Size, Field, 0, 4 ));
+        Type    = FlatDereference( Data, Size, FlatField( Data, Size, Field, 3, 4 ));
+        Column  = NULL;
+
+        if ( Name ) {
+            NameLength = FlatRead( Data, Name, 4 );
+            if ( NameLength > Size - Name - 4 ) NameLength = 0;
+            if (( NameLength == strlen( URLFieldName )) && 
+                ( memcmp( Data + Name + 4, URLFieldName, NameLength ) == 0 ))
+                Column = &Reader->URLColumn;
+            else if (( NameLength == strlen( ValueFieldName )) && 
+                     ( memcmp( Data + Name + 4, ValueFieldName, NameLength ) == 0 ))
+                Column = &Reader->ValueColumn; }
+
+        if ( Column ) {
+            if ( FlatField( Data, Size, Field, 4, 4 )) {
+                printf("Arrow column %.*s is dictionary-encoded, which isn't supported\n",
+                        ( int ) NameLength, Data + Name + 4 );
+                return ( false ); }
+            Column->Type    = FlatScalar( Data, Size, Field, 2, 1, 0 );
+            Column->Node    = Nodes;
+            Column->Buffer  = Buffers;
+            if ( Column->Type == ARROW_TYPE_INT ) {
+                Column->BitWidth    = FlatScalar( Data, Size, Type, 0, 4, 0 );
+                Column->Signed      = FlatScalar( Data, Size, Type, 1, 1, 0 ); }
+            else if ( Column->Type == ARROW_TYPE_FLOATING_POINT )
+                Column->BitWidth    = FlatScalar( Data, Size, Type, 0, 2, 0 ) == ARROW_PRECISION_DOUBLE ? 64 :
+                                      FlatScalar( Data, Size, Type, 0, 2, 0 ) == ARROW_PRECISION_SINGLE ? 32 : 0;
+        }
+
+        if ( !CountArrowField( Data, Size, Field, &Nodes, &Buffers )) {
+            printf("Arrow input has a column type that isn't supported\n");
+            return ( false ); }
+    }
+
+    if (( Reader->URLColumn.Type != ARROW_TYPE_UTF8 ) && 
+        ( Reader->URLColumn.Type != ARROW_TYPE_LARGE_UTF8 )) {
+        printf("Arrow input needs a utf8 column named %s\n", URLFieldName );
+        return ( false ); }
+
+    if ((( Reader->ValueColumn.Type != ARROW_TYPE_INT ) && 
+         ( Reader->ValueColumn.Type != ARROW_TYPE_FLOATING_POINT )) ||
+        (( Reader->ValueColumn.BitWidth != 8  ) && ( Reader->ValueColumn.BitWidth != 16 ) &&
+         ( Reader->ValueColumn.BitWidth != 32 ) && ( Reader->ValueColumn.BitWidth != 64 ))) {
+        printf("Arrow input needs an integer or float/double column named %s\n", 
+                ValueFieldName );
+        return ( false ); }
+
+    Reader->HaveSchema = true;
+    return ( true );
+}
+
+
+/*  Locates buffer Index of a record batch in the message body  */
+
+static const unsigned char* GetArrowBuffer( const unsigned char* Data, size_t Buffers, 
+                                            long Index, const unsigned char* Body, 
+                                            size_t BodyLength, size_t MinimumLength )
+{
+    unsigned long   Offset  = FlatRead( Data, Buffers + 16 * Index, 8 );
+    unsigned long   Length  = FlatRead( Data, Buffers + 16 * Index + 8, 8 );
+
+    if (( Offset > BodyLength ) || ( Length > BodyLength - Offset ) || 
+        ( Length < MinimumLength ))
+        return ( NULL );
+    return ( Body + Offset );
+}
+
+
+/*  Sets the reader up for the rows of a RecordBatch message  */
+
+static bool ReadArrowRecordBatch( ARROW_READER* Reader, const unsigned char* Data, 
+                                  size_t Size, size_t Batch, 
+                                  const unsigned char* Body, size_t BodyLength )
+{
+    ARROW_COLUMN*   URLColumn   = &Reader->URLColumn;
+    ARROW_COLUMN*   ValueColumn = &Reader->ValueColumn;
+    long            Length      = FlatScalar( Data, Size, Batch, 0, 8, 0 );
+    size_t          Nodes       = 0;
+    size_t          NodeCount   = 0;
+    size_t          Buffers     = 0;
+    size_t          BufferCount = 0;
+    size_t          OffsetWidth = ( URLColumn->Type == ARROW_TYPE_LARGE_UTF8 ) ? 8 : 4;
+    unsigned long   URLDataLength = 0;
+
+    if ( FlatField( Data, Size, Batch, 3, 4 )) {
+        printf("Compressed Arrow record batches aren't supported\n");
+        return ( false ); }
+
+    Nodes   = FlatVector( Data, Size, Batch, 1, 16, &NodeCount );
+    Buffers = FlatVector( Data, Size, Batch, 2, 16, &BufferCount );
+
+    if (( Length < 0 ) ||
+        (( size_t ) std::max( URLColumn->Node, ValueColumn->Node ) >= NodeCount ) ||
+        (( size_t ) URLColumn->Buffer + 2 >= BufferCount ) ||
+        (( size_t ) ValueColumn->Buffer + 1 >= BufferCount ))
+        goto Malformed;
+
+    /*  A validity buffer is only needed when there are nulls  */
+    Reader->URLValidity     = NULL;
+    Reader->ValueValidity   = NULL;
+    if ( FlatRead( Data, Nodes + 16 * URLColumn->Node + 8, 8 ))
+        if ( !( Reader->URLValidity = GetArrowBuffer( Data, Buffers, URLColumn->Buffer, 
+                                                      Body, BodyLength, ( Length + 7 ) / 8 )))
+            goto Malformed;
+    if ( FlatRead( Data, Nodes + 16 * ValueColumn->Node + 8, 8 ))
+        if ( !( Reader->ValueValidity = GetArrowBuffer( Data, Buffers, ValueColumn->Buffer, 
+                                                        Body, BodyLength, ( Length + 7 ) / 8 )))
+            goto Malformed;
+
+    Reader->URLOffsets  = GetArrowBuffer( Data, Buffers, URLColumn->Buffer + 1, 
+                                          Body, BodyLength, ( Length + 1 ) * OffsetWidth );
+    Reader->URLData     = ( const char* ) GetArrowBuffer( Data, Buffers, URLColumn->Buffer + 2, 
+                                                          Body, BodyLength, 0 );
+    Reader->Values      = GetArrowBuffer( Data, Buffers, ValueColumn->Buffer + 1, 
+                                          Body, BodyLength, Length * ValueColumn->BitWidth / 8 );
+    URLDataLength       = FlatRead( Data, Buffers + 16 * ( URLColumn->Buffer + 2 ) + 8, 8 );
+
+    /*  An empty batch may leave out the offsets  */
+    if (( Length ) && (( !Reader->URLOffsets ) || ( !Reader->URLData ) || ( !Reader->Values )))
+        goto Malformed;
+
+    Reader->URLDataLength   = URLDataLength;
+    Reader->RowCount        = Length;
+    Reader->NextRow         = 0;
+    return ( true );
+
+    Malformed:
+        printf("Malformed Arrow record batch\n");
+        return ( false );
+}
+
+
+/*  Reads the next message of the stream, and the schema or record  */
+/*  batch in it.  Other messages, like dictionaries, are skipped.   */
+/*  Returns false at the end of the stream, or on an error.         */
+
+static bool ReadArrowMessage( ARROW_READER* Reader )
+{
+    const unsigned char*    Metadata        = NULL;
+    size_t                  Position        = Reader->Position;
+    size_t                  MetadataLength  = 0;
+    size_t                  Message         = 0;
+    size_t                  Header          = 0;
+    unsigned long           BodyLength      = 0;
+    long                    HeaderType      = 0;
+
+    if ( Position + 4 > Reader->Size ) return ( false );
+
+    /*  The length is after a continuation marker, except in  */
+    /*  streams written before Arrow 0.15                     */
+    MetadataLength = FlatRead( Reader->Map, Position, 4 );
+    Position += 4;
+    if ( MetadataLength == ARROW_CONTINUATION ) {
+        if ( Position + 4 > Reader->Size ) return ( false );
+        MetadataLength = FlatRead( Reader->Map, Position, 4 );
+        Position += 4; }
+
+    /*  A zero length marks the end of the stream  */
+    if ( !MetadataLength ) return ( false );
+    if ( MetadataLength > Reader->Size - Position ) goto Malformed;
+
+    /*  The root offset to the Message table is at the start  */
+    Metadata    = Reader->Map + Position;
+    Message     = ( MetadataLength >= 4 ) ? FlatRead( Metadata, 0, 4 ) : 0;
+    if ( Message + 4 > MetadataLength ) Message = 0;
+    HeaderType  = FlatScalar( Metadata, MetadataLength, Message, 1, 1, 0 );
+    Header      = FlatDereference( Metadata, MetadataLength, 
+                                   FlatField( Metadata, MetadataLength, Message, 2, 4 ));
+    BodyLength  = FlatScalar( Metadata, MetadataLength, Message, 3, 8, 0 );
+    Position   += MetadataLength;
+
+    if (( !Message ) || ( BodyLength > Reader->Size - Position )) goto Malformed;
+    Reader->Position = Position + BodyLength;
+
+    if ( HeaderType == ARROW_HEADER_SCHEMA )
+        return ( ReadArrowSchema( Reader, Metadata, MetadataLength, Header ));
+
+    if ( HeaderType == ARROW_HEADER_RECORD_BATCH ) {
+        if ( !Reader->HaveSchema ) goto Malformed;
+        return ( ReadArrowRecordBatch( Reader, Metadata, MetadataLength, Header,
+                                       Reader->Map + Position, BodyLength )); }
+
+    return ( true );
+
+    Malformed:
+        printf("Malformed Arrow message at offset %lu\n", Reader->Position );
+        return ( false );
+}
+
+
+/*  Converts the value of a row.  The common cases are stored as  */
+/*  keys directly, the rest go through the text parser so the     */
+/*  range checks and --rank-by work as they do for text input.    */
+
+static int ReadArrowValue( ARROW_READER* Reader, long Row, PARSED_LINE* Parsed )
+{
+    const unsigned long     TopBit      = 0x8000000000000000UL;
+    const ARROW_COLUMN*     Column      = &Reader->ValueColumn;
+    const unsigned char*    Value       = Reader->Values + Row * ( Column->BitWidth / 8 );
+    long                    Integer     = 0;
+    double                  Double      = 0;
+    float                   Single      = 0;
+    char                    Text        [ 32 ];
+
+    Parsed->HighValue = 0;
+
+    if ( Column->Type == ARROW_TYPE_FLOATING_POINT ) {
+        if ( Column->BitWidth == 64 )
+            memcpy( &Double, Value, 8 );
+        else if ( Column->BitWidth == 32 ) {
+            memcpy( &Single, Value, 4 );
+            Double = Single; }
+        else
+            return ( PARSE_ERROR_BAD_VALUE );
+
+        if (( ValueType == VALUE_TYPE_F64 ) && ( !RankExpression )) {
+            if ( UNLIKELY( Double != Double )) return ( PARSE_ERROR_BAD_VALUE );
+            Parsed->LongValue = EncodeDoubleKey( Double );
+            return ( PARSE_OK ); }
+        snprintf( Text, sizeof( Text ), "%.17g", Double ); }
+    else {
+        /*  Sign or zero extended to 64 bits  */
+        Integer = ( long ) FlatRead( Value, 0, Column->BitWidth / 8 );
+        if (( Column->Signed ) && ( Column->BitWidth < 64 ))
+            Integer = ( Integer << ( 64 - Column->BitWidth )) >> ( 64 - Column->BitWidth );
+
+        if ( !RankExpression ) {
+            if (( ValueType == VALUE_TYPE_I64 ) && (( Column->Signed ) || ( Integer >= 0 ))) {
+                Parsed->LongValue = Integer;
+                return ( PARSE_OK ); }
+            if (( ValueType == VALUE_TYPE_U64 ) && (( !Column->Signed ) || ( Integer >= 0 ))) {
+                Parsed->LongValue = ( long )(( unsigned long ) Integer ^ TopBit );
+                return ( PARSE_OK ); }
+        }
+        snprintf( Text, sizeof( Text ), Column->Signed ? "%ld" : "%lu", Integer ); }
+
+    return ( ParseRecordValue( Text, strlen( Text ), Parsed ));
+}
+
+
+/*  Parses a row of the current record batch.  The URL is copied  */
+/*  into the block's buffer, NUL-terminated for the filters.       */
+
+static int ReadArrowRow( ARROW_READER* Reader, long Row, RECORD_BLOCK* Block, 
+                         PARSED_LINE* Parsed )
+{
+    size_t      OffsetWidth = ( Reader->URLColumn.Type == ARROW_TYPE_LARGE_UTF8 ) ? 8 : 4;
+    size_t      Start       = FlatRead( Reader->URLOffsets, Row * OffsetWidth, OffsetWidth );
+    size_t      End         = FlatRead( Reader->URLOffsets, ( Row + 1 ) * OffsetWidth, OffsetWidth );
+    int         Status      = PARSE_OK;
+
+    Parsed->ExtraColumns    = false;
+    Parsed->URL             = Block->Buffer + Block->Length;
+    Parsed->URLLength       = 0;
+
+    if (( Reader->URLValidity ) && 
+        ( !( Reader->URLValidity[ Row / 8 ] & ( 1 << ( Row % 8 )))))
+        return ( PARSE_ERROR_MISSING_COLUMN );
+    if (( Start > End ) || ( End > Reader->URLDataLength ) ||
+        ( Block->Length + End - Start + 1 > Block->BufferSize ))
+        return ( PARSE_ERROR_BAD_RECORD );
+
+    Parsed->URLLength = End - Start;
+    memcpy( Parsed->URL, Reader->URLData + Start, Parsed->URLLength );
+    Parsed->URL[ Parsed->URLLength ] = '\0';
+    Block->Length += Parsed->URLLength + 1;
+
+    Status = ParseURLColumn( Parsed );
+    if ( Status != PARSE_OK ) return ( Status );
+
+    if (( Reader->ValueValidity ) && 
+        ( !( Reader->ValueValidity[ Row / 8 ] & ( 1 << ( Row % 8 )))))
+        return ( PARSE_ERROR_MISSING_COLUMN );
+
+    return ( ReadArrowValue( Reader, Row, Parsed ));
+}
+
+
+/*  Reads up to ARROW_BLOCK_ROWS rows of an Arrow IPC file or  */
+/*  stream into the block.  The file is mapped the first time  */
+/*  through, and read from the mapping from then on.           */
+
+static bool ReadArrowRows( FILE* File, RECORD_BLOCK* Block )
+{
+    ARROW_READER*   Reader      = &ArrowInput;
+    struct stat     FileStat;
+    PARSED_LINE     Parsed;
+    size_t          OffsetWidth = 0;
+    size_t          URLBytes    = 0;
+    size_t          NewSize     = 0;
+    char*           NewBuffer   = NULL;
+    long            EndRow      = 0;
+    int             Status      = PARSE_OK;
+
+    if ( !Reader->Opened ) {
+        Reader->Opened = true;
+        if (( fstat( fileno( File ), &FileStat ) != 0 ) || ( FileStat.st_size < 8 ))
+            return ( false );
+        Reader->Map = ( const unsigned char* ) mmap( NULL, FileStat.st_size, PROT_READ, 
+                                                     MAP_PRIVATE, fileno( File ), 0 );
+        if ( Reader->Map == MAP_FAILED ) {
+            Reader->Map = NULL;
+            printf("Failed to map the Arrow input file\n");
+            return ( false ); }
+        madvise(( void* ) Reader->Map, FileStat.st_size, MADV_SEQUENTIAL );
+        Reader->Size = FileStat.st_size;
+
+        /*  The file format is a stream between magic strings  */
+        if ( memcmp( Reader->Map, "ARROW1", 6 ) == 0 )
+            Reader->Position = 8;
+    }
+
+    if ( !Reader->Map ) return ( false );
+
+    while ( Reader->NextRow >= Reader->RowCount )
+        if ( !ReadArrowMessage( Reader ))
+            return ( false );
+
+    EndRow      = std::min( Reader->RowCount, Reader->NextRow + ARROW_BLOCK_ROWS );
+    OffsetWidth = ( Reader->URLColumn.Type == ARROW_TYPE_LARGE_UTF8 ) ? 8 : 4;
+    URLBytes    = FlatRead( Reader->URLOffsets, EndRow * OffsetWidth, OffsetWidth ) -
+                  FlatRead( Reader->URLOffsets, Reader->NextRow * OffsetWidth, OffsetWidth );
+
+    /*  Room for the URLs and their NULs.  Bad offsets are caught  */
+    /*  by ReadArrowRow(), so just don't allocate for them here.   */
+    if ( URLBytes > Reader->URLDataLength ) URLBytes = 0;
+    NewSize = URLBytes + ( EndRow - Reader->NextRow ) + 1;
+    if ( Block->BufferSize < NewSize ) {
+        NewBuffer = ( char* ) realloc( Block->Buffer, NewSize );
+        if ( !NewBuffer ) {
+            printf("Failed to allocate a %lu byte record block\n", NewSize );
+            return ( false ); }
+        Block->Buffer       = NewBuffer;
+        Block->BufferSize   = NewSize; }
+
+    for ( long Row = Reader->NextRow; Row < EndRow; Row += 1 ) {
+        Status = ReadArrowRow( Reader, Row, Block, &Parsed );
+        AppendRecordRow( Block, &Parsed, Status ); }
+
+    Reader->NextRow = EndRow;
+    Block->Parsed   = Block->Length;
+    return ( true );
+}
+
+
+/*  FlatBuffers for the output file are built front to back: each  */
+/*  table is written before the tables and vectors it refers to,   */
+/*  and their offsets are patched in once they have been written.  */
+
+typedef struct _FLAT_FIELD
+{
+    int     Width;      // bytes, 0 if the field is absent
+    long    Value;      // ignored for offsets, which get patched
+}   FLAT_FIELD;
+
+static void FlatAppend( std::vector<unsigned char>* Out, unsigned long Value, int Width )
+{
+    for ( int Byte = 0; Byte < Width; Byte += 1 )
+        Out->push_back(( unsigned char )( Value >> ( 8 * Byte )));
+}
+
+static void FlatPatch( std::vector<unsigned char>* Out, size_t Position, size_t Target )
+{
+    unsigned int    Offset  = ( unsigned int )( Target - Position );
+
+    memcpy( Out->data() + Position, &Offset, 4 );
+}
+
+
+/*  Writes a vtable and the 8-byte aligned table after it.  The  */
+/*  positions of the fields are returned in Positions, for the   */
+/*  offsets to be patched.  Returns the table's position.        */
+
+static size_t FlatWriteTable( std::vector<unsigned char>* Out, int Count, 
+                              const FLAT_FIELD* Fields, size_t* Positions )
+{
+    size_t      Offsets     [ 8 ];
+    size_t      TableSize   = 4;
+    size_t      VTableSize  = 4 + 2 * Count;
+    size_t      VTable      = 0;
+    size_t      Table       = 0;
+
+    for ( int Field = 0; Field < Count; Field += 1 ) {
+        Offsets[ Field ] = 0;
+        if ( !Fields[ Field ].Width ) continue;
+        TableSize = ( TableSize + Fields[ Field ].Width - 1 ) & ~( size_t )( Fields[ Field ].Width - 1 );
+        Offsets[ Field ] = TableSize;
+        TableSize += Fields[ Field ].Width; }
+
+    if ( Out->size() % 2 ) Out->push_back( 0 );
+    while (( Out->size() + VTableSize ) % 8 ) 
+        FlatAppend( Out, 0, 2 );
+
+    VTable = Out->size();
+    FlatAppend( Out, VTableSize, 2 );
+    FlatAppend( Out, TableSize, 2 );
+    for ( int Field = 0; Field < Count; Field += 1 )
+        FlatAppend( Out, Offsets[ Field ], 2 );
+
+    Table = Out->size();
+    FlatAppend( Out, Table - VTable, 4 );
+    for ( int Field = 0; Field < Count; Field += 1 ) {
+        if ( !Fields[ Field ].Width ) continue;
+        while ( Out->size() < Table + Offsets[ Field ] ) Out->push_back( 0 );
+        if ( Positions ) Positions[ Field ] = Out->size();
+        FlatAppend( Out, Fields[ Field ].Value, Fields[ Field ].Width ); }
+    while ( Out->size() < Table + TableSize ) Out->push_back( 0 );
+
+    return ( Table );
+}
+
+
+/*  Writes a vector, of zeroes if Elements is NULL, to be patched  */
+
+static size_t FlatWriteVector( std::vector<unsigned char>* Out, size_t Count, 
+                               size_t ElementSize, const void* Elements )
+{
+    size_t      Alignment   = ( ElementSize >= 8 ) ? 8 : 4;
+    size_t      Vector      = 0;
+
+    while (( Out->size() + 4 ) % Alignment ) Out->push_back( 0 );
+    Vector = Out->size();
+    FlatAppend( Out, Count, 4 );
+    if ( Elements )
+        Out->insert( Out->end(), ( const unsigned char* ) Elements, 
+                     ( const unsigned char* ) Elements + Count * ElementSize );
+    else
+        Out->resize( Out->size() + Count * ElementSize, 0 );
+
+    return ( Vector );
+}
+
+
+/*  Writes the Schema table of the output: the URL column, and  */
+/*  the value column as Type, which is Utf8 for values that     */
+/*  don't fit a 64-bit number                                   */
+
+static size_t WriteArrowSchema( std::vector<unsigned char>* Out, int Type, bool Signed )
+{
+    const char*     Names       [ 2 ] = { URLFieldName, ValueFieldName };
+    int             Types       [ 2 ] = { ARROW_TYPE_UTF8, Type };
+    FLAT_FIELD      SchemaFields[ 2 ] = {{ 2, 0 }, { 4, 0 }};
+    size_t          SchemaPositions [ 2 ];
+    size_t          FieldPositions  [ 6 ];
+    size_t          Schema      = 0;
+    size_t          Fields      = 0;
+    size_t          Position    = 0;
+
+    Schema  = FlatWriteTable( Out, 2, SchemaFields, SchemaPositions );
+    Fields  = FlatWriteVector( Out, 2, 4, NULL );
+    FlatPatch( Out, SchemaPositions[1], Fields );
+
+    for ( int Column = 0; Column < 2; Column += 1 )
+    {
+        /*  name, nullable, type_type, type, dictionary, children  */
+        FLAT_FIELD  FieldFields [ 6 ] = {{ 4, 0 }, { 1, 0 }, { 1, Types[ Column ] }, 
+                                         { 4, 0 }, { 0, 0 }, { 4, 0 }};
+        FLAT_FIELD  IntFields   [ 2 ] = {{ 4, 64 }, { 1, Signed }};
+        FLAT_FIELD  FloatFields [ 1 ] = {{ 2, ARROW_PRECISION_DOUBLE }};
+
+        Position = FlatWriteTable( Out, 6, FieldFields, FieldPositions );
+        FlatPatch( Out, Fields + 4 + 4 * Column, Position );
+
+        Position = FlatWriteVector( Out, strlen( Names[ Column ] ), 1, Names[ Column ] );
+        Out->push_back( 0 );
+        FlatPatch( Out, FieldPositions[0], Position );
+
+        if ( Types[ Column ] == ARROW_TYPE_INT )
+            Position = FlatWriteTable( Out, 2, IntFields, NULL );
+        else if ( Types[ Column ] == ARROW_TYPE_FLOATING_POINT )
+            Position = FlatWriteTable( Out, 1, FloatFields, NULL );
+        else
+            Position = FlatWriteTable( Out, 0, NULL, NULL );
+        FlatPatch( Out, FieldPositions[3], Position );
+
+        Position = FlatWriteVector( Out, 0, 4, NULL );
+        FlatPatch( Out, FieldPositions[5], Position );
+    }
+
+    return ( Schema );
+}
+
+
+/*  Writes an encapsulated message: the continuation marker, the  */
+/*  length of the metadata padded to 8 bytes, the metadata, and   */
+/*  the body.  The footer's Block for it goes into Block.         */
+
+static bool WriteArrowMessage( FILE* File, std::vector<unsigned char>* Metadata, 
+                               const std::vector<unsigned char>* Body, 
+                               unsigned char* Block )
+{
+    long            Offset          = ftell( File );
+    unsigned int    Prefix      [ 2 ];
+    long            MetadataLength  = 0;
+    long            BodyLength      = Body ? Body->size() : 0;
+
+    while ( Metadata->size() % 8 ) Metadata->push_back( 0 );
+    Prefix[0]       = ARROW_CONTINUATION;
+    Prefix[1]       = Metadata->size();
+    MetadataLength  = sizeof( Prefix ) + Metadata->size();
+
+    /*  offset, metaDataLength, padding, bodyLength  */
+    if ( Block ) {
+        memset( Block, 0, 24 );
+        memcpy( Block, &Offset, 8 );
+        memcpy( Block + 8, &MetadataLength, 4 );
+        memcpy( Block + 16, &BodyLength, 8 ); }
+
+    return (( fwrite( Prefix, sizeof( Prefix ), 1, File ) == 1 ) &&
+            ( fwrite( Metadata->data(), Metadata->size(), 1, File ) == 1 ) &&
+            (( !BodyLength ) || ( fwrite( Body->data(), BodyLength, 1, File ) == 1 )));
+}
+
+
+/*  Appends a buffer to a record batch body, 8-byte aligned, and  */
+/*  its offset and length to the batch's list of Buffers          */
+
+static void AddArrowBuffer( std::vector<unsigned char>* Body, std::vector<long>* Buffers,
+                            const void* Data, size_t Length )
+{
+    Buffers->push_back( Body->size() );
+    Buffers->push_back( Length );
+    Body->insert( Body->end(), ( const unsigned char* ) Data, 
+                  ( const unsigned char* ) Data + Length );
+    while ( Body->size() % 8 ) Body->push_back( 0 );
+}
+
+
+/*  Writes the results to an Arrow IPC file, with one record batch  */
+/*  of a url and a value column.  i64, u64 and f64 values keep      */
+/*  their type, i128 and decimal values are written as text.        */
+
+bool WriteArrowFile( const char* FileName, std::vector<DATA_ITEM*>* DataVector )
+{
+    const unsigned long         TopBit      = 0x8000000000000000UL;
+    const unsigned int          EndOfStream [ 2 ] = { ARROW_CONTINUATION, 0 };
+    FILE*                       File        = NULL;
+    std::vector<unsigned char>  Metadata;
+    std::vector<unsigned char>  Body;
+    std::vector<long>           Buffers;
+    std::vector<int>            Offsets;
+    std::vector<char>           Text;
+    std::vector<long>           Values;
+    unsigned char               Block       [ 24 ];
+    long                        Nodes       [ 4 ];
+    size_t                      Positions   [ 4 ];
+    size_t                      Position    = 0;
+    long                        Rows        = DataVector->size();
+    int                         Type        = ARROW_TYPE_UTF8;
+    bool                        Status      = false;
+    char                        Value       [ 64 ];
+
+    if ( ValueType == VALUE_TYPE_F64 )
+        Type = ARROW_TYPE_FLOATING_POINT;
+    else if (( ValueType == VALUE_TYPE_I64 ) || ( ValueType == VALUE_TYPE_U64 ))
+        Type = ARROW_TYPE_INT;
+
+    /*  The URL column  */
+    Offsets.push_back( 0 );
+    for ( DATA_ITEM* Item : *DataVector ) {
+        Text.insert( Text.end(), Item->URL, Item->URL + strlen( Item->URL ));
+        if ( Text.size() > INT_MAX ) {
+            printf("Results are too large for an Arrow utf8 column\n");
+            return ( false ); }
+        Offsets.push_back( Text.size() ); }
+
+    AddArrowBuffer( &Body, &Buffers, NULL, 0 );
+    AddArrowBuffer( &Body, &Buffers, Offsets.data(), Offsets.size() * sizeof( int ));
+    AddArrowBuffer( &Body, &Buffers, Text.data(), Text.size() );
+
+    /*  The value column, as numbers or their text  */
+    AddArrowBuffer( &Body, &Buffers, NULL, 0 );
+    if ( Type == ARROW_TYPE_UTF8 ) {
+        Offsets.assign( 1, 0 );
+        Text.clear();
+        for ( DATA_ITEM* Item : *DataVector ) {
+            FormatValue( Item, Value, sizeof( Value ));
+            Text.insert( Text.end(), Value, Value + strlen( Value ));
+            Offsets.push_back( Text.size() ); }
+        AddArrowBuffer( &Body, &Buffers, Offsets.data(), Offsets.size() * sizeof( int ));
+        AddArrowBuffer( &Body, &Buffers, Text.data(), Text.size() ); }
+    else {
+        for ( DATA_ITEM* Item : *DataVector ) {
+            double  Double  = DecodeDoubleKey( Item->LongValue );
+            if ( ValueType == VALUE_TYPE_F64 )
+                memcpy( &Values.emplace_back(), &Double, sizeof( Double ));
+            else if ( ValueType == VALUE_TYPE_U64 )
+                Values.push_back(( long )(( unsigned long ) Item->LongValue ^ TopBit ));
+            else
+                Values.push_back( Item->LongValue ); }
+        AddArrowBuffer( &Body, &Buffers, Values.data(), Values.size() * sizeof( long )); }
+
+    File = fopen( FileName, "wb" );
+    if ( !File ) {
+        printf("Failed to create Arrow output file: %s\n", FileName );
+        return ( false ); }
+
+    if ( fwrite( "ARROW1\0\0", 8, 1, File ) != 1 ) goto Failed;
+
+    /*  The Schema message  */
+    {
+        FLAT_FIELD  MessageFields[ 4 ] = {{ 2, ARROW_METADATA_V5 }, { 1, ARROW_HEADER_SCHEMA }, 
+                                          { 4, 0 }, { 8, 0 }};
+        FlatAppend( &Metadata, 0, 4 );
+        Position = FlatWriteTable( &Metadata, 4, MessageFields, Positions );
+        FlatPatch( &Metadata, 0, Position );
+        FlatPatch( &Metadata, Positions[2], WriteArrowSchema( &Metadata, Type, ValueType != VALUE_TYPE_U64 ));
+        if ( !WriteArrowMessage( File, &Metadata, NULL, NULL )) goto Failed;
+    }
+
+    /*  The RecordBatch message, with a FieldNode per column  */
+    {
+        FLAT_FIELD  MessageFields[ 4 ] = {{ 2, ARROW_METADATA_V5 }, { 1, ARROW_HEADER_RECORD_BATCH }, 
+                                          { 4, 0 }, { 8, ( long ) Body.size() }};
+        FLAT_FIELD  BatchFields  [ 3 ] = {{ 8, Rows }, { 4, 0 }, { 4, 0 }};
+        size_t      BatchPositions [ 3 ];
+
+        Nodes[0] = Rows;    Nodes[1] = 0;
+        Nodes[2] = Rows;    Nodes[3] = 0;
+
+        Metadata.clear();
+        FlatAppend( &Metadata, 0, 4 );
+        Position = FlatWriteTable( &Metadata, 4, MessageFields, Positions );
+        FlatPatch( &Metadata, 0, Position );
+        Position = FlatWriteTable( &Metadata, 3, BatchFields, BatchPositions );
+        FlatPatch( &Metadata, Positions[2], Position );
+        FlatPatch( &Metadata, BatchPositions[1], FlatWriteVector( &Metadata, 2, 16, Nodes ));
+        FlatPatch( &Metadata, BatchPositions[2], 
+                   FlatWriteVector( &Metadata, Buffers.size() / 2, 16, Buffers.data() ));
+        if ( !WriteArrowMessage( File, &Metadata, &Body, Block )) goto Failed;
+    }
+
+    if ( fwrite( EndOfStream, sizeof( EndOfStream ), 1, File ) != 1 ) goto Failed;
+
+    /*  The footer repeats the schema, and locates the batch  */
+    {
+        FLAT_FIELD  FooterFields [ 4 ] = {{ 2, ARROW_METADATA_V5 }, { 4, 0 }, { 4, 0 }, { 4, 0 }};
+        int         FooterLength = 0;
+
+        Metadata.clear();
+        FlatAppend( &Metadata, 0, 4 );
+        Position = FlatWriteTable( &Metadata, 4, FooterFields, Positions );
+        FlatPatch( &Metadata, 0, Position );
+        FlatPatch( &Metadata, Positions[1], WriteArrowSchema( &Metadata, Type, ValueType != VALUE_TYPE_U64 ));
+        FlatPatch( &Metadata, Positions[2], FlatWriteVector( &Metadata, 0, 24, NULL ));
+        FlatPatch( &Metadata, Positions[3], FlatWriteVector( &Metadata, 1, 24, Block ));
+
+        FooterLength = Metadata.size();
+        if (( fwrite( Metadata.data(), Metadata.size(), 1, File ) != 1 ) ||
+            ( fwrite( &FooterLength, sizeof( FooterLength ), 1, File ) != 1 ) ||
+            ( fwrite( "ARROW1", 6, 1, File ) != 1 ))
+            goto Failed;
+    }
+
+    if ( fclose( File ) != 0 ) {
+        File = NULL;
+        goto Failed; }
+    File = NULL;
+
+    printf("Wrote %ld results to Arrow file: %s\n", Rows, FileName );
+    Status = true;
+    goto Cleanup;
+
+    Failed:
+        printf("Failed to write Arrow output file: %s, %s\n", 
+                FileName, strerror( errno ));
+        goto Cleanup;
+
+    Cleanup:
+        if ( File ) fclose( File );
+        return ( Status );
+}
+
+
+/*  Reads the next chunk of the file into Target.  With read-ahead,   */
+/*  the chunk was already read on ReadThread while the last block     */
+/*  was being parsed, so it is only copied, and the read of the one   */
+/*  after it is started.  This way a cold file's read latency is      */
+/*  hidden behind the parsing.  Returns 0 at the end of the file.     */
+
+static size_t ReadBlockChunk( FILE* File, RECORD_BLOCK* Block, char* Target, size_t Size )
+{
+    size_t      Length      = 0;
+
+    if ( !ReadAhead )
+        return ( fread( Target, 1, Size, File ));
+
+    if ( !Block->NextChunk ) {
+        Block->NextChunk = ( char* ) malloc( RECORD_BLOCK_READ_SIZE );
+        if ( !Block->NextChunk )
+            return ( fread( Target, 1, Size, File ));
+        Block->NextChunkLength = fread( Block->NextChunk, 1, RECORD_BLOCK_READ_SIZE, File ); }
+
+    if ( Block->ReadPending ) {
+        Block->ReadThread.join();
+        Block->ReadPending = false; }
+
+    /*  Size is always at least a whole read, see ReadRecordBlock()  */
+    Length = Block->NextChunkLength;
+    memcpy( Target, Block->NextChunk, Length );
+
+    if ( Length ) {
+        Block->ReadPending  = true;
+        Block->ReadThread   = std::thread( [ File, Block ]() {
+            Block->NextChunkLength = fread( Block->NextChunk, 1, 
+                                            RECORD_BLOCK_READ_SIZE, File ); });
+    }
+
+    return ( Length );
+}
+
+
+/*  Waits for a read that is still in flight, before the file is  */
+/*  closed or its position is used                                */
+
+void StopReadAhead( RECORD_BLOCK* Block )
+{
+    if ( Block->ReadPending ) {
+        Block->ReadThread.join();
+        Block->ReadPending = false; }
+}
+
+
+/*  Reads the next block of lines from the file and parses them   */
+/*  into the Block's columns.  The partial line at the end of the  */
+/*  previous block is moved to the front of the buffer first, and  */
+/*  the buffer only grows for a line longer than a whole read.     */
+/*  Returns false at the end of the file.                          */
+
+bool ReadRecordBlock( FILE** FilePtr, RECORD_BLOCK* Block )
+{
+    PARSED_LINE     Parsed;
+    char*           NewBuffer       = NULL;
+    char*           Line            = NULL;
+    char*           End             = NULL;
+    char*           NewLine         = NULL;
+    size_t          NewSize         = 0;
+    size_t          BytesRead       = 0;
+    size_t          LineLength      = 0;
+    int             ParseStatus     = PARSE_OK;
+
+    Block->RowCount = 0;
+    Block->NextRow  = 0;
+    Block->LongValues.clear();
+    Block->HighValues.clear();
+    Block->URLOffsets.clear();
+    Block->URLLengths.clear();
+    Block->LineNumbers.clear();
+    Block->Status.clear();
+    Block->Attributes.clear();
+    Block->AttributesLengths.clear();
+    for ( int Column = 0; Column <= EXPRESSION_MAX_COLUMN; Column += 1 )
+        Block->Columns[ Column ].clear();
+    for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+        Block->Metrics[ Metric ].clear();
+
+    if ( Block->Parsed ) {
+        Block->FileOffset  += Block->Parsed;
+        Block->Length      -= Block->Parsed;
+        memmove( Block->Buffer, Block->Buffer + Block->Parsed, Block->Length );
+        Block->Parsed      = 0; }
+
+    /*  Arrow input has its rows in column buffers already  */
+    if ( InputFormat == INPUT_FORMAT_ARROW ) {
+        if ( !ReadArrowRows( *FilePtr, Block )) return ( false );
+        goto RowsParsed; }
+
+    /*  Read until there is at least one whole line, or the end.  */
+    /*  The +1 is room for the NUL after a last line that has no  */
+    /*  newline, which ParseDataLine() writes past its end.       */
+    while ( true )
+    {
+        if ( Block->BufferSize < Block->Length + RECORD_BLOCK_READ_SIZE + 1 ) {
+            NewSize     = std::max( Block->BufferSize * 2, 
+                                    Block->Length + RECORD_BLOCK_READ_SIZE + 1 );
+            NewBuffer   = ( char* ) realloc( Block->Buffer, NewSize );
+            if ( !NewBuffer ) {
+                printf("Failed to allocate a %lu byte record block\n", NewSize );
+                return ( false ); }
+            Block->Buffer       = NewBuffer;
+            Block->BufferSize   = NewSize; }
+
+        BytesRead = ReadBlockChunk( *FilePtr, Block, 
+                                    Block->Buffer + Block->Length, 
+                                    Block->BufferSize - Block->Length - 1 );
+        Block->Length += BytesRead;
+
+        if (( !BytesRead ) || 
+            ( memchr( Block->Buffer + Block->Length - BytesRead, '\n', BytesRead )))
+            break;
+    }
+
+    Line    = Block->Buffer;
+    End     = Block->Buffer + Block->Length;
+
+    while ( Line < End )
+    {
+        NewLine = ( char* ) memchr( Line, '\n', End - Line );
+
+        if ( NewLine )
+            LineLength = NewLine + 1 - Line;
+        else if ( BytesRead )
+            break;      // carried over to the next block
+        else if ( IncrementalStateFile ) {
+            /*  In incremental mode, a last line without a newline is   */
+            /*  most likely still being written.  Put it back and stop  */
+            /*  here so the next run picks it up once it is complete.   */
+            fseek( *FilePtr, -( long )( End - Line ), SEEK_CUR );
+            Block->Length = Line - Block->Buffer;
+            break; }
+        else {
+            LineLength  = End - Line;
+            *End        = '\0'; }
+
+        CountLength( &LineLengths, LineLength );
+        ParseStatus = ParseLineFunction( Line, LineLength, &Parsed );
+        if ( ParseStatus != PARSE_OK ) Parsed.URL = Line;
+        AppendRecordRow( Block, &Parsed, ParseStatus );
+        Line += LineLength;
+    }
+
+    Block->Parsed = Line - Block->Buffer;
+
+    RowsParsed:
+
+    if ( RankExpression )
+        EvaluateExpressionBlock( Block );
+
+    /*  The multi-metric mode keeps a total per metric instead  */
+    if (( !MetricCount ) && ( !TotalsPerRow ))
+        for ( long Row = 0; Row < Block->RowCount; Row += 1 )
+            if ( LIKELY( Block->Status[Row] == PARSE_OK ))
+                AccumulateValue( &ValueTotals, 
+                                 Block->LongValues[Row], 
+                                 Block->HighValues[Row] );
+
+    return ( Block->RowCount > 0 );
+}
+
+
+/*  Returns the next row of the Block that parsed, reading the  */
+/*  next block once this one is used up, or -1 at the end of    */
+/*  the file.                                                   */
+
+long NextRecordRow( FILE** FilePtr, RECORD_BLOCK* Block )
+{
+    long    Row     = 0;
+
+    while ( true )
+    {
+        while ( Block->NextRow < Block->RowCount ) {
+            Row = Block->NextRow++;
+            if ( LIKELY( Block->Status[Row] == PARSE_OK ))
+                return ( Row );
+        }
+
+        if ( !ReadRecordBlock( FilePtr, Block ))
+            return ( -1 );
+    }
+}
+
+
+/*  Reads the next line that parsed, for the consumers that go a  */
+/*  line at a time.  The PARSED_LINE points into the block, which */
+/*  is reused by a later call.  Returns false at the end of the   */
+/*  file.                                                         */
+
+bool ReadParsedLine( FILE** FilePtr, PARSED_LINE* Parsed )
+{
+    long    Row     = NextRecordRow( FilePtr, &InputBlock );
+
+    if ( Row < 0 ) return ( false );
+
+    Parsed->URL                 = InputBlock.Buffer + InputBlock.URLOffsets[Row];
+    Parsed->URLLength           = InputBlock.URLLengths[Row];
+    Parsed->LongValue           = InputBlock.LongValues[Row];
+    Parsed->HighValue           = InputBlock.HighValues[Row];
+    Parsed->ExtraColumns        = false;
+    Parsed->Attributes          = InputBlock.Attributes[Row];
+    Parsed->AttributesLength    = InputBlock.AttributesLengths[Row];
+
+    for ( int Metric = 0; Metric < MetricCount; Metric += 1 )
+        Parsed->Metrics[ Metric ] = InputBlock.Metrics[ Metric ][Row];
+
+    return ( true );
+}
+
+
+/*  Copies one row of a block out into a new DATA_ITEM, which  */
+/*  the caller owns.  With DeferURLs, the URL isn't copied,     */
+/*  the item only notes where it is in the input file.          */
+/*  Returns NULL if out of memory.                              */
+
+DATA_ITEM* NewBlockDataItem( RECORD_BLOCK* Block, long Row )
+{
+    DATA_ITEM*      NewDataItem     = NULL;
+    char*           URL             = NULL;
+    size_t          URLLength       = Block->URLLengths[Row];
+
+    /* Allocate memory from the heap        */
+    /* to store the URL string, which       */
+    /* will be added to a DATA_ITEM struct  */
+    if ( !DeferURLs ) {
+        URL = ( char* ) malloc( URLLength + 1 );
+
+        if ( !URL ) {
+            printf("Failed to allocate URL\n");
+            goto Failed;
+        }
+
+        memcpy( URL, Block->Buffer + Block->URLOffsets[Row], URLLength );
+        URL[ URLLength ] = '\0';
+    }
+    
+    /*  Allocate new struct from the heap to store the data */
+    NewDataItem = ( DATA_ITEM* )
+                    malloc( sizeof( DATA_ITEM ));
+
+    if  ( !NewDataItem ) {
+            printf("Failed to allocate DATA_ITEM\n");
+            goto Failed; }
+
+    memset( NewDataItem, '\0', sizeof( DATA_ITEM ));
+    
+    /*  Fill in the new struct  */
+    NewDataItem->URL                = URL;
+    NewDataItem->LongValue          = Block->LongValues[Row];
+    NewDataItem->HighValue          = Block->HighValues[Row];
+    NewDataItem->Attributes         = Block->Attributes[Row];
+    NewDataItem->AttributesLength   = Block->AttributesLengths[Row];
+    NewDataItem->URLLength          = URLLength;
+    NewDataItem->URLOffset          = Block->FileOffset + Block->URLOffsets[Row];
+
+    /*  We are success  */
+    goto Exit;
+
+    Failed:
+        /*  URL should not be released under   */
+        /*  successful executions              */
+        if ( URL )
+            free ( URL );
+        goto Exit;
+        
+    Exit:
+        /*  Return the DATA_ITEM struct to the caller   */
+        /*  which will either be a valid one, or NULL   */
+        return(NewDataItem);
+}
+
+
+/*  Overwrites an item with a row of the block, keeping its URL  */
+/*  allocation if the new URL fits in it                         */
+
+bool ReuseBlockDataItem( DATA_ITEM* Item, RECORD_BLOCK* Block, long Row )
+{
+    size_t      URLLength   = Block->URLLengths[Row];
+    char*       URL         = Item->URL;
+
+    /*  With DeferURLs only the offset is kept, even if  */
+    /*  the item had a copy, as results resumed by -r do */
+    if ( DeferURLs ) {
+        free( Item->URL );
+        Item->URL = NULL; }
+
+    else {
+        if ( malloc_usable_size( URL ) < URLLength + 1 ) {
+            URL = ( char* ) realloc( URL, URLLength + 1 );
+            if ( !URL ) {
+                printf("Failed to allocate URL\n");
+                return ( false ); }
+            Item->URL = URL; }
+
+        memcpy( URL, Block->Buffer + Block->URLOffsets[Row], URLLength );
+        URL[ URLLength ] = '\0'; }
+
+    Item->LongValue         = Block->LongValues[Row];
+    Item->HighValue         = Block->HighValues[Row];
+    Item->Attributes        = Block->Attributes[Row];
+    Item->AttributesLength  = Block->AttributesLengths[Row];
+    Item->URLLength         = URLLength;
+    Item->URLOffset         = Block->FileOffset + Block->URLOffsets[Row];
+    return ( true );
+}
+
+
+/*  Reads back the URLs of the items that only know where      */
+/*  theirs is in the input file.  This runs on the results      */
+/*  once the scan is done, so of all the candidates only the    */
+/*  final N URLs are ever copied.  The URLs are read in file    */
+/*  order, a window of the file at a time, so the results of a  */
+/*  large -n don't take a system call each.                     */
+
+#define URL_READ_WINDOW_SIZE    ( 256L << 10 )
+
+bool MaterializeURLs( std::vector<DATA_ITEM*> *DataVector, FILE* DataFile )
+{
+    std::vector<std::pair<long, DATA_ITEM*>>    Pending;
+    std::vector<char>                           Window;
+    long                                        WindowOffset    = 0;
+    ssize_t                                     WindowLength    = 0;
+    char*                                       URL             = NULL;
+
+    if (( !DataVector ) || ( !DataFile )) return ( false );
+
+    /*  Sorted with the offsets alongside, not by looking  */
+    /*  them up in the items, which are all over the heap  */
+    for ( DATA_ITEM* Item : *DataVector )
+        if ( !Item->URL ) Pending.push_back( { Item->URLOffset, Item } );
+
+    std::sort( Pending.begin(), Pending.end() );
+
+    for ( auto& Entry : Pending )
+    {
+        DATA_ITEM*  Item    = Entry.second;
+
+        /*  Read the window that starts at this URL  */
+        if ( Item->URLOffset + Item->URLLength > WindowOffset + WindowLength ) {
+            Window.resize( std::max( URL_READ_WINDOW_SIZE, ( long ) Item->URLLength ));
+            WindowOffset = Item->URLOffset;
+            WindowLength = pread( fileno( DataFile ), Window.data(), Window.size(), WindowOffset );
+
+            if ( WindowLength < ( ssize_t ) Item->URLLength ) {
+                printf("Failed to read the result URLs back from input file: %s\n", 
+                        InputFileName );
+                return ( false ); }
+        }
+
+        URL = ( char* ) malloc( Item->URLLength + 1 );
+        if ( !URL ) {
+            printf("Failed to allocate URL\n");
+            return ( false ); }
+
+        memcpy( URL, Window.data() + ( Item->URLOffset - WindowOffset ), Item->URLLength );
+        URL[ Item->URLLength ] = '\0';
+        Item->URL = URL;
+    }
+
+    return ( true );
+}
+
+
+DATA_ITEM* GetNextDataItem(FILE** FilePtr)
+{
+    long    Row     = 0;
+
+    if ( !FilePtr ) return ( NULL );
+
+    Row = NextRecordRow( FilePtr, &InputBlock );
+    if ( Row < 0 ) return ( NULL );
+
+    return ( NewBlockDataItem( &InputBlock, Row ));
+}
+
+
+/*  Prints how many malformed lines were skipped, by type  */
+
+void PrintParseErrorSummary()
+{
+    long    SkippedLines    = 0;
+
+    for ( int Status = 1; Status < PARSE_FILTERED; Status += 1 )
+        SkippedLines += ParseErrorCounts[ Status ];
+
+    if ( SkippedLines ) {
+        printf("Skipped %ld malformed lines:\n", SkippedLines );
+        for ( int Status = 1; Status < PARSE_FILTERED; Status += 1 )
+            if ( ParseErrorCounts[ Status ] )
+                printf("    %-24s = %ld\n", 
+                        ParseStatusNames[ Status ], 
+                        ParseErrorCounts[ Status ] );
+    }
+
+    if ( ParseErrorCounts[ PARSE_FILTERED ] )
+        printf("Lines filtered by URL list = %ld\n", 
+                ParseErrorCounts[ PARSE_FILTERED ] );
+
+    if ( ExtraColumnLineCount )
+        printf("Lines with extra columns (ignored) = %ld\n", 
+                ExtraColumnLineCount );
+}
+    
+
+/*  main  */
+int main( int argc, char *argv[] )
+{
+    printf("\nClickHouse TakeHome v0.1\n\n");
+    if ( !ParseArgs( argc, argv )) {
+          PrintHelp();
+          return (1); }
+
+    if ( !SelectKernels() ) return ( 1 );
+    
+    SORT_COMPARE_FUNCTION   CompareFunction = NULL;
+    std::vector             <DATA_ITEM*> DataVector;
+    std::vector             <DATA_ITEM*> MergeBuffer;   // swapped with DataVector by a merge
+    DATA_ITEM*              DataItem        = NULL;
+    DATA_ITEM*              Boundary        = NULL;     // the Nth result
+    DATA_ITEM               Probe           = { 0 };
+    DATA_ITEM               Previous        = { 0 };    // the line before
+    DATA_ITEM*              RunTail         = NULL;     // last item of a rising run
+    bool                    RunsEnabled     = false;
+    size_t                  RunStart        = 0;
+    long                    RunLength       = 0;
+    long                    IncreasingLines = 0;        // valued above the line before
+    long                    DecreasingLines = 0;        // valued below it
+    long*                   RisingLines     = NULL;     // the ones ranked above it
+    long*                   FallingLines    = NULL;     // the ones ranked below it
+    bool                    StoppedEarly    = false;
+    long                    UnsortedLine    = 0;        // first line out of order with --presorted
+    bool                    Dropped         = false;
+    long                    KeptSorted      = 0;        // items still in order from the last batch
+    int                     Engine          = SELECT_ENGINE_AUTO;
+    int                     LastEngine      = SELECT_ENGINE_AUTO;
+    long                    EngineBatches   [ SELECT_ENGINE_COUNT ] = { 0 };
+    long                    SelectUs        = 0;
+    std::unordered_map      <std::string_view, DATA_ITEM*> CandidateIndex;
+    FILE*                   DataFile        = NULL;
+    bool                    Status          = false;
+    long                    BeforeLoadTs    = 0;
+    long                    AfterLoadTs     = 0;
+    long                    BatchLinesRead  = 0;
+    long                    BatchCandidates = 0;
+    long                    BatchesRead     = 0;
+    long                    TotalLinesRead  = 0;
+    bool                    UseResultCache  = false;
+    CACHE_KEY               CacheKey        = { 0 };
+    CACHE_KEY               AfterScanKey    = { 0 };
+    char                    QuerySignature  [ 512 ] = { 0 };
+    
+    CompareFunction = GetCompareFunction();
+
+    /*  Generate a test data file if requested */
+    if ( GenerateTestDataFile ) { GenerateTestData(
+                                  OutputFileName, 
+                                  NumLinesToGenerate ); 
+                                { printf("\n"); return(0);}}
+
+    /*  Build a URL list image file if requested  */
+    if ( URLListImageFileName ) {
+        URL_LIST* List = BuildURLList( URLListTextFileName );
+        Status = (( List ) && ( SaveURLList( List, URLListImageFileName )));
+        FreeURLList( List );
+        printf("\n");
+        return ( Status ? 0 : 1 );
+    }
+
+    /*  Load the URL filter lists, before anything is read  */
+    if ( BlockListFileName ) {
+        BlockList = LoadURLList( BlockListFileName );
+        if ( !BlockList ) return ( 1 ); }
+
+    if ( AllowListFileName ) {
+        AllowList = LoadURLList( AllowListFileName );
+        if ( !AllowList ) return ( 1 ); }
+
+    if ( JoinFileName ) {
+        DimensionList = LoadURLList( JoinFileName );
+        if ( !DimensionList ) return ( 1 ); }
+    else if (( JoinFilterValue ) || ( JoinGroupColumn )) {
+        printf("\n--join-filter and --join-group need a --join file\n\n");
+        return ( 1 ); }
+
+    /*  Compile the ranking expression.  Its results are doubles  */
+    if ( RankExpressionText ) {
+        RankExpression = CompileExpression( RankExpressionText );
+        if ( !RankExpression ) return ( 1 );
+        ValueType = VALUE_TYPE_F64; }
+
+    /*  Multi-metric mode has its own selection, one top-N per  */
+    /*  column, and keeps 64-bit keys only                      */
+    if (( MetricCount ) &&
+        (( SelectionType != SELECTION_TYPE_NORMAL ) || ( RankExpression ) ||
+         ( JoinGroupColumn ) || ( IncrementalStateFile ) || ( TieCap >= 0 ) ||
+         ( ValueType == VALUE_TYPE_I128 ))) {
+        printf("\n--metrics can't be combined with -m 1, -r, --rank-by, "
+               "--join-group, --with-ties or i128 values\n\n");
+        return ( 1 ); }
+
+    /*  JSON and Arrow input have just the URL and value fields  */
+    if (( InputFormat != INPUT_FORMAT_TEXT ) &&
+        (( MetricCount ) || (( RankExpression ) && ( RankExpression->MaxColumn > 2 )))) {
+        printf("\n--metrics and --rank-by columns past $2 need text input\n\n");
+        return ( 1 ); }
+
+    /*  The value of an access log line is one of its fields,  */
+    /*  the bytes unless --value-field says otherwise          */
+    if ( InputFormat == INPUT_FORMAT_COMBINED ) {
+        if ( strcmp( ValueFieldName, "value" ) == 0 )
+            ValueFieldName = CombinedFieldNames[ COMBINED_FIELD_BYTES ];
+        for ( CombinedValueField = 0; 
+              CombinedValueField < COMBINED_FIELD_COUNT; 
+              CombinedValueField += 1 )
+            if ( strcmp( ValueFieldName, CombinedFieldNames[ CombinedValueField ] ) == 0 )
+                break;
+        if ( CombinedValueField == COMBINED_FIELD_COUNT ) {
+            printf("\n--value-field of combined input is bytes, status or time\n\n");
+            return ( 1 ); }
+    }
+
+    /*  Arrow input is mapped whole, it has no lines to resume at  */
+    if (( InputFormat == INPUT_FORMAT_ARROW ) && ( IncrementalStateFile )) {
+        printf("\n-r needs line-based input, not arrow\n\n");
+        return ( 1 ); }
+
+    /*  The multi-metric results are one table per column  */
+    if (( ArrowOutputFileName ) && ( MetricCount )) {
+        printf("\n--arrow-output can't be combined with --metrics\n\n");
+        return ( 1 ); }
+
+    /*  The full sort writes every line, there's no top-N  */
+    /*  to select, cache or resume                         */
+    if (( SortOutputFileName ) &&
+        (( SelectionType != SELECTION_TYPE_NORMAL ) || ( MetricCount ) || 
+         ( JoinGroupColumn ) || ( IncrementalStateFile ) || ( CacheDirectory ) ||
+         ( TieCap >= 0 ) || ( DistinctURLs ) || ( PresortedInput ) || 
+         ( ArrowOutputFileName ))) {
+        printf("\n--sort-output can't be combined with -m 1, -r, -c, --metrics, "
+               "--join-group, --with-ties, --distinct, --presorted or --arrow-output\n\n");
+        return ( 1 ); }
+
+    /*  Only the top-N lines can repeat a URL  */
+    if (( DistinctURLs ) &&
+        (( SelectionType != SELECTION_TYPE_NORMAL ) || 
+         ( MetricCount ) || ( JoinGroupColumn ))) {
+        printf("\n--distinct can't be combined with -m 1, --metrics or --join-group\n\n");
+        return ( 1 ); }
+
+    /*  Group sums are added up as plain longs  */
+    if (( JoinGroupColumn ) && 
+        ( ValueType != VALUE_TYPE_I64 ) && ( ValueType != VALUE_TYPE_DECIMAL )) {
+        printf("\n--join-group only supports i64 and decimal values\n\n");
+        return ( 1 ); }
+
+    /*  Without a --memory-limit, stay within the cgroup's  */
+    if ( !MemoryLimit )
+        MemoryLimit = GetCgroupMemoryLimit();
+    if (( MemoryLimit ) && ( Verbose ))
+        printf("Memory limit: %ld MB\n", MemoryLimit >> 20 );
+
+    /*  Make sure we have an input file specified */
+    if ( !InputFileName ) {
+        printf("\nIf you want to load an input file, "
+               "please specify: -i <Filename> \n\n");
+        return (1);
+    }
+
+    /*  Consult the result cache before opening the input.      */
+    /*  Only the Normal mode is cached, because the results of  */
+    /*  the Random/Sampling mode are meant to differ each run.  */
+    if (( CacheDirectory ) && 
+        ( SelectionType == SELECTION_TYPE_NORMAL ) &&
+        ( !MetricCount )) {
+
+        BeforeLoadTs   = GetCurrentTimeMs();
+        UseResultCache = ( BuildQuerySignature( QuerySignature, 
+                                                sizeof( QuerySignature )) &&
+                           BuildCacheKey( InputFileName, 
+                                          QuerySignature, 
+                                          &CacheKey ));
+
+        if (( UseResultCache ) &&
+            ( LoadCachedResults( &CacheKey, 
+                                 QuerySignature, 
+                                 &DataVector, 
+                                 &TotalLinesRead ))) {
+
+            AfterLoadTs = GetCurrentTimeMs();
+            printf("Result cache hit: %lu results for %ld items "
+                   "in %ldms from file: %s\n",
+                    DataVector.size(),
+                    TotalLinesRead,
+                    (AfterLoadTs-BeforeLoadTs),
+                    InputFileName );
+
+            if ( DataVector.size() < ResultCount )
+                ResultCount = DataVector.size();
+
+            goto PrintResults;
+        }
+    }
+
+    /* Attempt to open the input file  */
+    DataFile = fopen( InputFileName, "r" );
+    if ( !DataFile ) {
+        printf("Failed to open input file: %s\n", 
+                InputFileName );
+        goto Failed; }
+
+    /*  Let the kernel read ahead further, too.  The read-ahead  */
+    /*  thread only pays off when it has a CPU of its own, with  */
+    /*  one the copy out of its chunk is pure overhead.          */
+    posix_fadvise( fileno( DataFile ), 0, 0, POSIX_FADV_SEQUENTIAL );
+    if (( ReadAhead ) && ( GetThreadCount() < 2 ))
+        ReadAhead = false;
+    
+    /* Record the time prior to loading file */
+    BeforeLoadTs  =  GetCurrentTimeMs();
+
+    /*  In incremental mode, start from the results and position  */
+    /*  saved by the previous run, so only appended lines are     */
+    /*  read.  The Random mode handles its own reservoir state.   */
+    if (( IncrementalStateFile ) && 
+        ( SelectionType == SELECTION_TYPE_NORMAL ) &&
+        ( !JoinGroupColumn )) {
+
+        if (( BuildQuerySignature( QuerySignature, sizeof( QuerySignature ))) &&
+            ( LoadIncrementalState( DataFile, 
+                                    QuerySignature, 
+                                    &DataVector, 
+                                    NULL, 
+                                    &TotalLinesRead ))) 
+            printf( "Resumed %lu results and %ld lines read "
+                    "from incremental state file: %s\n",
+                    DataVector.size(), 
+                    TotalLinesRead, 
+                    IncrementalStateFile );
+        else 
+            printf( "No usable incremental state, "
+                    "processing from the start of the file\n" );
+    }
+    printf( "Loading data from input file: %s\n", InputFileName );
+    
+    if ( SelectionType == SELECTION_TYPE_RANDOM ) {
+        GenerateAlgorithmR( &DataFile );
+        goto Exit; }
+    
+    if ( MetricCount ) {
+        Status = GenerateMultiMetric( &DataFile );
+        goto Cleanup; }
+
+    if ( SortOutputFileName ) {
+        Status = GenerateSortedFile( &DataFile );
+        goto Cleanup; }
+
+    /*  Grouping by a dimension attribute has to see every  */
+    /*  line before anything can be selected                */
+    if ( JoinGroupColumn ) {
+        if ( IncrementalStateFile )
+            printf("Incremental mode is not supported with --join-group, "
+                   "processing the whole file\n");
+        GenerateJoinGroups( &DataFile, &DataVector, &TotalLinesRead );
+        goto FinishedReading; }
+
+    /*  With --distinct, the candidates are indexed by URL.  */
+    /*  Resumed results are distinct already.              */
+    if ( DistinctURLs )
+        for ( DATA_ITEM* Item : DataVector )
+            CandidateIndex.emplace( Item->URL, Item );
+
+    /*  Where the parser leaves the URLs as they are in the file,  */
+    /*  the candidates keep just their offsets, and the URLs of    */
+    /*  the results are read back at the end.  --distinct looks    */
+    /*  the candidates up by URL, so they need theirs copied.      */
+    {
+        struct stat DataStat;
+
+        DeferURLs = (( InputFormat == INPUT_FORMAT_TEXT ) || 
+                     ( InputFormat == INPUT_FORMAT_COMBINED )) &&
+                    ( !NormalizeURLs ) && ( !DistinctURLs ) &&
+                    ( fstat( fileno( DataFile ), &DataStat ) == 0 ) &&
+                    ( S_ISREG( DataStat.st_mode ));
+        InputBlock.FileOffset = ftell( DataFile );
+    }
+
+    /*  Lines that rank above the line before them, in the  */
+    /*  result order.  Without any, the input is sorted.    */
+    /*  It's only sorted in the result order once a line    */
+    /*  ranked below the one before, equal values alone     */
+    /*  could as well be the start of the opposite order.   */
+    RisingLines  = ( ResultSortType == SORT_TYPE_DESCENDING ) ? 
+                   &IncreasingLines : &DecreasingLines;
+    FallingLines = ( ResultSortType == SORT_TYPE_DESCENDING ) ? 
+                   &DecreasingLines : &IncreasingLines;
+
+    /*  --presorted can stop partway through a block, so the  */
+    /*  totals take the lines as they are used                */
+    TotalsPerRow = PresortedInput;
+
+    /*  Runs overwrite the items they pass, which --with-ties  */
+    /*  and --distinct need to keep                             */
+    RunsEnabled = ( TieCap < 0 ) && ( !DistinctURLs ) && ( ResultCount > 0 );
+
+    /*  Allocated up front, as the first allocation after a trim  */
+    /*  is the one malloc consolidates the freed URLs in          */
+    MergeBuffer.reserve( BatchSize + ResultCount );
+
+    /*  Begin loading + processing data in batches */
+    while (( DataFile ) && ( !StoppedEarly ))
+    {
+        EnforceMemoryLimit( &BatchSize );
+        BatchLinesRead  = 0;
+        BatchCandidates = 0;
+        if ( Verbose ) printf("Start of batch. "
+                              "BatchLinesRead = %lu, "
+                              "TotalLinesRead = %lu, "
+                              "DataVector.size() = %lu\n", 
+                               BatchLinesRead, 
+                               TotalLinesRead, 
+                               DataVector.size());
+                               
+        /*  Keep reading more lines until we have   */
+        /*  read a BatchSize amount of them, or     */
+        /*  until we reach the end of file          */
+        while ( BatchLinesRead < BatchSize )
+        {
+            long Row = NextRecordRow( &DataFile, &InputBlock );
+            if ( Row < 0 ) break;
+
+            BatchLinesRead += 1;
+            TotalLinesRead += 1;
+
+            /*  Keep track of how sorted the input is, without  */
+            /*  branches, as these are unpredictable on input   */
+            /*  that isn't sorted                               */
+            Probe.LongValue = InputBlock.LongValues[Row];
+            Probe.HighValue = InputBlock.HighValues[Row];
+            if (( !BatchesRead ) && ( BatchLinesRead == 1 ))
+                Previous = Probe;
+            if ( ValueType == VALUE_TYPE_I128 ) {
+                IncreasingLines += CompareAscending128( &Previous, &Probe );
+                DecreasingLines += CompareAscending128( &Probe, &Previous ); }
+            else {
+                IncreasingLines += ( Probe.LongValue > Previous.LongValue );
+                DecreasingLines += ( Probe.LongValue < Previous.LongValue ); }
+            Previous = Probe;
+
+            /*  Once DataVector holds a full top-N, a line that   */
+            /*  can't get into it is dropped right in the block,  */
+            /*  without copying it out.  With --with-ties, lines  */
+            /*  equal to the Nth result still go in.              */
+            Dropped = ( Boundary ) &&
+                      (( TieCap >= 0 ) ? CompareFunction( Boundary, &Probe )
+                                       : !CompareFunction( &Probe, Boundary ));
+
+            if ( UNLIKELY( PresortedInput )) {
+
+                /*  A line out of order means --presorted was wrong,  */
+                /*  and the whole file has to be read after all       */
+                if (( *RisingLines ) && ( !UnsortedLine ))
+                    UnsortedLine = TotalLinesRead;
+
+                /*  If the input is sorted in the result order, so  */
+                /*  far and as --presorted says, no line after this */
+                /*  one can get in either                           */
+                if (( Dropped ) && ( !*RisingLines ) && ( *FallingLines ) &&
+                    ( !IncrementalStateFile )) {
+                    StoppedEarly     = true;
+                    BatchLinesRead  -= 1;
+                    TotalLinesRead  -= 1;
+                    break; }
+
+                AccumulateValue( &ValueTotals, Probe.LongValue, Probe.HighValue ); }
+
+            if ( Dropped ) continue;
+
+            /*  With --distinct, a URL that is already a candidate  */
+            /*  only gets its value raised, if this one is better.  */
+            /*  Raising the Nth result leaves no item at the old    */
+            /*  Nth value, so until the batch is sorted again       */
+            /*  there's no boundary to filter lines with.           */
+            if ( DistinctURLs ) {
+                auto Found = CandidateIndex.find( 
+                                std::string_view( InputBlock.Buffer + InputBlock.URLOffsets[Row],
+                                                  InputBlock.URLLengths[Row] ));
+                if ( Found != CandidateIndex.end() ) {
+                    if ( CompareFunction( &Probe, Found->second )) {
+                        if ( Found->second == Boundary )
+                            Boundary = NULL;
+                        Found->second->LongValue = Probe.LongValue;
+                        Found->second->HighValue = Probe.HighValue;
+                        KeptSorted       = 0;
+                        BatchCandidates += 1; }
+                    continue; }
+            }
+
+            /*  In a run of lines that each rank at least as high  */
+            /*  as the one before, as in input sorted against the  */
+            /*  result order, only the last ResultCount lines can  */
+            /*  make the top-N.  So once there are that many, the  */
+            /*  oldest of them is overwritten instead of adding    */
+            /*  another item, and the batch stays small to sort.   */
+            if (( RunTail ) && ( !CompareFunction( RunTail, &Probe ))) {
+
+                /*  The results of the last batch are sorted best  */
+                /*  first, reversed they are the run's start       */
+                if ( RunLength < 0 ) {
+                    std::reverse( DataVector.begin(), DataVector.end() );
+                    KeptSorted  = 0;
+                    RunStart    = 0;
+                    RunLength   = DataVector.size(); }
+
+                if ( RunLength >= ResultCount ) {
+                    RunTail = DataVector[ RunStart + RunLength % ResultCount ];
+                    if ( !ReuseBlockDataItem( RunTail, &InputBlock, Row )) goto Failed;
+                    RunLength       += 1;
+                    BatchCandidates += 1;
+
+                    /*  If the run is all of the results, its oldest  */
+                    /*  line is the Nth result now                    */
+                    if ( !RunStart )
+                        Boundary = DataVector[ RunLength % ResultCount ];
+                    continue; }
+            }
+            else {
+                RunStart    = DataVector.size();
+                RunLength   = 0; }
+
+            /* Add new DATA_ITEM to the DataVector */
+            DataItem = NewBlockDataItem( &InputBlock, Row );
+            if ( !DataItem ) goto Failed;
+            DataVector.push_back ( DataItem );
+            BatchCandidates += 1;
+            RunLength       += 1;
+            if ( RunsEnabled ) RunTail = DataItem;
+
+            if ( DistinctURLs )
+                CandidateIndex.emplace( std::string_view( DataItem->URL, 
+                                                          InputBlock.URLLengths[Row] ),
+                                        DataItem );
+
+            if ( Verbose ) 
+                printf("Finished line. "
+                       " BatchLinesRead = %lu, "
+                       " TotalLinesRead = %lu, "
+                       " DataVector.size() = %lu\n", 
+                       BatchLinesRead, 
+                       TotalLinesRead, 
+                       DataVector.size());
+    
+        }  /* End Reading Batch */
+
+        /*  If we are no longer getting lines       */
+        /*  of data then break out of loop          */
+        if ( !BatchLinesRead )    
+            break;
+
+        
+        BatchesRead += 1;
+        
+        printf("\n");
+        printf( "Loaded Batch %lu: "
+                "LinesRead = %lu, "
+                "TotalRead = %lu, "
+                "Candidates = %lu, "
+                "DataVector.size() = %lu\n", 
+                BatchesRead, 
+                BatchLinesRead, 
+                TotalLinesRead, 
+                BatchCandidates,
+                DataVector.size());
+
+        /*  Nothing in this batch could make the top-N  */
+        if ( !BatchCandidates ) continue;
+        
+        /*  A run that went on through the whole batch holds all of  */
+        /*  the items, in the order they came, from worst to best    */
+        /*  and rotated where it overwrote the oldest.  Undoing that */
+        /*  puts them in order without comparing any.                */
+        if (( RunsEnabled ) && ( RunStart == 0 ) && ( RunLength > 0 ) &&
+            ( DataVector.size() == (size_t) std::min( RunLength, ResultCount ))) {
+            std::rotate( DataVector.begin(), 
+                         DataVector.begin() + RunLength % DataVector.size(), 
+                         DataVector.end() );
+            std::reverse( DataVector.begin(), DataVector.end() );
+            KeptSorted = DataVector.size(); }
+
+        /*  How depends on how many are new, see PlanSelection(),  */
+        /*  and each change of plan is logged.  A run or --distinct */
+        /*  that reordered the kept items has the batch sorted     */
+        /*  whole, which isn't a change of plan.                   */
+        Engine = PlanSelection( KeptSorted, DataVector.size() - KeptSorted );
+        if (( Engine != LastEngine ) && 
+            (( KeptSorted ) || ( LastEngine == SELECT_ENGINE_AUTO ))) {
+            printf("Batch %lu: ordering by %s, %ld sorted + %ld new items, "
+                   "%.1f%% of the lines accepted\n",
+                    BatchesRead,
+                    SelectEngineNames[ Engine ],
+                    KeptSorted,
+                    DataVector.size() - KeptSorted,
+                    100.0 * BatchCandidates / BatchLinesRead );
+            LastEngine = Engine; }
+        EngineBatches[ Engine ] += 1;
+        SelectUs -= GetCurrentTimeUs();
+
+        switch ( Engine )
+        {
+            /*  The kept items are in order, only the new ones  */
+            /*  need sorting.  With --with-ties that sort is    */
+            /*  stable, like the merge, so the ties that are    */
+            /*  kept are the same from run to run.  The merge   */
+            /*  goes into MergeBuffer, as std::inplace_merge()  */
+            /*  allocating one right after a trim freed many    */
+            /*  URLs costs more than the merge itself.          */
+            case SELECT_ENGINE_MERGE:
+                if ( TieCap >= 0 )
+                    stable_sort( DataVector.begin() + KeptSorted, 
+                                 DataVector.end(), 
+                                 CompareFunction );
+                else
+                    sort(   DataVector.begin() + KeptSorted, 
+                            DataVector.end(), 
+                            CompareFunction );
+                if ( KeptSorted ) {
+                    MergeBuffer.resize( DataVector.size() );
+                    std::merge( DataVector.begin(), 
+                                DataVector.begin() + KeptSorted,
+                                DataVector.begin() + KeptSorted,
+                                DataVector.end(), 
+                                MergeBuffer.begin(),
+                                CompareFunction );
+                    DataVector.swap( MergeBuffer ); }
+                break;
+
+            /*  Only the top N are kept, the rest are trimmed  */
+            /*  in whatever order nth_element leaves them      */
+            case SELECT_ENGINE_SELECT:
+                std::nth_element( DataVector.begin(), 
+                                  DataVector.begin() + ResultCount, 
+                                  DataVector.end(), 
+                                  CompareFunction );
+                sort(   DataVector.begin(), 
+                        DataVector.begin() + ResultCount, 
+                        CompareFunction );
+                break;
+
+            /*  Sort the contents of the data vector which now      */
+            /*  contains the addition of a new batch of data.       */        
+            /*  Use the default sorting mechanism in C++ with       */
+            /*  custom comparator function because our sort key     */
+            /*  is a field in a C struct.                           */
+        
+            /*  It will either the Desc/Asc comparator              */ 
+            /*  using function ptr                                  */
+            
+            /*  With --with-ties, a stable sort keeps the earlier   */
+            /*  of equal items first, so the ties that are kept     */
+            /*  are the same from run to run                        */
+            default:
+                if ( TieCap >= 0 )
+                    stable_sort( DataVector.begin (), 
+                                 DataVector.end   (), 
+                                 CompareFunction  ); 
+                else
+                    sort(   DataVector.begin (), 
+                            DataVector.end   (), 
+                            CompareFunction  ); 
+                break;
+        }
+
+        SelectUs += GetCurrentTimeUs();
+        printf("Finished Sorting DataVector\n");
+        
+        /*  Now trim the DataVector.                        */
+        /*  Only keep the ResultCount amount of data        */ 
+        /*  in resident Vector memory.                      */
+        /*  Start from the tail, freeing struct memory      */
+        /*  and removing from DataVector.                   */
+        
+        /*  ResultCount, plus any ties kept with --with-ties  */
+        long KeepCount = GetKeepCount( &DataVector, CompareFunction );
+        
+        for ( long Index = DataVector.size() - 1; 
+                   Index > KeepCount - 1;
+                   Index -= 1 ){
+
+            DATA_ITEM*  DeleteItem = DataVector[Index];
+            if ( DistinctURLs )
+                CandidateIndex.erase( DeleteItem->URL );
+            if ( DeleteItem->URL )                
+                 free ( DeleteItem->URL );
+                 free ( DeleteItem );
+           
+            DataVector.pop_back();
+        }
+
+        printf("Finished Trimming DataVector. "
+               "DataVector.size() = %lu\n", 
+               DataVector.size());
+
+        if (( ResultCount > 0 ) && ( DataVector.size() >= (size_t) ResultCount ))
+            Boundary = DataVector[ ResultCount - 1 ];
+        KeptSorted = DataVector.size();
+
+        /*  A run can go on from the best result  */
+        if (( RunsEnabled ) && ( !DataVector.empty() )) {
+            RunTail     = DataVector[0];
+            RunLength   = -1; }
+        
+        if ( Verbose ) {
+            if (( DeferURLs ) && ( !MaterializeURLs( &DataVector, DataFile ))) goto Failed;
+            PrintVectorData( &DataVector ); }
+        
+        /* Loop back up to do the next batch */
+        
+    }  /* End Reading File */
+    
+    FinishedReading:
+    if (( DeferURLs ) && ( !MaterializeURLs( &DataVector, DataFile ))) goto Failed;
+    AfterLoadTs = GetCurrentTimeMs();
+
+    if ( DataVector.size() < ResultCount )
+        ResultCount = DataVector.size();
+    printf("\n");
+    printf("Processed %ld items in %ldms from file: %s\n",
+            TotalLinesRead, 
+            (AfterLoadTs-BeforeLoadTs), 
+            InputFileName );  
+
+    PrintParseErrorSummary();
+    if ( ShowLengthStats ) PrintLengthStats();
+
+    if ( LastEngine != SELECT_ENGINE_AUTO ) {
+        printf("Ordered the batches in %ldms:", SelectUs / 1000 );
+        for ( int Index = SELECT_ENGINE_SORT; Index < SELECT_ENGINE_COUNT; Index += 1 )
+            if ( EngineBatches[ Index ] )
+                printf(" %ld by %s", EngineBatches[ Index ], SelectEngineNames[ Index ] );
+        printf("\n"); }
+
+    /*  Say when the input turned out to be sorted by value, as  */
+    /*  --presorted can stop reading such a file early           */
+    if ( StoppedEarly )
+        printf("Stopped early after %ld lines, trusting --presorted that no later "
+               "line can make the results.  The totals only cover those lines.\n",
+               TotalLinesRead );
+    else if ( UnsortedLine )
+        printf("Line %ld is out of order, so the input was read in full "
+               "despite --presorted\n", UnsortedLine );
+    else if (( RisingLines ) && ( IncreasingLines + DecreasingLines ) &&
+             (( !IncreasingLines ) || ( !DecreasingLines )))
+        printf("The input is sorted by value, %s%s\n",
+                IncreasingLines ? "ascending" : "descending",
+                (( !*RisingLines ) && ( !PresortedInput )) ? 
+                    ", --presorted would stop reading it early" : "" );
+
+    /*  Save the results + file position for the next run  */
+    if (( IncrementalStateFile ) && ( !JoinGroupColumn ))
+        SaveIncrementalState( DataFile, 
+                              QuerySignature, 
+                              &DataVector, 
+                              NULL, 
+                              TotalLinesRead );
+
+    /*  Save the results for the next run with the same query.   */
+    /*  If the file changed while we were reading it, the key    */
+    /*  we computed up front no longer describes what we read.   */
+    /*  A run --presorted stopped early has the totals of only   */
+    /*  part of the file, which the same query without it would  */
+    /*  get from the cache, so it isn't saved.                   */
+    if (( UseResultCache ) && ( !StoppedEarly )) {
+        if (( BuildCacheKey( InputFileName, 
+                             QuerySignature, 
+                             &AfterScanKey )) &&
+            ( memcmp( &CacheKey, 
+                      &AfterScanKey, 
+                      sizeof( CACHE_KEY )) == 0 ))
+            StoreCachedResults( &CacheKey, 
+                                QuerySignature, 
+                                &DataVector, 
+                                TotalLinesRead );
+        else
+            printf("Input file changed during the scan, "
+                   "not caching results\n");
+    }
+
+    /*  Print the results  */
+    PrintResults:
+    printf("\n");
+    printf("Top %ld Results ", ( TieCap >= 0 ) ? (long) DataVector.size() : ResultCount );
+    
+    if ( ResultSortType == SORT_TYPE_DESCENDING )
+        printf("(DESCENDING):\n");
+    else if ( ResultSortType == SORT_TYPE_ASCENDING )
+        printf("(ASCENDING):\n");
+    
+    PrintVectorData( &DataVector );
+    if ( ArrowOutputFileName )
+        WriteArrowFile( ArrowOutputFileName, &DataVector );
+
+    if ( TieCap >= 0 )
+        PrintTieSummary( &DataVector, CompareFunction );
+
+    PrintValueTotals( &ValueTotals );
+
+    /*  There are some cleanup items to do before exiting */
+    goto Success;
+
+    Success:
+        /*  Success, no major failures  */
+        Status = true;
+        goto Cleanup;
+
+    Failed:
+        /*  Sometimes errno shows weird/wrong */
+        /*  error text but oh well */
+        printf("Error code: %d, text: %s\n", 
+                errno, strerror(errno));
+        Status = false;
+        goto Cleanup;
+
+    Cleanup:    
+        /*  Free the rest of the data  */
+        while ( !DataVector.empty() ){
+          
+            DATA_ITEM* DataItem = DataVector.back();
+        
+            if ( DataItem->URL )                
+                 free ( DataItem->URL );
+                 free ( DataItem );
+                 
+            DataVector.pop_back();  
+        }
+        
+        /*  Close input data file  */
+        StopReadAhead( &InputBlock );
+        if ( DataFile )
+            fclose( DataFile );
+
+        FreeURLList( BlockList );
+        FreeURLList( AllowList );
+        FreeURLList( DimensionList );
+        goto Exit;
+
+    Exit:
+        StopReadAhead( &InputBlock );
+        PrintPeakMemory();
+        printf("\n");
+        return(Status);
+
+}
+
+/*  I made two comparators, because I didn't       */
+/*  want to potentially slow it down by having an 'if' */
+/*  decision for every comparison for Asc/Desc because */
+/*  there is a user config option to select what type  */
+
+bool CompareAscending(  DATA_ITEM* Item1,
+                        DATA_ITEM* Item2 ){  
+return (( Item1->LongValue ) < 
+        ( Item2->LongValue ));}
+
+bool CompareDescending( DATA_ITEM* Item1,
+                        DATA_ITEM* Item2 ){
+return (( Item1->LongValue ) > 
+        ( Item2->LongValue ));}
+
+/*  And two more for 128-bit values, which are the only ones  */
+/*  that need to look at HighValue                            */
+
+bool CompareAscending128(  DATA_ITEM* Item1,
+                           DATA_ITEM* Item2 ){  
+return (( Item1->HighValue != Item2->HighValue ) ?
+        ( Item1->HighValue  < Item2->HighValue ) :
+        ( Item1->LongValue  < Item2->LongValue ));}
+
+bool CompareDescending128( DATA_ITEM* Item1,
+                           DATA_ITEM* Item2 ){
+return (( Item1->HighValue != Item2->HighValue ) ?
+        ( Item1->HighValue  > Item2->HighValue ) :
+        ( Item1->LongValue  > Item2->LongValue ));}
+
+/*  Picks the comparator for the sort order + value type  */
+
+SORT_COMPARE_FUNCTION GetCompareFunction()
+{
+    if ( ValueType == VALUE_TYPE_I128 )
+        return (( ResultSortType == SORT_TYPE_DESCENDING ) ? 
+                  CompareDescending128 : CompareAscending128 );
+
+    return (( ResultSortType == SORT_TYPE_DESCENDING ) ? 
+              CompareDescending : CompareAscending );
+}
+
+
+/*  Number of leading items of a sorted DataVector to keep.    */
+/*  That's ResultCount, plus with --with-ties the items tied   */
+/*  with the Nth one, up to TieCap more.  Ties past the cap    */
+/*  are only counted.  Rather than holding on to every tie,    */
+/*  only the boundary value and its overflow count are kept    */
+/*  between batches (and runs, with -r), and the count         */
+/*  restarts when a later batch moves the boundary.            */
+
+size_t GetKeepCount( std::vector<DATA_ITEM*>* DataVector, 
+                     SORT_COMPARE_FUNCTION CompareFunction )
+{
+    size_t      Size    = DataVector->size();
+    size_t      Keep    = std::min( Size, (size_t) ResultCount );
+    size_t      Limit   = 0;
+    DATA_ITEM*  Nth     = NULL;
+
+    if (( TieCap < 0 ) || ( Keep == 0 )) return ( Keep );
+
+    auto Tied = [ CompareFunction ]( DATA_ITEM* Item1, DATA_ITEM* Item2 ) {
+        return (( !CompareFunction( Item1, Item2 )) && 
+                ( !CompareFunction( Item2, Item1 ))); };
+
+    Nth   = ( *DataVector )[ Keep - 1 ];
+    Limit = std::min( Size, Keep + TieCap );
+
+    while (( Keep < Limit ) && ( Tied( Nth, ( *DataVector )[ Keep ] )))
+        Keep += 1;
+
+    if ( !Tied( &TieBoundary, Nth ))
+        TieOverflowCount = 0;
+
+    for ( size_t Index = Keep; 
+          ( Index < Size ) && ( Tied( Nth, ( *DataVector )[ Index ] )); 
+          Index += 1 )
+        TieOverflowCount += 1;
+
+    TieBoundary.LongValue   = Nth->LongValue;
+    TieBoundary.HighValue   = Nth->HighValue;
+
+    return ( Keep );
+}
+
+
+/*  Picks how to order the DataVector of a batch: its first     */
+/*  Sorted items are the results of the batches before, still   */
+/*  in order, and the New ones after them are the candidates    */
+/*  of this batch.  The costs are in comparisons, n log n to    */
+/*  sort, one per item to merge, and a few per item for         */
+/*  nth_element, which --with-ties can't use as it needs the    */
+/*  ties past the Nth in order too.  A low accept rate makes    */
+/*  New small and favors the merge, a large batch of a small    */
+/*  -n favors nth_element.  --engine forces one instead.        */
+
+#define SELECT_NTH_COST         3       // comparisons per item of nth_element
+
+int PlanSelection( long Sorted, long New )
+{
+    long    Total       = Sorted + New;
+    bool    CanSelect   = ( TieCap < 0 ) && ( Total > ResultCount );
+    double  SortCost    = Total * log2( Total + 2.0 );
+    double  MergeCost   = New * log2( New + 2.0 ) + Total;
+    double  SelectCost  = ( SELECT_NTH_COST * Total ) + 
+                          ( ResultCount * log2( ResultCount + 2.0 ));
+    int     Engine      = SELECT_ENGINE_SORT;
+
+    if ( SelectEngine != SELECT_ENGINE_AUTO )
+        return ((( SelectEngine == SELECT_ENGINE_SELECT ) && ( !CanSelect )) ? 
+                SELECT_ENGINE_SORT : SelectEngine );
+
+    if (( Sorted ) && ( MergeCost < SortCost )) {
+        Engine      = SELECT_ENGINE_MERGE;
+        SortCost    = MergeCost; }
+
+    if (( CanSelect ) && ( SelectCost < SortCost ))
+        Engine      = SELECT_ENGINE_SELECT;
+
+    return ( Engine );
+}
+
+
+/*  Reports the value at the rank boundary and how many items  */
+/*  share it, including the ones over the --with-ties cap      */
+
+void PrintTieSummary( std::vector<DATA_ITEM*>* DataVector,
+                      SORT_COMPARE_FUNCTION CompareFunction )
+{
+    DATA_ITEM*  Last        = NULL;
+    long        FirstRank   = 0;
+    char        Value       [ 64 ];
+
+    if ( DataVector->empty() ) return;
+
+    Last      = DataVector->back();
+    FirstRank = DataVector->size() - 1;
+    while (( FirstRank > 0 ) && 
+           ( !CompareFunction(( *DataVector )[ FirstRank - 1 ], Last )) &&
+           ( !CompareFunction( Last, ( *DataVector )[ FirstRank - 1 ] )))
+        FirstRank -= 1;
+
+    FormatValue( Last, Value, sizeof( Value ));
+    printf( "\nRank boundary: value %s is shared by %ld items from rank %ld",
+            Value, 
+            (long) DataVector->size() - FirstRank + TieOverflowCount,
+            FirstRank );
+
+    if ( TieOverflowCount )
+        printf( ", %ld of them over the tie cap of %ld were not kept",
+                TieOverflowCount, TieCap );
+    printf( "\n" );
+}
+
+
+/* Function to print the vector data */
+bool PrintVectorData( std::vector<DATA_ITEM*> *DataVector )
+{
+    /*  Every line could have been skipped or filtered  */
+    if ( DataVector->empty() ) {
+        printf("No results\n");
+        return ( true ); }
+
+    // For verbose mode, print out the difference of
+    // the LongValues for each array item vs. them
+    // previous array item, just to see how far they span
+    long PreviousValue = 
+        ( (DATA_ITEM*)  DataVector->at(0))->LongValue;
+
+    for ( long Index  =  0;
+               Index <  DataVector->size();
+               Index += 1 ){
+
+        DATA_ITEM*  Item =  DataVector->at( Index );
+
+        /*  In the --join-group mode, the items are groups  */
+        const char* Label = JoinGroupColumn ? "Group" : "URL";
+        char        Value [ 64 ];
+
+        if ( ValueType != VALUE_TYPE_I64 ) {
+
+            /*  Typed values are decoded from their keys  */
+            FormatValue( Item, Value, sizeof( Value ));
+            printf( "[%ld] Value=%s  %s=%s",
+                Index,
+                Value,
+                Label,
+                ( Item->URL   ) );
+        }
+        else if ( Verbose )
+            
+            printf( "[%ld] LongValue=%ld (%ld)  %s=%s",
+                Index, 
+                ( Item->LongValue ),
+                ( Item->LongValue ) - PreviousValue,
+                Label,
+                ( Item->URL   ));
+        
+        else
+            printf( "[%ld] LongValue=%ld  %s=%s",
+                Index,
+                ( Item->LongValue ),
+                Label,
+                ( Item->URL   ) );
+
+        if ( ValueTotals.Count )
+            printf( "  Share=%.4g%%", GetShareOfTotal( &ValueTotals, Item ));
+
+        /*  Items from the result cache or incremental state  */
+        /*  don't carry their attributes, so look them up     */
+        if (( DimensionList ) && ( !JoinGroupColumn )) {
+            size_t          Length  = Item->AttributesLength;
+            const char*     Attrs   = Item->Attributes;
+
+            if ( !Attrs ) {
+                URL_LIST_SLOT* Slot = URLListFind( DimensionList, 
+                                                   Item->URL, 
+                                                   strlen( Item->URL ));
+                if ( Slot ) Attrs = URLListAttributes( DimensionList, Slot, &Length );
+            }
+
+            if ( Attrs )
+                printf( "  Attributes=%.*s", (int) Length, Attrs );
+            else
+                printf( "  Attributes=-" );
+        }
+
+        printf( "\n" );
+
+            
+        
+        PreviousValue = ( Item->LongValue );
+
+    }
+
+    return ( true );
+}
+
+
+/*  General purpose 64-bit hash for byte strings.  It consumes   */
+/*  8 bytes per step and uses the splitmix64 finalizer to mix,   */
+/*  which is plenty for cache keys and hash tables.              */
+
+unsigned long HashBytes( const void* Data, size_t Length, unsigned long Seed )
+{
+    const unsigned char*    Bytes   = ( const unsigned char* ) Data;
+    unsigned long           Hash    = Seed ^ ( Length * 0x9E3779B97F4A7C15UL );
+    unsigned long           Word    = 0;
+
+    while ( Length >= 8 ) {
+        memcpy( &Word, Bytes, 8 );
+        Hash   = ( Hash ^ Word ) * 0xBF58476D1CE4E5B9UL;
+        Hash  ^= ( Hash >> 29 );
+        Bytes += 8;
+        Length -= 8;
+    }
+
+    /*  Remaining 0-7 bytes  */
+    Word = 0;
+    memcpy( &Word, Bytes, Length );
+    Hash  = ( Hash ^ Word ) * 0x94D049BB133111EBUL;
+
+    /*  splitmix64 finalizer  */
+    Hash ^= ( Hash >> 30 );
+    Hash *= 0xBF58476D1CE4E5B9UL;
+    Hash ^= ( Hash >> 27 );
+    Hash *= 0x94D049BB133111EBUL;
+    Hash ^= ( Hash >> 31 );
+
+    return ( Hash );
+}
+
+
+/*  The query signature is a text description of every option  */
+/*  that changes what the results are.  Any option added later  */
+/*  that affects results needs to be added here too, otherwise  */
+/*  the result cache would return stale answers for it.         */
+
+bool BuildQuerySignature( char* Buffer, size_t BufferSize )
+{
+    if ( !Buffer ) return ( false );
+
+    int Length = snprintf( Buffer, BufferSize,
+                           "v3 m=%d n=%ld s=%d b=%ld norm=%d type=%s.%ld "
+                           "block=%016lx allow=%016lx "
+                           "join=%016lx filter=%s group=%ld rank=%s metrics=%s ties=%ld distinct=%d "
+                           "format=%s fields=%s,%s",
+                           SelectionType,
+                           ResultCount,
+                           ResultSortType,
+                           BatchSize,
+                           NormalizeURLs,
+                           ValueTypeNames[ ValueType ],
+                           DecimalScale,
+                           BlockList ? BlockList->Header->ContentHash : 0,
+                           AllowList ? AllowList->Header->ContentHash : 0,
+                           DimensionList ? DimensionList->Header->ContentHash : 0,
+                           JoinFilterValue ? JoinFilterValue : "",
+                           JoinGroupColumn,
+                           RankExpressionText ? RankExpressionText : "",
+                           MetricsOptionText ? MetricsOptionText : "",
+                           TieCap,
+                           DistinctURLs,
+                           InputFormatNames[ InputFormat ],
+                           URLFieldName,
+                           ValueFieldName );
+
+    return (( Length > 0 ) && ( (size_t) Length < BufferSize ));
+}
+
+
+/*  Fills in a CACHE_KEY for the input file.  Besides the stat()  */
+/*  identity, we hash the first, middle and last blocks of the    */
+/*  file, which catches rewrites that preserve size + mtime       */
+/*  without having to read the whole file.                        */
+
+bool BuildCacheKey( const char*   Filename,
+                    const char*   Signature,
+                    CACHE_KEY*    CacheKey )
+{
+    const size_t    SampleBlockSize     = 4096;
+    char            SampleBlock         [ 4096 ];
+    struct stat     FileStat;
+    int             FileDescriptor      = -1;
+    off_t           SampleOffsets       [ 3 ];
+    bool            Status              = false;
+
+    if (( !Filename ) || ( !Signature ) || ( !CacheKey )) return ( false );
+    memset( CacheKey, '\0', sizeof( CACHE_KEY ));
+
+    FileDescriptor = open( Filename, O_RDONLY );
+    if ( FileDescriptor < 0 ) goto Failed;
+    if ( fstat( FileDescriptor, &FileStat ) != 0 ) goto Failed;
+
+    CacheKey -> Device              = FileStat.st_dev;
+    CacheKey -> Inode               = FileStat.st_ino;
+    CacheKey -> FileSize            = FileStat.st_size;
+    CacheKey -> ModifiedTimeSec     = FileStat.st_mtim.tv_sec;
+    CacheKey -> ModifiedTimeNsec    = FileStat.st_mtim.tv_nsec;
+    CacheKey -> QueryHash           = HashBytes( Signature, 
+                                                 strlen( Signature ), 0 );
+
+    SampleOffsets[0] = 0;
+    SampleOffsets[1] = ( FileStat.st_size / 2 );
+    SampleOffsets[2] = ( FileStat.st_size > (off_t) SampleBlockSize ) ?
+                       ( FileStat.st_size - SampleBlockSize ) : 0;
+
+    for ( int Sample = 0; Sample < 3; Sample += 1 )
+    {
+        ssize_t BytesRead = pread( FileDescriptor, 
+                                   SampleBlock, 
+                                   SampleBlockSize,
+                                   SampleOffsets[Sample] );
+        if ( BytesRead < 0 ) goto Failed;
+
+        CacheKey -> ContentHash = HashBytes( SampleBlock, 
+                                             BytesRead,
+                                             CacheKey -> ContentHash );
+    }
+
+    goto Success;
+
+    Success:
+        Status = true;
+        goto Cleanup;
+    Failed:
+        Status = false;
+        goto Cleanup;
+    Cleanup:
+        if ( FileDescriptor >= 0 )
+            close( FileDescriptor );
+        goto Exit;
+    Exit:
+        return ( Status );
+}
+
+
+/*  Cache files are named by the file identity + query only, not  */
+/*  by the size/mtime/content.  That way a changed file maps to   */
+/*  the same cache file, fails validation on load, and gets its   */
+/*  stale entry overwritten instead of leaving garbage around.    */
+
+bool BuildCacheFileName( CACHE_KEY* CacheKey, char* Buffer, size_t BufferSize )
+{
+    if (( !CacheKey ) || ( !Buffer ) || ( !CacheDirectory )) return ( false );
+
+    unsigned long NameHash = HashBytes( &CacheKey->Device, 
+                                        sizeof( CacheKey->Device ),
+                                        CacheKey->QueryHash );
+    NameHash = HashBytes( &CacheKey->Inode, 
+                          sizeof( CacheKey->Inode ), 
+                          NameHash );
+
+    int Length = snprintf( Buffer, BufferSize, 
+                           "%s/clickhouse-%016lx.cache",
+                           CacheDirectory, NameHash );
+
+    return (( Length > 0 ) && ( (size_t) Length < BufferSize ));
+}
+
+
+/*  Serializes DATA_ITEMs as: LongValue, HighValue, URL length,   */
+/*  URL bytes.                                                    */
+/*  Used by the result cache and anything else that needs to      */
+/*  persist a result set between runs.                            */
+
+bool WriteDataItems( FILE* File, std::vector<DATA_ITEM*> *DataVector )
+{
+    if (( !File ) || ( !DataVector )) return ( false );
+
+    for ( long Index  = 0; 
+               Index  < DataVector->size(); 
+               Index += 1 ){
+
+        DATA_ITEM*      Item        = DataVector->at( Index );
+        unsigned int    URLLength   = Item->URL ? strlen( Item->URL ) : 0;
+
+        if (( fwrite( &Item->LongValue, sizeof( long ), 1, File ) != 1 ) ||
+            ( fwrite( &Item->HighValue, sizeof( long ), 1, File ) != 1 ) ||
+            ( fwrite( &URLLength, sizeof( URLLength ), 1, File ) != 1 ) ||
+            ( fwrite( Item->URL, 1, URLLength, File ) != URLLength ))
+            return ( false );
+    }
+
+    return ( true );
+}
+
+
+/*  Reads back ItemCount DATA_ITEMs written by WriteDataItems,   */
+/*  appending them to the DataVector.                            */
+
+bool ReadDataItems( FILE* File, long ItemCount, std::vector<DATA_ITEM*> *DataVector )
+{
+    if (( !File ) || ( !DataVector )) return ( false );
+
+    for ( long Index  = 0; 
+               Index  < ItemCount; 
+               Index += 1 ){
+
+        long            LongValue   = 0;
+        long            HighValue   = 0;
+        unsigned int    URLLength   = 0;
+
+        if (( fread( &LongValue, sizeof( long ), 1, File ) != 1 ) ||
+            ( fread( &HighValue, sizeof( long ), 1, File ) != 1 ) ||
+            ( fread( &URLLength, sizeof( URLLength ), 1, File ) != 1 ))
+            return ( false );
+
+        DATA_ITEM*  Item  = ( DATA_ITEM* ) malloc( sizeof( DATA_ITEM ));
+        char*       URL   = ( char* ) malloc( URLLength + 1 );
+
+        if (( !Item ) || ( !URL ) || 
+            ( fread( URL, 1, URLLength, File ) != URLLength )) {
+            free( Item );
+            free( URL );
+            return ( false );
+        }
+
+        URL[ URLLength ]            = '\0';
+        Item -> URL                 = URL;
+        Item -> LongValue           = LongValue;
+        Item -> HighValue           = HighValue;
+        Item -> Attributes          = NULL;
+        Item -> AttributesLength    = 0;
+        DataVector->push_back( Item );
+    }
+
+    return ( true );
+}
+
+
+/*  Cache file layout:                                          */
+/*    "CHRC" magic, CACHE_KEY, signature length + signature,    */
+/*    TotalLinesRead, item count, then the items                */
+
+static const char   CacheFileMagic[4]   = { 'C', 'H', 'R', 'C' };
+
+bool LoadCachedResults( CACHE_KEY*                  CacheKey,
+                        const char*                 Signature,
+                        std::vector<DATA_ITEM*>*    DataVector,
+                        long*                       TotalLinesRead )
+{
+    char            CacheFileName   [ PATH_MAX ];
+    char            SavedSignature  [ 512 ];
+    char            Magic           [ 4 ];
+    CACHE_KEY       SavedKey;
+    unsigned int    SignatureLength = 0;
+    long            ItemCount       = 0;
+    FILE*           CacheFile       = NULL;
+    bool            Status          = false;
+
+    if ( !BuildCacheFileName( CacheKey, CacheFileName, sizeof( CacheFileName )))
+        return ( false );
+
+    CacheFile = fopen( CacheFileName, "r" );
+    if ( !CacheFile ) return ( false );
+
+    /*  Any mismatch means the entry is stale or from a     */
+    /*  different query that collided on the name: a miss   */
+    if (( fread( Magic, sizeof( Magic ), 1, CacheFile ) != 1 ) ||
+        ( memcmp( Magic, CacheFileMagic, sizeof( Magic )) != 0 ) ||
+        ( fread( &SavedKey, sizeof( CACHE_KEY ), 1, CacheFile ) != 1 ) ||
+        ( memcmp( &SavedKey, CacheKey, sizeof( CACHE_KEY )) != 0 ) ||
+        ( fread( &SignatureLength, sizeof( SignatureLength ), 1, CacheFile ) != 1 ) ||
+        ( SignatureLength >= sizeof( SavedSignature )) ||
+        ( fread( SavedSignature, 1, SignatureLength, CacheFile ) != SignatureLength ))
+        goto Failed;
+
+    SavedSignature[ SignatureLength ] = '\0';
+    if ( strcmp( SavedSignature, Signature ) != 0 ) goto Failed;
+
+    if (( fread( TotalLinesRead, sizeof( long ), 1, CacheFile ) != 1 ) ||
+        ( fread( &TieOverflowCount, sizeof( long ), 1, CacheFile ) != 1 ) ||
+        ( fread( &ValueTotals, sizeof( VALUE_TOTALS ), 1, CacheFile ) != 1 ) ||
+        ( fread( &ItemCount, sizeof( long ), 1, CacheFile ) != 1 ) ||
+        ( !ReadDataItems( CacheFile, ItemCount, DataVector )))
+        goto Failed;
+
+    goto Success;
+
+    Success:
+        Status = true;
+        goto Cleanup;
+    Failed:
+        Status = false;
+        /*  Don't hand back a partial result set  */
+        while ( !DataVector->empty() ) {
+            DATA_ITEM* Item = DataVector->back();
+            free( Item->URL );
+            free( Item );
+            DataVector->pop_back();
+        }
+        *TotalLinesRead = 0;
+        goto Cleanup;
+    Cleanup:
+        fclose( CacheFile );
+        goto Exit;
+    Exit:
+        return ( Status );
+}
+
+
+/*  Writes the cache entry to a temp file first and renames it   */
+/*  into place, so a concurrent reader never sees a torn file.   */
+
+bool StoreCachedResults( CACHE_KEY*                 CacheKey,
+                         const char*                Signature,
+                         std::vector<DATA_ITEM*>*   DataVector,
+                         long                       TotalLinesRead )
+{
+    char            CacheFileName   [ PATH_MAX ];
+    char            TempFileName    [ PATH_MAX + 32 ];
+    unsigned int    SignatureLength = strlen( Signature );
+    long            ItemCount       = DataVector->size();
+    FILE*           CacheFile       = NULL;
+    bool            Status          = false;
+
+    if ( !BuildCacheFileName( CacheKey, CacheFileName, sizeof( CacheFileName )))
+        return ( false );
+
+    snprintf( TempFileName, sizeof( TempFileName ), 
+              "%s.%d.tmp", CacheFileName, getpid() );
+
+    CacheFile = fopen( TempFileName, "w" );
+    if ( !CacheFile ) {
+        printf("Failed to create result cache file: %s\n", TempFileName );
+        return ( false );
+    }
+
+    if (( fwrite( CacheFileMagic, sizeof( CacheFileMagic ), 1, CacheFile ) != 1 ) ||
+        ( fwrite( CacheKey, sizeof( CACHE_KEY ), 1, CacheFile ) != 1 ) ||
+        ( fwrite( &SignatureLength, sizeof( SignatureLength ), 1, CacheFile ) != 1 ) ||
+        ( fwrite( Signature, 1, SignatureLength, CacheFile ) != SignatureLength ) ||
+        ( fwrite( &TotalLinesRead, sizeof( long ), 1, CacheFile ) != 1 ) ||
+        ( fwrite( &TieOverflowCount, sizeof( long ), 1, CacheFile ) != 1 ) ||
+        ( fwrite( &ValueTotals, sizeof( VALUE_TOTALS ), 1, CacheFile ) != 1 ) ||
+        ( fwrite( &ItemCount, sizeof( long ), 1, CacheFile ) != 1 ) ||
+        ( !WriteDataItems( CacheFile, DataVector )))
+        goto Failed;
+
+    if ( fclose( CacheFile ) != 0 ) {
+        CacheFile = NULL;
+        goto Failed; }
+    CacheFile = NULL;
+
+    if ( rename( TempFileName, CacheFileName ) != 0 ) goto Failed;
+
+    if ( Verbose ) printf("Stored results in cache file: %s\n", CacheFileName );
+    goto Success;
+
+    Success:
+        Status = true;
+        goto Exit;
+    Failed:
+        Status = false;
+        printf("Failed to write result cache file: %s\n", CacheFileName );
+        if ( CacheFile )
+            fclose( CacheFile );
+        unlink( TempFileName );
+        goto Exit;
+    Exit:
+        return ( Status );
+}
+
+
+/*  Hashes the (up to) 4KB of the file just before Offset.  If   */
+/*  these bytes are the same as last time, it's a safe bet the   */
+/*  file was only appended to since then.                        */
+
+bool HashFileTail( FILE* File, long Offset, unsigned long* Hash )
+{
+    char        TailBlock   [ 4096 ];
+    long        TailStart   = ( Offset > (long) sizeof( TailBlock )) ?
+                              ( Offset - sizeof( TailBlock )) : 0;
+
+    if (( !File ) || ( !Hash )) return ( false );
+
+    ssize_t BytesRead = pread( fileno( File ), 
+                               TailBlock, 
+                               Offset - TailStart, 
+                               TailStart );
+
+    if ( BytesRead != ( Offset - TailStart )) return ( false );
+
+    *Hash = HashBytes( TailBlock, BytesRead, Offset );
+    return ( true );
+}
+
+
+/*  Loads the state saved by the previous incremental run and, if  */
+/*  it still applies to DataFile, moves DataFile to the offset     */
+/*  where that run stopped.  SampleIndexes is only used by the     */
+/*  Random mode, and may be NULL.  Returns false when the caller   */
+/*  should process the file from the start instead.                */
+
+bool LoadIncrementalState( FILE*                        DataFile,
+                           const char*                  Signature,
+                           std::vector<DATA_ITEM*>*     DataVector,
+                           std::vector<long>*           SampleIndexes,
+                           long*                        TotalLinesRead )
+{
+    INCREMENTAL_STATE   State;
+    struct stat         FileStat;
+    unsigned long       TailHash    = 0;
+    FILE*               StateFile   = NULL;
+    bool                Status      = false;
+
+    if (( !DataFile ) || ( !Signature ) || ( !DataVector )) return ( false );
+
+    StateFile = fopen( IncrementalStateFile, "r" );
+    if ( !StateFile ) return ( false );
+
+    if (( fread( &State, sizeof( State ), 1, StateFile ) != 1 ) ||
+        ( fstat( fileno( DataFile ), &FileStat ) != 0 ))
+        goto Failed;
+
+    /*  Same file, same query, and it hasn't shrunk or changed  */
+    /*  underneath the offset we processed up to                */
+    if (( State.Device != FileStat.st_dev ) ||
+        ( State.Inode != FileStat.st_ino ) ||
+        ( State.QueryHash != HashBytes( Signature, strlen( Signature ), 0 )) ||
+        ( State.ProcessedOffset > FileStat.st_size ) ||
+        ( !HashFileTail( DataFile, State.ProcessedOffset, &TailHash )) ||
+        ( State.TailHash != TailHash )) {
+        if ( Verbose ) printf("Incremental state does not match input file\n");
+        goto Failed; }
+
+    if ( !ReadDataItems( StateFile, State.ItemCount, DataVector ))
+        goto Failed;
+
+    if ( SampleIndexes ) {
+        SampleIndexes->resize( State.ItemCount );
+        if (( State.ItemCount > 0 ) &&
+            ( fread( SampleIndexes->data(), 
+                     sizeof( long ), 
+                     State.ItemCount, 
+                     StateFile ) != (size_t) State.ItemCount ))
+            goto Failed;
+    }
+
+    if ( fseek( DataFile, State.ProcessedOffset, SEEK_SET ) != 0 )
+        goto Failed;
+
+    *TotalLinesRead         = State.TotalLinesRead;
+    ValueTotals             = State.Totals;
+    TieOverflowCount        = State.TieOverflowCount;
+    TieBoundary.LongValue   = State.TieBoundaryValue;
+    TieBoundary.HighValue   = State.TieBoundaryHigh;
+    goto Success;
+
+    Success:
+        Status = true;
+        goto Cleanup;
+    Failed:
+        Status = false;
+        while ( !DataVector->empty() ) {
+            DATA_ITEM* Item = DataVector->back();
+            free( Item->URL );
+            free( Item );
+            DataVector->pop_back();
+        }
+        if ( SampleIndexes )
+            SampleIndexes->clear();
+        goto Cleanup;
+    Cleanup:
+        fclose( StateFile );
+        goto Exit;
+    Exit:
+        return ( Status );
+}
+
+
+/*  Saves the current results along with the current position   */
+/*  of DataFile, which must be at the end of the last complete  */
+/*  line processed.  Written to a temp file + renamed, so an    */
+/*  interrupted run leaves the previous state intact.           */
+
+bool SaveIncrementalState( FILE*                        DataFile,
+                           const char*                  Signature,
+                           std::vector<DATA_ITEM*>*     DataVector,
+                           std::vector<long>*           SampleIndexes,
+                           long                         TotalLinesRead )
+{
+    INCREMENTAL_STATE   State;
+    struct stat         FileStat;
+    char                TempFileName [ PATH_MAX ];
+    FILE*               StateFile    = NULL;
+    bool                Status       = false;
+
+    if (( !DataFile ) || ( !Signature ) || ( !DataVector )) return ( false );
+
+    memset( &State, '\0', sizeof( State ));
+
+    if ( fstat( fileno( DataFile ), &FileStat ) != 0 ) goto Failed;
+
+    State.Device            = FileStat.st_dev;
+    State.Inode             = FileStat.st_ino;
+    State.ProcessedOffset   = ftell( DataFile );
+    State.QueryHash         = HashBytes( Signature, strlen( Signature ), 0 );
+    State.TotalLinesRead    = TotalLinesRead;
+    State.ItemCount         = DataVector->size();
+    State.Totals            = ValueTotals;
+    State.TieOverflowCount  = TieOverflowCount;
+    State.TieBoundaryValue  = TieBoundary.LongValue;
+    State.TieBoundaryHigh   = TieBoundary.HighValue;
+
+    if (( State.ProcessedOffset < 0 ) ||
+        ( !HashFileTail( DataFile, State.ProcessedOffset, &State.TailHash )))
+        goto Failed;
+
+    snprintf( TempFileName, sizeof( TempFileName ), 
+              "%s.%d.tmp", IncrementalStateFile, getpid() );
+
+    StateFile = fopen( TempFileName, "w" );
+    if ( !StateFile ) goto Failed;
+
+    if (( fwrite( &State, sizeof( State ), 1, StateFile ) != 1 ) ||
+        ( !WriteDataItems( StateFile, DataVector )))
+        goto Failed;
+
+    if (( SampleIndexes ) && ( State.ItemCount > 0 ) &&
+        ( fwrite( SampleIndexes->data(), 
+                  sizeof( long ), 
+                  State.ItemCount, 
+                  StateFile ) != (size_t) State.ItemCount ))
+        goto Failed;
+
+    if ( fclose( StateFile ) != 0 ) {
+        StateFile = NULL;
+        goto Failed; }
+    StateFile = NULL;
+
+    if ( rename( TempFileName, IncrementalStateFile ) != 0 ) goto Failed;
+
+    printf("Saved incremental state at offset %ld to: %s\n", 
+            State.ProcessedOffset, IncrementalStateFile );
+    goto Success;
+
+    Success:
+        Status = true;
+        goto Exit;
+    Failed:
+        Status = false;
+        printf("Failed to save incremental state file: %s\n", 
+                IncrementalStateFile );
+        if ( StateFile ) {
+            fclose( StateFile );
+            unlink( TempFileName ); }
+        goto Exit;
+    Exit:
+        return ( Status );
+}
+
+
+/*  Bloom filter + hash set helpers.  The partition comes from  */
+/*  the top bits of the hash, the Bloom block within it from a  */
+/*  remixed copy of the hash, and the probe bits and the hash   */
+/*  set slot from the low bits.                                 */
+
+static inline unsigned long URLListHash( const char* URL, size_t Length )
+{
+    unsigned long Hash = HashBytes( URL, Length, 0x55524C4C495354UL );
+    return ( Hash ? Hash : 1 );
+}
+
+static inline unsigned long* URLListBloomBlock( URL_LIST_HEADER*  Header,
+                                                unsigned long*    Bloom,
+                                                unsigned long     Hash )
+{
+    unsigned long   Partition   = Hash >> Header->PartitionShift;
+    unsigned long   Mixed       = ( Hash * 0x9E3779B97F4A7C15UL ) >> 32;
+    unsigned long   Block       = ( Partition * Header->BloomBlocksPerPartition ) +
+                                  (( Mixed * Header->BloomBlocksPerPartition ) >> 32 );
+
+    return ( Bloom + ( Block * URL_LIST_BLOOM_BLOCK_WORDS ));
+}
+
+/*  Checks whether the URL is in the list.  Most URLs are not,  */
+/*  and for those the Bloom filter usually answers on its own.  */
+
+bool URLListContains( URL_LIST* List, const char* URL, size_t Length )
+{
+    return ( URLListFind( List, URL, Length ) != NULL );
+}
+
+
+/*  Returns the hash set slot of the URL, or NULL if the URL  */
+/*  isn't in the list                                         */
+
+URL_LIST_SLOT* URLListFind( URL_LIST* List, const char* URL, size_t Length )
+{
+    unsigned long       Hash        = URLListHash( URL, Length );
+    URL_LIST_HEADER*    Header      = List->Header;
+    unsigned long*      Block       = URLListBloomBlock( Header, List->Bloom, Hash );
+
+    for ( int Probe = 0; Probe < URL_LIST_BLOOM_PROBES; Probe += 1 ) {
+        unsigned long Bit = ( Hash >> ( Probe * 9 )) & 511;
+        if ( !( Block[ Bit >> 6 ] & ( 1UL << ( Bit & 63 ))))
+            return ( NULL );
+    }
+
+    /*  Maybe in the list, confirm with the exact hash set  */
+    unsigned long       Mask        = Header->SlotsPerPartition - 1;
+    URL_LIST_SLOT*      Partition   = List->Slots + 
+                                      (( Hash >> Header->PartitionShift ) *
+                                         Header->SlotsPerPartition );
+
+    for ( unsigned long Slot = Hash & Mask; ; Slot = ( Slot + 1 ) & Mask )
+    {
+        if ( Partition[Slot].Hash == 0 ) return ( NULL );
+
+        if (( Partition[Slot].Hash == Hash ) &&
+            (( Partition[Slot].OffsetAndLength & 0xFFFF ) == Length ) &&
+            ( memcmp( List->Pool + ( Partition[Slot].OffsetAndLength >> 16 ),
+                      URL, Length ) == 0 ))
+            return ( &Partition[Slot] );
+    }
+}
+
+
+/*  The attributes of a URL are the rest of its line in the    */
+/*  list file, which is still there in the pool after the URL  */
+
+const char* URLListAttributes( URL_LIST* List, URL_LIST_SLOT* Slot, size_t* Length )
+{
+    const char*     PoolEnd     = ( const char* ) List->Header + List->Header->ImageSize;
+    const char*     Start       = List->Pool + ( Slot->OffsetAndLength >> 16 ) +
+                                  ( Slot->OffsetAndLength & 0xFFFF );
+    const char*     End         = NULL;
+
+    while (( Start < PoolEnd ) && (( *Start == ' ' ) || ( *Start == '\t' ) || 
+                                   ( *Start == '\0' )))
+        Start += 1;
+
+    End = ( Start < PoolEnd ) ? 
+          ( const char* ) memchr( Start, '\n', PoolEnd - Start ) : NULL;
+    if ( !End ) End = PoolEnd;
+
+    while (( End > Start ) && ( IS_DELIMITER( End[-1] )))
+        End -= 1;
+
+    *Length = End - Start;
+    return ( Start );
+}
+
+
+/*  Returns the Column'th (1-based) whitespace separated token  */
+/*  of the attributes, or NULL if there aren't that many        */
+
+const char* GetAttributeColumn( const char*   Attributes, 
+                                size_t        Length,
+                                long          Column, 
+                                size_t*       TokenLength )
+{
+    const char*     Cursor  = Attributes;
+    const char*     End     = Attributes + Length;
+
+    while ( Cursor < End )
+    {
+        while (( Cursor < End ) && ( IS_DELIMITER( *Cursor ))) Cursor += 1;
+        if ( Cursor >= End ) break;
+
+        const char* Token = Cursor;
+        while (( Cursor < End ) && ( !IS_DELIMITER( *Cursor ))) Cursor += 1;
+
+        Column -= 1;
+        if ( Column == 0 ) {
+            *TokenLength = Cursor - Token;
+            return ( Token ); }
+    }
+
+    return ( NULL );
+}
+
+
+/*  True if one of the attribute tokens is exactly Value  */
+
+static bool HasAttribute( const char* Attributes, size_t Length, const char* Value )
+{
+    size_t          ValueLength = strlen( Value );
+    size_t          TokenLength = 0;
+    const char*     Token       = NULL;
+
+    for ( long Column = 1; 
+          ( Token = GetAttributeColumn( Attributes, Length, Column, &TokenLength ));
+          Column += 1 )
+        if (( TokenLength == ValueLength ) && 
+            ( memcmp( Token, Value, ValueLength ) == 0 ))
+            return ( true );
+
+    return ( false );
+}
+
+
+/*  Checks that a mapped image is laid out the way BuildURLList()  */
+/*  lays it out and that every slot points inside the pool, and     */
+/*  that every partition has an empty slot to end a probe, so a     */
+/*  truncated or corrupt file can't make a lookup read past it.     */
+
+static bool CheckURLListImage( URL_LIST_HEADER* Header, unsigned long MapSize )
+{
+    unsigned long   Partitions  = 1UL << URL_LIST_PARTITION_BITS;
+    unsigned long   BloomBytes  = URL_LIST_BLOOM_BLOCK_WORDS * sizeof( unsigned long );
+    unsigned long   EntryCount  = 0;
+    unsigned long   PoolSize    = 0;
+    URL_LIST_SLOT*  Slots       = NULL;
+
+    if (( Header->ImageSize != MapSize ) ||
+        ( Header->PartitionShift != 64 - URL_LIST_PARTITION_BITS ) ||
+        ( Header->SlotsPerPartition == 0 ) ||
+        ( Header->SlotsPerPartition & ( Header->SlotsPerPartition - 1 )) ||
+        ( Header->SlotsPerPartition > MapSize / sizeof( URL_LIST_SLOT ) / Partitions ) ||
+        ( Header->BloomBlocksPerPartition == 0 ) ||
+        ( Header->BloomBlocksPerPartition > MapSize / BloomBytes / Partitions ) ||
+        ( Header->BloomOffset != sizeof( URL_LIST_HEADER )) ||
+        ( Header->SlotsOffset != Header->BloomOffset + 
+                                 ( Partitions * Header->BloomBlocksPerPartition * BloomBytes )) ||
+        ( Header->PoolOffset  != Header->SlotsOffset + 
+                                 ( Partitions * Header->SlotsPerPartition * 
+                                   sizeof( URL_LIST_SLOT ))) ||
+        ( Header->PoolOffset > MapSize ))
+        return ( false );
+
+    Slots    = ( URL_LIST_SLOT* )( ( char* ) Header + Header->SlotsOffset );
+    PoolSize = MapSize - Header->PoolOffset;
+
+    for ( unsigned long Partition = 0; Partition < Partitions; Partition += 1 )
+    {
+        bool HasEmptySlot = false;
+
+        for ( unsigned long Slot = 0; Slot < Header->SlotsPerPartition; Slot += 1 )
+        {
+            URL_LIST_SLOT*  Entry   = Slots + ( Partition * Header->SlotsPerPartition ) + Slot;
+            unsigned long   Offset  = Entry->OffsetAndLength >> 16;
+            unsigned long   Length  = Entry->OffsetAndLength & 0xFFFF;
+
+            if ( Entry->Hash == 0 ) {
+                HasEmptySlot = true;
+                continue; }
+
+            if (( Offset > PoolSize ) || ( Length > PoolSize - Offset ))
+                return ( false );
+
+            EntryCount += 1;
+        }
+
+        if ( !HasEmptySlot ) return ( false );
+    }
+
+    return ( EntryCount == Header->EntryCount );
+}
+
+
+/*  Loads a URL list.  A prebuilt image (see --build-url-list)  */
+/*  is mmap()ed as-is, so startup is one pass over the hash set */
+/*  to check it, no matter how long the URLs are.  Anything     */
+/*  else is read as a text file with one URL per line and built */
+/*  in memory.                                                  */
+
+URL_LIST* LoadURLList( const char* Filename )
+{
+    URL_LIST*           List            = NULL;
+    URL_LIST_HEADER*    Header          = NULL;
+    struct stat         FileStat;
+    char                Magic           [ 8 ];
+    int                 FileDescriptor  = -1;
+    long                StartTs         = GetCurrentTimeMs();
+
+    FileDescriptor = open( Filename, O_RDONLY );
+    if ( FileDescriptor < 0 ) {
+        printf("Failed to open URL list: %s\n", Filename );
+        return ( NULL ); }
+
+    if (( fstat( FileDescriptor, &FileStat ) != 0 ) ||
+        ( FileStat.st_size < (off_t) sizeof( URL_LIST_HEADER )) ||
+        ( pread( FileDescriptor, Magic, 8, 0 ) != 8 ) ||
+        ( memcmp( Magic, "CHURLLS1", 8 ) != 0 )) {
+        close( FileDescriptor );
+        return ( BuildURLList( Filename )); }
+
+    Header = ( URL_LIST_HEADER* ) mmap( NULL, 
+                                        FileStat.st_size, 
+                                        PROT_READ, 
+                                        MAP_PRIVATE, 
+                                        FileDescriptor, 0 );
+    close( FileDescriptor );
+
+    if ( Header == MAP_FAILED ) {
+        printf("Failed to map URL list: %s\n", Filename );
+        return ( NULL ); }
+
+    if ( Header->ImageSize != (unsigned long) FileStat.st_size ) {
+        printf("URL list image is truncated: %s\n", Filename );
+        munmap( Header, FileStat.st_size );
+        return ( NULL ); }
+
+    if ( !CheckURLListImage( Header, FileStat.st_size )) {
+        printf("URL list image is corrupt: %s\n", Filename );
+        munmap( Header, FileStat.st_size );
+        return ( NULL ); }
+
+    /*  The list has to hold URLs in the same form as the parser  */
+    if ( Header->Normalized != NormalizeURLs ) {
+        printf("URL list %s was built %s --normalize-urls, "
+               "rebuild it to match\n", 
+               Filename, Header->Normalized ? "with" : "without" );
+        munmap( Header, FileStat.st_size );
+        return ( NULL ); }
+
+    List = ( URL_LIST* ) malloc( sizeof( URL_LIST ));
+    if ( !List ) {
+        munmap( Header, FileStat.st_size );
+        return ( NULL ); }
+
+    List -> Header  = Header;
+    List -> Bloom   = ( unsigned long* )( ( char* ) Header + Header->BloomOffset );
+    List -> Slots   = ( URL_LIST_SLOT* )( ( char* ) Header + Header->SlotsOffset );
+    List -> Pool    = ( char* ) Header + Header->PoolOffset;
+    List -> Mapped  = true;
+
+    printf("Mapped URL list with %lu entries in %ldms: %s\n",
+            Header->EntryCount, 
+            GetCurrentTimeMs() - StartTs, 
+            Filename );
+
+    return ( List );
+}
+
+
+/*  Per-thread work for BuildURLList().  Phase 1 tokenizes a    */
+/*  range of the text into entries and counts them per          */
+/*  partition.  Phase 2 inserts a range of partitions.          */
+
+typedef struct _URL_LIST_BUILD_TASK
+{
+    char*                       Text;
+    size_t                      Start;
+    size_t                      End;
+    std::vector<URL_LIST_SLOT>  Entries;
+    std::vector<long>           PartitionCounts;
+    long                        SkippedCount;
+    long                        FirstPartition;
+    long                        PartitionStep;
+    URL_LIST*                   List;
+    URL_LIST_SLOT*              SortedEntries;
+    long*                       PartitionStarts;
+}   URL_LIST_BUILD_TASK;
+
+static void URLListTokenizeTask( URL_LIST_BUILD_TASK* Task )
+{
+    size_t  Cursor  = Task->Start;
+    int     Shift   = 64 - URL_LIST_PARTITION_BITS;
+
+    Task->PartitionCounts.assign( 1 << URL_LIST_PARTITION_BITS, 0 );
+
+    while ( Cursor < Task->End )
+    {
+        char*   Line        = Task->Text + Cursor;
+        char*   LineEnd     = ( char* ) memchr( Line, '\n', Task->End - Cursor );
+        size_t  Length      = 0;
+
+        if ( !LineEnd ) LineEnd = Task->Text + Task->End;
+        Cursor = ( LineEnd - Task->Text ) + 1;
+
+        /*  Use the first token on the line, skip blanks + comments  */
+        while (( Line < LineEnd ) && ( IS_DELIMITER( *Line ))) Line += 1;
+        while (( Line + Length < LineEnd ) && ( !IS_DELIMITER( Line[Length] ))) 
+            Length += 1;
+
+        if (( Length == 0 ) || ( Line[0] == '#' )) continue;
+
+        /*  Normalize the same way the parser will.  The bytes the   */
+        /*  URL shrank by are blanked, so any attributes after it    */
+        /*  on the line can still be found from the end of the URL   */
+        if ( NormalizeURLs ) {
+            size_t  TokenLength = Length;
+            char    Delimiter   = Line[ TokenLength ];
+
+            Line[ TokenLength ] = '\0';
+            if ( NormalizeURL( Line, &Length ) != PARSE_OK ) {
+                Task->SkippedCount += 1;
+                continue; }
+
+            memset( Line + Length, ' ', TokenLength - Length );
+            Line[ TokenLength ] = Delimiter;
+        }
+
+        if ( Length > URL_LIST_MAX_URL_LENGTH ) {
+            Task->SkippedCount += 1;
+            continue; }
+
+        URL_LIST_SLOT Entry;
+        Entry.Hash              = URLListHash( Line, Length );
+        Entry.OffsetAndLength   = (( Line - Task->Text ) << 16 ) | Length;
+        Task->Entries.push_back( Entry );
+        Task->PartitionCounts[ Entry.Hash >> Shift ] += 1;
+    }
+}
+
+static void URLListInsertTask( URL_LIST_BUILD_TASK* Task )
+{
+    URL_LIST*           List        = Task->List;
+    URL_LIST_HEADER*    Header      = List->Header;
+    unsigned long       Mask        = Header->SlotsPerPartition - 1;
+    long                Partitions  = 1 << URL_LIST_PARTITION_BITS;
+
+    for ( long Partition  = Task->FirstPartition; 
+               Partition  < Partitions; 
+               Partition += Task->PartitionStep )
+    {
+        URL_LIST_SLOT*  Slots   = List->Slots + ( Partition * Header->SlotsPerPartition );
+
+        for ( long Index  = Task->PartitionStarts[ Partition ];
+                   Index  < Task->PartitionStarts[ Partition + 1 ];
+                   Index += 1 )
+        {
+            URL_LIST_SLOT   Entry   = Task->SortedEntries[ Index ];
+            unsigned long   Length  = Entry.OffsetAndLength & 0xFFFF;
+            char*           URL     = List->Pool + ( Entry.OffsetAndLength >> 16 );
+            unsigned long*  Block   = URLListBloomBlock( Header, List->Bloom, Entry.Hash );
+
+            for ( int Probe = 0; Probe < URL_LIST_BLOOM_PROBES; Probe += 1 ) {
+                unsigned long Bit = ( Entry.Hash >> ( Probe * 9 )) & 511;
+                Block[ Bit >> 6 ] |= ( 1UL << ( Bit & 63 ));
+            }
+
+            for ( unsigned long Slot = Entry.Hash & Mask; ; Slot = ( Slot + 1 ) & Mask )
+            {
+                if ( Slots[Slot].Hash == 0 ) {
+                    Slots[Slot] = Entry;
+                    break; }
+
+                /*  Duplicate URL in the list file  */
+                if (( Slots[Slot].Hash == Entry.Hash ) &&
+                    (( Slots[Slot].OffsetAndLength & 0xFFFF ) == Length ) &&
+                    ( memcmp( List->Pool + ( Slots[Slot].OffsetAndLength >> 16 ),
+                              URL, Length ) == 0 ))
+                    break;
+            }
+        }
+    }
+}
+
+
+/*  Builds a URL list from a text file with one URL per line,   */
+/*  using all of the threads: the text is split into ranges to  */
+/*  be tokenized + hashed, the entries are grouped by partition */
+/*  and then the partitions are inserted in parallel.           */
+
+URL_LIST* BuildURLList( const char* Filename )
+{
+    FILE*                               TextFile        = NULL;
+    char*                               Text            = NULL;
+    size_t                              TextSize        = 0;
+    long                                Threads         = GetThreadCount();
+    long                                InsertThreads   = 0;
+    long                                Partitions      = 1 << URL_LIST_PARTITION_BITS;
+    long                                LargestCount    = 0;
+    long                                EntryCount      = 0;
+    long                                SkippedCount    = 0;
+    long                                StartTs         = GetCurrentTimeMs();
+    unsigned long                       ImageSize       = 0;
+    URL_LIST*                           List            = NULL;
+    URL_LIST_HEADER*                    Header          = NULL;
+    std::vector<URL_LIST_BUILD_TASK>    Tasks;
+    std::vector<std::thread>            Workers;
+    std::vector<long>                   PartitionStarts;
+    std::vector<URL_LIST_SLOT>          SortedEntries;
+
+    if ( !Filename ) return ( NULL );
+
+    /*  Read the whole text file, it becomes the URL pool  */
+    TextFile = fopen( Filename, "r" );
+    if ( !TextFile ) {
+        printf("Failed to open URL list: %s\n", Filename );
+        return ( NULL ); }
+
+    fseek( TextFile, 0, SEEK_END );
+    TextSize = ftell( TextFile );
+    fseek( TextFile, 0, SEEK_SET );
+
+    Text = ( char* ) malloc( TextSize + 1 );
+    if (( !Text ) || ( fread( Text, 1, TextSize, TextFile ) != TextSize )) {
+        printf("Failed to read URL list: %s\n", Filename );
+        fclose( TextFile );
+        free( Text );
+        return ( NULL ); }
+
+    fclose( TextFile );
+    Text[ TextSize ] = '\0';
+
+    /*  Starting a thread costs about as much as tokenizing  */
+    /*  a few tens of KB, so small lists use fewer threads,  */
+    /*  and there's no work for more threads than partitions */
+    Threads       = std::max( 1L, std::min( Threads, ( long )( TextSize >> 16 ) + 1 ));
+    InsertThreads = std::min( Threads, Partitions );
+
+    /*  Phase 1: split the text on line boundaries, one range  */
+    /*  per thread, and tokenize + hash the ranges             */
+    Tasks.resize( Threads );
+    for ( size_t Thread = 0, Start = 0; Thread < (size_t) Threads; Thread += 1 ) {
+        size_t End = std::max( Start, ( TextSize * ( Thread + 1 )) / Threads );
+        while (( End > 0 ) && ( End < TextSize ) && ( Text[ End - 1 ] != '\n' )) 
+            End += 1;
+
+        Tasks[Thread].Text          = Text;
+        Tasks[Thread].Start         = Start;
+        Tasks[Thread].End           = End;
+        Tasks[Thread].SkippedCount  = 0;
+        Start = End;
+    }
+
+    for ( long Thread = 0; Thread < Threads; Thread += 1 )
+        Workers.push_back( std::thread( URLListTokenizeTask, &Tasks[Thread] ));
+    for ( long Thread = 0; Thread < Threads; Thread += 1 )
+        Workers[Thread].join();
+    Workers.clear();
+
+    /*  Group the entries by partition, and size the structures  */
+    /*  for the largest partition: ~10 Bloom bits per URL, and   */
+    /*  a hash set at most half full                             */
+    PartitionStarts.assign( Partitions + 1, 0 );
+    for ( long Partition = 0; Partition < Partitions; Partition += 1 ) {
+        long Count = 0;
+        for ( long Thread = 0; Thread < Threads; Thread += 1 )
+            Count += Tasks[Thread].PartitionCounts[ Partition ];
+        PartitionStarts[ Partition + 1 ] = PartitionStarts[ Partition ] + Count;
+        LargestCount = std::max( LargestCount, Count );
+    }
+
+    EntryCount = PartitionStarts[ Partitions ];
+    SortedEntries.resize( EntryCount );
+
+    {
+        std::vector<long> Fill( PartitionStarts.begin(), PartitionStarts.end() - 1 );
+        for ( long Thread = 0; Thread < Threads; Thread += 1 ) {
+            SkippedCount += Tasks[Thread].SkippedCount;
+            for ( URL_LIST_SLOT& Entry : Tasks[Thread].Entries )
+                SortedEntries[ Fill[ Entry.Hash >> ( 64 - URL_LIST_PARTITION_BITS ) ]++ ] = Entry;
+            std::vector<URL_LIST_SLOT>().swap( Tasks[Thread].Entries );
+        }
+    }
+
+    /*  Lay out the image: header, Bloom blocks, slots, pool  */
+    unsigned long SlotsPerPartition = 4;
+    while ( SlotsPerPartition < (unsigned long) ( LargestCount * 2 )) 
+        SlotsPerPartition *= 2;
+
+    unsigned long BloomBlocksPerPartition = (( LargestCount * 10 ) / 512 ) + 1;
+    unsigned long BloomOffset   = sizeof( URL_LIST_HEADER );
+    unsigned long SlotsOffset   = BloomOffset + ( Partitions * BloomBlocksPerPartition *
+                                                  URL_LIST_BLOOM_BLOCK_WORDS * 
+                                                  sizeof( unsigned long ));
+    unsigned long PoolOffset    = SlotsOffset + ( Partitions * SlotsPerPartition *
+                                                  sizeof( URL_LIST_SLOT ));
+    ImageSize                   = PoolOffset + TextSize;
+
+    Header = ( URL_LIST_HEADER* ) calloc( 1, ImageSize );
+    List   = ( URL_LIST* ) malloc( sizeof( URL_LIST ));
+    if (( !Header ) || ( !List )) {
+        printf("Failed to allocate URL list\n");
+        free( Header );
+        free( List );
+        free( Text );
+        return ( NULL ); }
+
+    memcpy( Header->Magic, "CHURLLS1", 8 );
+    Header -> EntryCount                = 0;
+    Header -> PartitionShift            = 64 - URL_LIST_PARTITION_BITS;
+    Header -> SlotsPerPartition         = SlotsPerPartition;
+    Header -> BloomBlocksPerPartition   = BloomBlocksPerPartition;
+    Header -> Normalized                = NormalizeURLs;
+    Header -> ContentHash               = HashBytes( Text, TextSize, NormalizeURLs );
+    Header -> BloomOffset               = BloomOffset;
+    Header -> SlotsOffset               = SlotsOffset;
+    Header -> PoolOffset                = PoolOffset;
+    Header -> ImageSize                 = ImageSize;
+
+    List -> Header  = Header;
+    List -> Bloom   = ( unsigned long* )( ( char* ) Header + BloomOffset );
+    List -> Slots   = ( URL_LIST_SLOT* )( ( char* ) Header + SlotsOffset );
+    List -> Pool    = ( char* ) Header + PoolOffset;
+    List -> Mapped  = false;
+
+    memcpy( List->Pool, Text, TextSize );
+    free( Text );
+
+    /*  Phase 2: each thread inserts every InsertThreads'th partition  */
+    for ( long Thread = 0; Thread < InsertThreads; Thread += 1 ) {
+        Tasks[Thread].List              = List;
+        Tasks[Thread].SortedEntries     = SortedEntries.data();
+        Tasks[Thread].PartitionStarts   = PartitionStarts.data();
+        Tasks[Thread].FirstPartition    = Thread;
+        Tasks[Thread].PartitionStep     = InsertThreads;
+        Workers.push_back( std::thread( URLListInsertTask, &Tasks[Thread] ));
+    }
+    for ( long Thread = 0; Thread < InsertThreads; Thread += 1 )
+        Workers[Thread].join();
+
+    /*  Count what actually went in, without the duplicates  */
+    for ( unsigned long Slot = 0; Slot < Partitions * SlotsPerPartition; Slot += 1 )
+        if ( List->Slots[Slot].Hash ) Header->EntryCount += 1;
+
+    printf("Built URL list with %lu entries in %ldms using %ld threads: %s\n",
+            Header->EntryCount, 
+            GetCurrentTimeMs() - StartTs, 
+            Threads, 
+            Filename );
+    printf("Threads: %ld available (%s)\n", GetThreadCount(), GetThreadTopology() );
+
+    if ( SkippedCount )
+        printf("Skipped %ld invalid or too long URLs in the list\n", SkippedCount );
+
+    return ( List );
+}
+
+
+/*  Writes the list image, which LoadURLList() can map later  */
+
+bool SaveURLList( URL_LIST* List, const char* Filename )
+{
+    FILE*   ImageFile   = NULL;
+    bool    Status      = false;
+
+    if (( !List ) || ( !Filename )) return ( false );
+
+    ImageFile = fopen( Filename, "w" );
+    if ( !ImageFile ) {
+        printf("Failed to create URL list image: %s\n", Filename );
+        return ( false ); }
+
+    Status = ( fwrite( List->Header, 1, List->Header->ImageSize, ImageFile ) == 
+               List->Header->ImageSize );
+    Status = ( fclose( ImageFile ) == 0 ) && Status;
+
+    if ( Status )
+        printf("Saved URL list image (%lu bytes) to: %s\n", 
+                List->Header->ImageSize, Filename );
+    else
+        printf("Failed to write URL list image: %s\n", Filename );
+
+    return ( Status );
+}
+
+
+void FreeURLList( URL_LIST* List )
+{
+    if ( !List ) return;
+
+    if ( List->Mapped )
+        munmap( List->Header, List->Header->ImageSize );
+    else
+        free( List->Header );
+
+    free( List );
+}
+
+
+/*  Memory budget, from --memory-limit or the cgroup.  The      */
+/*  kept results plus one batch are what grows, so once per     */
+/*  batch this compares the resident set against the budget,    */
+/*  and shrinks the batch to what still fits.  Before that,     */
+/*  freed memory is handed back with malloc_trim(), which is    */
+/*  what compacts the heap after a trim of many small URLs.     */
+/*  The results themselves can't shrink, if they don't fit      */
+/*  the run goes on with the smallest batch and says so.        */
+
+#define MEMORY_BUDGET_PERCENT       80      // of the limit, the rest is slack
+#define MEMORY_MIN_BATCH_SIZE       100
+
+/*  Directory of this process's cgroup v2 under /sys/fs/cgroup,  */
+/*  or /sys/fs/cgroup itself when it can't be told               */
+
+void GetCgroupDirectory( char* Directory, size_t DirectorySize )
+{
+    char    Line        [ PATH_MAX ];
+    FILE*   File        = NULL;
+
+    /*  The unified hierarchy's line is "0::/path"  */
+    snprintf( Directory, DirectorySize, "/sys/fs/cgroup" );
+    if (( File = fopen( "/proc/self/cgroup", "r" ))) {
+        while ( fgets( Line, sizeof( Line ), File ))
+            if ( strncmp( Line, "0::", 3 ) == 0 ) {
+                Line[ strcspn( Line, "\n" ) ] = '\0';
+                snprintf( Directory, DirectorySize, 
+                          "/sys/fs/cgroup%s", 
+                          strcmp( Line + 3, "/" ) ? Line + 3 : "" );
+                break; }
+        fclose( File );
+    }
+}
+
+/*  cgroup v2 memory.max of this process, 0 if there's none  */
+
+long GetCgroupMemoryLimit()
+{
+    char    Directory   [ PATH_MAX + 32 ];
+    char    LimitPath   [ PATH_MAX + 64 ];
+    char    Value       [ 64 ]  = "";
+    FILE*   File        = NULL;
+    long    Limit       = 0;
+
+    GetCgroupDirectory( Directory, sizeof( Directory ));
+    snprintf( LimitPath, sizeof( LimitPath ), "%s/memory.max", Directory );
+
+    if ( !( File = fopen( LimitPath, "r" ))) return ( 0 );
+    if ( fgets( Value, sizeof( Value ), File ))
+        Limit = atol( Value );      // "max" reads as 0
+    fclose( File );
+
+    return ( Limit );
+}
+
+long GetResidentBytes()
+{
+    long    Size        = 0;
+    long    Resident    = 0;
+    FILE*   File        = fopen( "/proc/self/statm", "r" );
+
+    if ( !File ) return ( 0 );
+    if ( fscanf( File, "%ld %ld", &Size, &Resident ) != 2 )
+        Resident = 0;
+    fclose( File );
+
+    return ( Resident * sysconf( _SC_PAGESIZE ));
+}
+
+void EnforceMemoryLimit( long* BatchSizePtr )
+{
+    static bool     WarnedResults   = false;
+
+    long    Budget      = MemoryLimit / 100 * MEMORY_BUDGET_PERCENT;
+    long    Resident    = 0;
+    long    ItemBytes   = 0;
+    long    Fits        = 0;
+
+    if ( !MemoryLimit ) return;
+
+    /*  Same per item estimate as --length-stats, a DATA_ITEM,  */
+    /*  its pointer and its URL, 64 bytes until we know better  */
+    ItemBytes = sizeof( DATA_ITEM ) + sizeof( DATA_ITEM* ) + 32 +
+                ((( URLLengths.Count ? URLLengths.TotalLength / URLLengths.Count : 64 ) 
+                  + 1 + 15 ) & ~15L );
+
+    Resident = GetResidentBytes();
+    if ( Resident > Budget / 2 ) {
+        malloc_trim( 0 );
+        Resident = GetResidentBytes(); }
+
+    Fits = ( Budget - Resident ) / ItemBytes;
+
+    if (( !WarnedResults ) && ( ResultCount * ItemBytes > Budget )) {
+        printf("Memory limit: -n %ld needs about %ld MB, over the %ld MB budget\n",
+                ResultCount, ( ResultCount * ItemBytes ) >> 20, Budget >> 20 );
+        WarnedResults = true; }
+
+    if ( Fits >= *BatchSizePtr ) return;
+
+    /*  Every batch re-sorts the kept results, so a batch much  */
+    /*  smaller than them costs more time than it saves memory  */
+    Fits = std::max( Fits, std::max( ResultCount / 4, ( long ) MEMORY_MIN_BATCH_SIZE ));
+    if ( Fits < *BatchSizePtr ) {
+        printf("Memory limit: %ld MB resident of a %ld MB budget, "
+               "batch size reduced from %ld to %ld\n",
+                Resident >> 20, Budget >> 20, *BatchSizePtr, Fits );
+        *BatchSizePtr = Fits; }
+}
+
+void PrintPeakMemory()
+{
+    struct rusage   Usage;
+
+    if ( getrusage( RUSAGE_SELF, &Usage ) != 0 ) return;
+
+    printf("Peak resident memory: %ld KB", Usage.ru_maxrss );
+    if ( MemoryLimit )
+        printf(" (limit %ld KB)", MemoryLimit >> 10 );
+    printf("\n");
+}
+
+
+/*  Number of worker threads to use for parallel work.  Unless  */
+/*  --threads says otherwise, that's the CPUs this process may  */
+/*  run on (its affinity mask, which taskset and cpusets set),  */
+/*  capped by the cgroup v2 CPU quota, rounded up.  In a        */
+/*  container the host's core count would oversubscribe the    */
+/*  quota and get the threads throttled.                        */
+
+static char     ThreadTopology  [ 128 ] = "";
+
+long GetThreadCount()
+{
+    static long     Count       = 0;
+
+    cpu_set_t       CPUSet;
+    long            CPUs        = 0;
+    long            QuotaCPUs   = 0;
+    long            Quota       = 0;
+    long            Period      = 0;
+    char            Directory   [ PATH_MAX + 32 ];
+    char            QuotaPath   [ PATH_MAX + 64 ];
+    FILE*           File        = NULL;
+
+    if ( Count ) return ( Count );
+
+    if ( ThreadCountOption ) {
+        Count = ThreadCountOption;
+        snprintf( ThreadTopology, sizeof( ThreadTopology ), "set with --threads" );
+        return ( Count ); }
+
+    CPU_ZERO( &CPUSet );
+    if ( sched_getaffinity( 0, sizeof( CPUSet ), &CPUSet ) == 0 )
+        CPUs = CPU_COUNT( &CPUSet );
+    if ( CPUs <= 0 )
+        CPUs = std::thread::hardware_concurrency();
+    if ( CPUs <= 0 )
+        CPUs = 1;
+
+    /*  cpu.max is "<quota> <period>", or "max <period>"  */
+    GetCgroupDirectory( Directory, sizeof( Directory ));
+    snprintf( QuotaPath, sizeof( QuotaPath ), "%s/cpu.max", Directory );
+
+    if (( File = fopen( QuotaPath, "r" ))) {
+        if (( fscanf( File, "%ld %ld", &Quota, &Period ) == 2 ) && 
+            ( Quota > 0 ) && ( Period > 0 ))
+            QuotaCPUs = ( Quota + Period - 1 ) / Period;
+        fclose( File );
+    }
+
+    Count = (( QuotaCPUs > 0 ) && ( QuotaCPUs < CPUs )) ? QuotaCPUs : CPUs;
+
+    if ( QuotaCPUs > 0 )
+        snprintf( ThreadTopology, sizeof( ThreadTopology ), 
+                  "%ld CPUs in affinity mask, cgroup quota %.2f CPUs",
+                  CPUs, ( double ) Quota / Period );
+    else
+        snprintf( ThreadTopology, sizeof( ThreadTopology ), 
+                  "%ld CPUs in affinity mask, no cgroup quota", CPUs );
+
+    return ( Count );
+}
+
+/*  How GetThreadCount() came up with its answer  */
+
+const char* GetThreadTopology()
+{
+    GetThreadCount();
+    return ( ThreadTopology );
+}
+
+
+/*  --sort-output writes every line of the input ordered by      */
+/*  value, as an external sort that stays within the memory     */
+/*  limit.  Lines are collected into a run until the run's      */
+/*  budget is used, the run is radix sorted on all the threads  */
+/*  and, unless it's the only one, written to a temporary run   */
+/*  file.  All the threads then merge the run files at once,    */
+/*  each one taking a range of the keys and writing its part of */
+/*  the output at the offset the lines before it add up to.     */
+/*                                                              */
+/*  A run is one buffer: the URL bytes grow up from the start,  */
+/*  the entries grow down from the end, and the radix sort's    */
+/*  scratch array takes the gap between them.                   */
+
+#define SORT_DEFAULT_MEMORY         ( 1L << 30 )        // without any memory limit
+#define SORT_RESERVED_BYTES         ( 32L << 20 )       // input block, write buffers
+#define SORT_MIN_RUN_BYTES          ( 1L << 20 )
+#define SORT_MIN_MEMORY             ( 16L << 20 )       // with the smallest run
+#define SORT_MAX_RUN_BYTES          ( 0xFFFFFFFFL )     // URL offsets are 32-bit
+#define SORT_RADIX_THREAD_ENTRIES   ( 1L << 16 )        // per thread at least
+#define SORT_WRITE_BUFFER_SIZE      ( 4L << 20 )
+#define SORT_MIN_MERGE_BUFFER       ( 64L << 10 )
+#define SORT_MAX_MERGE_BUFFER       ( 4L << 20 )
+#define SORT_INDEX_STEP             1024                // run records per index entry
+#define SORT_RECORD_HEADER_SIZE     20                  // Low, High, Length
+#define SORT_MAX_VALUE_LENGTH       64
+
+/*  A line of a run.  The value is keyed so that an unsigned   */
+/*  comparison of ( High, Low ) is the output order.           */
+typedef struct _SORT_ENTRY
+{
+    unsigned long   Low;
+    unsigned long   High;
+    unsigned int    URLOffset;
+    unsigned int    URLLength;
+}   SORT_ENTRY;
+
+/*  Every SORT_INDEX_STEP'th record of a run file, where it is  */
+/*  in the file and where its line is in the run's output       */
+typedef struct _SORT_INDEX_ENTRY
+{
+    unsigned long   Low;
+    unsigned long   High;
+    long            FileOffset;
+    long            OutputOffset;
+}   SORT_INDEX_ENTRY;
+
+/*  A sorted run file of records: the key, the line length and  */
+/*  the output line.  It is unlinked already, and goes away     */
+/*  when File is closed.                                        */
+typedef struct _SORT_RUN
+{
+    int                             File;
+    long                            FileSize;
+    long                            OutputSize;     // of its lines
+    long                            LineCount;
+    long                            MaxRecordSize;
+    std::vector<SORT_INDEX_ENTRY>   Index;
+}   SORT_RUN;
+
+/*  Per-thread work of a radix sort pass, over a slice of the  */
+/*  entries.  Counts become the offsets for the scatter.       */
+typedef struct _SORT_RADIX_TASK
+{
+    SORT_ENTRY*     Source;
+    SORT_ENTRY*     Target;
+    long            Start;
+    long            End;
+    int             Digit;                  // byte of the key, 0 to 15
+    long            Counts      [ 256 ];
+    long            DigitCounts [ 16 ][ 256 ];
+}   SORT_RADIX_TASK;
+
+/*  Where a merge thread is in one of the run files  */
+typedef struct _SORT_CURSOR
+{
+    SORT_RUN*       Run;
+    long            RunNumber;
+    char*           Buffer;
+    long            BufferSize;
+    char*           Record;                 // the current one, in Buffer
+    char*           End;                    // of the data in Buffer
+    long            FilePosition;           // of End
+    unsigned long   Low;
+    unsigned long   High;
+    unsigned int    Length;                 // of the line
+    bool            Failed;
+}   SORT_CURSOR;
+
+/*  Per-thread work of the merge: the lines with keys from     */
+/*  First up to, but not including, Last                       */
+typedef struct _SORT_MERGE_TASK
+{
+    std::vector<SORT_RUN>*  Runs;
+    bool                    HasFirst;
+    bool                    HasLast;
+    SORT_INDEX_ENTRY        First;
+    SORT_INDEX_ENTRY        Last;
+    long                    BufferSize;     // of each read buffer, and the output's
+    int                     OutputFile;
+    long                    LinesWritten;
+    bool                    Failed;
+}   SORT_MERGE_TASK;
+
+static inline bool SortKeyBelow( unsigned long Low1, unsigned long High1,
+                                 unsigned long Low2, unsigned long High2 )
+{
+    return (( High1 != High2 ) ? ( High1 < High2 ) : ( Low1 < Low2 ));
+}
+
+static inline unsigned long SortDigit( SORT_ENTRY* Entry, int Digit )
+{
+    return ((( Digit < 8 ) ? ( Entry->Low  >> ( Digit * 8 )) : 
+                             ( Entry->High >> (( Digit - 8 ) * 8 ))) & 0xFF );
+}
+
+static void SortHistogramTask( SORT_RADIX_TASK* Task )
+{
+    memset( Task->DigitCounts, 0, sizeof( Task->DigitCounts ));
+
+    for ( long Index = Task->Start; Index < Task->End; Index += 1 ) {
+        unsigned long Low  = Task->Source[ Index ].Low;
+        unsigned long High = Task->Source[ Index ].High;
+
+        for ( int Digit = 0; Digit < 8; Digit += 1 ) {
+            Task->DigitCounts[ Digit     ][ ( Low  >> ( Digit * 8 )) & 0xFF ] += 1;
+            Task->DigitCounts[ Digit + 8 ][ ( High >> ( Digit * 8 )) & 0xFF ] += 1; }
+    }
+}
+
+static void SortCountTask( SORT_RADIX_TASK* Task )
+{
+    memset( Task->Counts, 0, sizeof( Task->Counts ));
+
+    for ( long Index = Task->Start; Index < Task->End; Index += 1 )
+        Task->Counts[ SortDigit( &Task->Source[ Index ], Task->Digit ) ] += 1;
+}
+
+static void SortScatterTask( SORT_RADIX_TASK* Task )
+{
+    for ( long Index = Task->Start; Index < Task->End; Index += 1 ) {
+        SORT_ENTRY* Entry = &Task->Source[ Index ];
+        Task->Target[ Task->Counts[ SortDigit( Entry, Task->Digit ) ]++ ] = *Entry;
+    }
+}
+
+static void RunSortTasks( void ( *TaskFunction )( SORT_RADIX_TASK* ),
+                          std::vector<SORT_RADIX_TASK>* Tasks )
+{
+    std::vector<std::thread> Workers;
+
+    for ( size_t Thread = 1; Thread < Tasks->size(); Thread += 1 )
+        Workers.push_back( std::thread( TaskFunction, &( *Tasks )[ Thread ] ));
+    TaskFunction( &( *Tasks )[ 0 ] );
+    for ( std::thread& Worker : Workers )
+        Worker.join();
+}
+
+
+/*  Stable LSD radix sort of the entries by ( High, Low ), a    */
+/*  byte at a time, on all the threads.  Each thread counts     */
+/*  its slice, and scatters it to the offsets of its slice in   */
+/*  each bucket.  The bytes that all the keys share, like the   */
+/*  High of 64-bit values, are skipped.  Returns the array the  */
+/*  result ended up in, Entries or Scratch.                     */
+
+static SORT_ENTRY* RadixSortEntries( SORT_ENTRY* Entries, SORT_ENTRY* Scratch, long Count )
+{
+    long                            Threads     = GetThreadCount();
+    bool                            Counted     = true;
+    std::vector<SORT_RADIX_TASK>    Tasks;
+
+    Threads = std::max( 1L, std::min( Threads, Count / SORT_RADIX_THREAD_ENTRIES ));
+    Tasks.resize( Threads );
+
+    for ( long Thread = 0; Thread < Threads; Thread += 1 ) {
+        Tasks[Thread].Source    = Entries;
+        Tasks[Thread].Start     = ( Count * Thread ) / Threads;
+        Tasks[Thread].End       = ( Count * ( Thread + 1 )) / Threads; }
+
+    RunSortTasks( SortHistogramTask, &Tasks );
+
+    for ( int Digit = 0; Digit < 16; Digit += 1 )
+    {
+        long Offset = 0;
+        bool Shared = false;
+
+        for ( int Bucket = 0; ( Bucket < 256 ) && ( !Shared ); Bucket += 1 ) {
+            long Total = 0;
+            for ( long Thread = 0; Thread < Threads; Thread += 1 )
+                Total += Tasks[Thread].DigitCounts[ Digit ][ Bucket ];
+            Shared = ( Total == Count ); }
+        if ( Shared ) continue;
+
+        /*  The histogram is of the slices before the first pass  */
+        for ( long Thread = 0; Thread < Threads; Thread += 1 ) {
+            Tasks[Thread].Source    = Entries;
+            Tasks[Thread].Target    = Scratch;
+            Tasks[Thread].Digit     = Digit;
+            if ( Counted )
+                memcpy( Tasks[Thread].Counts, Tasks[Thread].DigitCounts[ Digit ], 
+                        sizeof( Tasks[Thread].Counts )); }
+
+        if ( !Counted ) RunSortTasks( SortCountTask, &Tasks );
+        Counted = false;
+
+        for ( int Bucket = 0; Bucket < 256; Bucket += 1 )
+            for ( long Thread = 0; Thread < Threads; Thread += 1 ) {
+                long BucketCount = Tasks[Thread].Counts[ Bucket ];
+                Tasks[Thread].Counts[ Bucket ] = Offset;
+                Offset += BucketCount; }
+
+        RunSortTasks( SortScatterTask, &Tasks );
+        std::swap( Entries, Scratch );
+    }
+
+    return ( Entries );
+}
+
+
+/*  Writes all of Data, at Offset, or at the file position if  */
+/*  Offset is negative                                         */
+
+static bool SortWriteAll( int File, const char* Data, long Length, long Offset )
+{
+    while ( Length > 0 )
+    {
+        ssize_t Written = ( Offset < 0 ) ? write( File, Data, Length ) :
+                                           pwrite( File, Data, Length, Offset );
+        if ( Written <= 0 ) {
+            if (( Written < 0 ) && ( errno == EINTR )) continue;
+            return ( false ); }
+
+        Data    += Written;
+        Length  -= Written;
+        if ( Offset >= 0 ) Offset += Written;
+    }
+    return ( true );
+}
+
+
+/*  Writes the sorted entries of a run as output lines, or as   */
+/*  the records of a run file when Run is given, through one    */
+/*  big buffer so the file is written in large sequential       */
+/*  pieces.  The records are the key, the line length and the   */
+/*  line, so the merge only compares keys and copies bytes.     */
+
+static bool WriteSortRun( SORT_ENTRY* Entries, long Count, const char* URLs,
+                          int File, SORT_RUN* Run, long BufferSize )
+{
+    const unsigned long TopBit      = 0x8000000000000000UL;
+    bool                Descending  = ( ResultSortType == SORT_TYPE_DESCENDING );
+    char*               Buffer      = ( char* ) malloc( BufferSize );
+    long                Used        = 0;
+    long                FileOffset  = 0;
+    long                OutputSize  = 0;
+    DATA_ITEM           Item        = { 0 };
+    char                Value       [ SORT_MAX_VALUE_LENGTH ];
+
+    if ( !Buffer ) return ( false );
+
+    for ( long Index = 0; Index < Count; Index += 1 )
+    {
+        SORT_ENTRY*     Entry       = &Entries[ Index ];
+        unsigned long   Low         = Descending ? ~Entry->Low  : Entry->Low;
+        unsigned long   High        = Descending ? ~Entry->High : Entry->High;
+        long            ValueLength = 0;
+        long            LineLength  = 0;
+        long            Needed      = 0;
+
+        Item.LongValue  = ( long )( Low  ^ TopBit );
+        Item.HighValue  = ( long )( High ^ TopBit );
+        FormatValue( &Item, Value, sizeof( Value ));
+
+        ValueLength = strlen( Value );
+        LineLength  = Entry->URLLength + 1 + ValueLength + 1;
+        Needed      = LineLength + ( Run ? SORT_RECORD_HEADER_SIZE : 0 );
+
+        if ( Used + Needed > BufferSize ) {
+            if ( !SortWriteAll( File, Buffer, Used, -1 )) goto Failed;
+            Used = 0; }
+
+        /*  A line longer than the buffer gets a buffer of its own  */
+        if ( Needed > BufferSize ) {
+            char* Larger = ( char* ) realloc( Buffer, Needed );
+            if ( !Larger ) goto Failed;
+            Buffer      = Larger;
+            BufferSize  = Needed; }
+
+        if ( Run ) {
+            unsigned int Length = ( unsigned int ) LineLength;
+
+            if (( Index % SORT_INDEX_STEP ) == 0 )
+                Run->Index.push_back( { Entry->Low, Entry->High, FileOffset, OutputSize } );
+
+            memcpy( Buffer + Used,      &Entry->Low,    8 );
+            memcpy( Buffer + Used + 8,  &Entry->High,   8 );
+            memcpy( Buffer + Used + 16, &Length,        4 );
+            Used += SORT_RECORD_HEADER_SIZE;
+
+            Run->MaxRecordSize = std::max( Run->MaxRecordSize, Needed ); }
+
+        memcpy( Buffer + Used, URLs + Entry->URLOffset, Entry->URLLength );
+        Used += Entry->URLLength;
+        Buffer[ Used++ ] = ' ';
+        memcpy( Buffer + Used, Value, ValueLength );
+        Used += ValueLength;
+        Buffer[ Used++ ] = '\n';
+
+        FileOffset += Needed;
+        OutputSize += LineLength;
+    }
+
+    if ( !SortWriteAll( File, Buffer, Used, -1 )) goto Failed;
+
+    if ( Run ) {
+        Run -> FileSize     = FileOffset;
+        Run -> OutputSize   = OutputSize;
+        Run -> LineCount    = Count; }
+
+    free( Buffer );
+    return ( true );
+
+    Failed:
+        free( Buffer );
+        return ( false );
+}
+
+
+/*  Makes the whole record at Cursor->Record readable, reading  */
+/*  more of the run file when it's cut off at the end of the    */
+/*  buffer.  False at the end of the run, or on a read error.   */
+
+static bool LoadSortCursor( SORT_CURSOR* Cursor )
+{
+    long            Available   = Cursor->End - Cursor->Record;
+    unsigned int    Length      = 0;
+
+    while ( true )
+    {
+        if ( Available >= SORT_RECORD_HEADER_SIZE ) {
+            memcpy( &Length, Cursor->Record + 16, 4 );
+            if ( Available >= SORT_RECORD_HEADER_SIZE + ( long ) Length ) break; }
+
+        long    Wanted  = std::min( Cursor->BufferSize - Available,
+                                    Cursor->Run->FileSize - Cursor->FilePosition );
+        ssize_t Read    = 0;
+
+        if ( Wanted <= 0 ) {
+            Cursor->Failed = ( Available > 0 );
+            return ( false ); }
+
+        memmove( Cursor->Buffer, Cursor->Record, Available );
+        Read = pread( Cursor->Run->File, Cursor->Buffer + Available, 
+                      Wanted, Cursor->FilePosition );
+        if ( Read <= 0 ) {
+            Cursor->Failed = true;
+            return ( false ); }
+
+        Cursor -> Record        = Cursor->Buffer;
+        Cursor -> End           = Cursor->Buffer + Available + Read;
+        Cursor -> FilePosition += Read;
+        Available              += Read;
+    }
+
+    memcpy( &Cursor->Low,  Cursor->Record,     8 );
+    memcpy( &Cursor->High, Cursor->Record + 8, 8 );
+    Cursor->Length = Length;
+    return ( true );
+}
+
+static inline bool NextSortRecord( SORT_CURSOR* Cursor )
+{
+    Cursor->Record += SORT_RECORD_HEADER_SIZE + Cursor->Length;
+    return ( LoadSortCursor( Cursor ));
+}
+
+/*  Heap order of the cursors: the smallest key on top, and  */
+/*  the earlier run on ties, which keeps the sort stable     */
+static bool SortCursorAfter( SORT_CURSOR* Cursor1, SORT_CURSOR* Cursor2 )
+{
+    if (( Cursor1->High != Cursor2->High ) || ( Cursor1->Low != Cursor2->Low ))
+        return ( SortKeyBelow( Cursor2->Low, Cursor2->High, 
+                               Cursor1->Low, Cursor1->High ));
+    return ( Cursor1->RunNumber > Cursor2->RunNumber );
+}
+
+
+/*  Merges the lines of one key range from all the run files.   */
+/*  Where the range starts in each run comes from the run's     */
+/*  index, and the lines of all the runs before it add up to    */
+/*  where it starts in the output, so the threads don't have to */
+/*  wait for each other.                                        */
+
+static void SortMergeTask( SORT_MERGE_TASK* Task )
+{
+    std::vector<SORT_RUN>&      Runs            = *Task->Runs;
+    std::vector<SORT_CURSOR>    Cursors         ( Runs.size() );
+    std::vector<SORT_CURSOR*>   Heap;
+    char*                       Output          = ( char* ) malloc( Task->BufferSize );
+    long                        Used            = 0;
+    long                        OutputOffset    = 0;
+
+    if ( !Output ) goto Failed;
+
+    for ( size_t Number = 0; Number < Runs.size(); Number += 1 )
+    {
+        SORT_CURSOR*    Cursor  = &Cursors[ Number ];
+        SORT_RUN*       Run     = &Runs[ Number ];
 
-            DATA_ITEM*  DeleteItem = DataVector[Index];
-            if ( DeleteItem->URL )                
-                 free ( DeleteItem->URL );
-                 free ( DeleteItem );
-           
-            DataVector.pop_back();
+        Cursor -> Run           = Run;
+        Cursor -> RunNumber     = Number;
+        Cursor -> BufferSize    = Task->BufferSize;
+        Cursor -> Buffer        = ( char* ) malloc( Cursor->BufferSize );
+        Cursor -> Record        = Cursor->Buffer;
+        Cursor -> End           = Cursor->Buffer;
+        Cursor -> FilePosition  = 0;
+        if ( !Cursor->Buffer ) goto Failed;
+
+        /*  Start at the last indexed record below the range  */
+        if ( Task->HasFirst ) {
+            auto Start = std::lower_bound( Run->Index.begin(), Run->Index.end(), Task->First,
+                                           []( const SORT_INDEX_ENTRY& Entry, 
+                                               const SORT_INDEX_ENTRY& Key ) {
+                                               return ( SortKeyBelow( Entry.Low, Entry.High,
+                                                                      Key.Low, Key.High )); } );
+            if ( Start != Run->Index.begin() ) {
+                Start -= 1;
+                Cursor -> FilePosition  = Start->FileOffset;
+                OutputOffset           += Start->OutputOffset; }
         }
 
-        printf("Finished Trimming DataVector. "
-               "DataVector.size() = %lu\n", 
-               DataVector.size());
-        
-        if ( Verbose ) PrintVectorData( &DataVector );
-        
-        /* Loop back up to do the next batch */
-        
-    }  /* End Reading File */
-    
-    AfterLoadTs = GetCurrentTimeMs();
-    printf("\n");
-    printf("Processed %ld items in %ldms from file: %s\n",
-            TotalLinesRead, 
-            (AfterLoadTs-BeforeLoadTs), 
-            InputFileName );  
+        if ( !LoadSortCursor( Cursor )) {
+            if ( Cursor->Failed ) goto Failed;
+            continue; }
 
-    /*  Print the results  */
-    printf("\n");
-    printf("Top %ld Results ", ResultCount );
-    
-    if ( ResultSortType == SORT_TYPE_DESCENDING )
-        printf("(DESCENDING):\n");
-    else if ( ResultSortType == SORT_TYPE_ASCENDING )
-        printf("(ASCENDING):\n");
-    
-    PrintVectorData( &DataVector );
+        /*  ...and skip up to it, counting the lines  */
+        while (( Task->HasFirst ) &&
+               ( SortKeyBelow( Cursor->Low, Cursor->High, 
+                               Task->First.Low, Task->First.High ))) {
+            OutputOffset += Cursor->Length;
+            if ( !NextSortRecord( Cursor )) break; }
 
-    /*  There are some cleanup items to do before exiting */
-    goto Success;
+        if ( Cursor->Failed ) goto Failed;
+        if (( Cursor->Record < Cursor->End ) &&
+            (( !Task->HasLast ) ||
+             ( SortKeyBelow( Cursor->Low, Cursor->High, 
+                             Task->Last.Low, Task->Last.High ))))
+            Heap.push_back( Cursor );
+    }
 
-    Success:
-        /*  Success, no major failures  */
-        Status = true;
-        goto Cleanup;
+    std::make_heap( Heap.begin(), Heap.end(), SortCursorAfter );
+
+    while ( !Heap.empty() )
+    {
+        std::pop_heap( Heap.begin(), Heap.end(), SortCursorAfter );
+        SORT_CURSOR* Cursor = Heap.back();
+
+        if ( Used + Cursor->Length > Task->BufferSize ) {
+            if ( !SortWriteAll( Task->OutputFile, Output, Used, OutputOffset )) goto Failed;
+            OutputOffset += Used;
+            Used          = 0; }
+
+        /*  Lines longer than the buffer go straight out  */
+        if ( Cursor->Length > Task->BufferSize ) {
+            if ( !SortWriteAll( Task->OutputFile, Cursor->Record + SORT_RECORD_HEADER_SIZE, 
+                                Cursor->Length, OutputOffset )) goto Failed;
+            OutputOffset += Cursor->Length; }
+        else {
+            memcpy( Output + Used, Cursor->Record + SORT_RECORD_HEADER_SIZE, Cursor->Length );
+            Used += Cursor->Length; }
+
+        Task->LinesWritten += 1;
+
+        if (( NextSortRecord( Cursor )) &&
+            (( !Task->HasLast ) ||
+             ( SortKeyBelow( Cursor->Low, Cursor->High, 
+                             Task->Last.Low, Task->Last.High ))))
+            std::push_heap( Heap.begin(), Heap.end(), SortCursorAfter );
+        else {
+            if ( Cursor->Failed ) goto Failed;
+            Heap.pop_back(); }
+    }
+
+    if ( !SortWriteAll( Task->OutputFile, Output, Used, OutputOffset )) goto Failed;
+    goto Cleanup;
 
     Failed:
-        /*  Sometimes errno shows weird/wrong */
-        /*  error text but oh well */
-        printf("Error code: %d, text: %s\n", 
-                errno, strerror(errno));
-        Status = false;
+        Task->Failed = true;
         goto Cleanup;
+    Cleanup:
+        for ( SORT_CURSOR& Cursor : Cursors )
+            free( Cursor.Buffer );
+        free( Output );
+}
 
-    Cleanup:    
-        /*  Free the rest of the data  */
-        while ( !DataVector.empty() ){
-          
-            DATA_ITEM* DataItem = DataVector.back();
-        
-            if ( DataItem->URL )                
-                 free ( DataItem->URL );
-                 free ( DataItem );
-                 
-            DataVector.pop_back();  
-        }
-        
-        /*  Close input data file  */
-        if ( DataFile )
-            fclose( DataFile );
-        goto Exit;
 
-    Exit:
-        printf("\n");
-        return(Status);
+/*  Merges the run files into the output on all the threads.   */
+/*  The key ranges of the threads are split at quantiles of     */
+/*  the keys in the run indexes, so they get about as many      */
+/*  lines each.  The output is sized up front, and each thread  */
+/*  writes its range where it belongs.                          */
+
+static bool MergeSortRuns( std::vector<SORT_RUN>* Runs, int OutputFile, long Budget )
+{
+    std::vector<SORT_INDEX_ENTRY>   Keys;
+    std::vector<SORT_MERGE_TASK>    Tasks;
+    std::vector<std::thread>        Workers;
+    long                            Threads         = GetThreadCount();
+    long                            OutputSize      = 0;
+    long                            MaxRecordSize   = 0;
+    long                            BufferSize      = 0;
+    long                            LinesWritten    = 0;
+    long                            LineCount       = 0;
+
+    for ( SORT_RUN& Run : *Runs ) {
+        Keys.insert( Keys.end(), Run.Index.begin(), Run.Index.end() );
+        OutputSize     += Run.OutputSize;
+        LineCount      += Run.LineCount;
+        MaxRecordSize   = std::max( MaxRecordSize, Run.MaxRecordSize );
+        posix_fadvise( Run.File, 0, 0, POSIX_FADV_SEQUENTIAL ); }
+
+    std::sort( Keys.begin(), Keys.end(), 
+               []( const SORT_INDEX_ENTRY& Key1, const SORT_INDEX_ENTRY& Key2 ) {
+                   return ( SortKeyBelow( Key1.Low, Key1.High, Key2.Low, Key2.High )); } );
+
+    Threads = std::max( 1L, std::min( Threads, ( long ) Keys.size() ));
+
+    /*  Half of the budget for the buffers, one per run plus  */
+    /*  the output's per thread, each fits the longest record */
+    BufferSize = Budget / 2 / ( Threads * (( long ) Runs->size() + 1 ));
+    BufferSize = std::max( SORT_MIN_MERGE_BUFFER, 
+                           std::min( SORT_MAX_MERGE_BUFFER, BufferSize ));
+    BufferSize = std::max( BufferSize, MaxRecordSize );
 
+    if (( MemoryLimit ) && 
+        ( BufferSize * Threads * (( long ) Runs->size() + 1 ) > Budget / 2 ))
+        printf("Merging %lu runs takes %ld MB of buffers, more than --memory-limit "
+               "leaves for them\n", 
+                Runs->size(), ( BufferSize * Threads * (( long ) Runs->size() + 1 )) >> 20 );
+
+    if ( ftruncate( OutputFile, OutputSize ) != 0 ) return ( false );
+
+    Tasks.resize( Threads );
+    for ( long Thread = 0; Thread < Threads; Thread += 1 ) {
+        Tasks[Thread].Runs              = Runs;
+        Tasks[Thread].HasFirst          = ( Thread > 0 );
+        Tasks[Thread].HasLast           = ( Thread < Threads - 1 );
+        Tasks[Thread].First             = Keys[ ( Keys.size() * Thread ) / Threads ];
+        if ( Tasks[Thread].HasLast )
+            Tasks[Thread].Last          = Keys[ ( Keys.size() * ( Thread + 1 )) / Threads ];
+        Tasks[Thread].BufferSize        = BufferSize;
+        Tasks[Thread].OutputFile        = OutputFile;
+        Tasks[Thread].LinesWritten      = 0;
+        Tasks[Thread].Failed            = false;
+        Workers.push_back( std::thread( SortMergeTask, &Tasks[Thread] ));
+    }
+    for ( long Thread = 0; Thread < Threads; Thread += 1 )
+        Workers[Thread].join();
+
+    for ( SORT_MERGE_TASK& Task : Tasks ) {
+        if ( Task.Failed ) return ( false );
+        LinesWritten += Task.LinesWritten; }
+
+    if ( Verbose )
+        printf("Merged %lu runs on %ld threads, %ld KB buffers\n",
+                Runs->size(), Threads, BufferSize >> 10 );
+
+    /*  Every line has to come out exactly once  */
+    return ( LinesWritten == LineCount );
 }
 
-/*  I made two comparators, because I didn't       */
-/*  want to potentially slow it down by having an 'if' */
-/*  decision for every comparison for Asc/Desc because */
-/*  there is a user config option to select what type  */
 
-bool CompareAscending(  DATA_ITEM* Item1,
-                        DATA_ITEM* Item2 ){  
-return (( Item1->LongValue ) < 
-        ( Item2->LongValue ));}
+/*  Sorts the run collected so far: the entries were added from  */
+/*  the end of the buffer down, so they're reversed first, back  */
+/*  to the input order that the stable sort keeps for ties       */
 
-bool CompareDescending( DATA_ITEM* Item1,
-                        DATA_ITEM* Item2 ){
-return (( Item1->LongValue ) > 
-        ( Item2->LongValue ));}
+static SORT_ENTRY* SortRunBuffer( char* RunBuffer, long URLBytes,
+                                  SORT_ENTRY* EntryTop, long Count )
+{
+    SORT_ENTRY* Entries = EntryTop - Count;
+    SORT_ENTRY* Scratch = ( SORT_ENTRY* )( RunBuffer + (( URLBytes + 7 ) & ~7L ));
+
+    std::reverse( Entries, EntryTop );
+    return ( RadixSortEntries( Entries, Scratch, Count ));
+}
 
 
-/* Function to print the vector data */
-bool PrintVectorData( std::vector<DATA_ITEM*> *DataVector )
+/*  Writes a sorted run to a new run file, next to the output  */
+
+static bool AddSortRun( std::vector<SORT_RUN>* Runs, SORT_ENTRY* Sorted, 
+                        long Count, const char* URLs, long WriteBytes )
 {
-    // For verbose mode, print out the difference of
-    // the LongValues for each array item vs. them
-    // previous array item, just to see how far they span
-    long PreviousValue = 
-        ( (DATA_ITEM*)  DataVector->at(0))->LongValue;
+    SORT_RUN    Run             = { -1, 0, 0, 0, 0 };
+    char        RunFileName     [ PATH_MAX ];
 
-    for ( long Index  =  0;
-               Index <  DataVector->size();
-               Index += 1 ){
+    snprintf( RunFileName, sizeof( RunFileName ), "%s.runXXXXXX", SortOutputFileName );
+    Run.File = mkstemp( RunFileName );
+    if ( Run.File < 0 ) {
+        printf("Failed to create sort run file: %s\n", RunFileName );
+        return ( false ); }
 
-        DATA_ITEM*  Item =  DataVector->at( Index );
+    /*  Nothing else needs its name, it goes away on close()  */
+    unlink( RunFileName );
+    Runs->push_back( Run );
 
-        if ( Verbose )
-            
-            printf( "[%ld] LongValue=%ld (%ld)  URL=%s\n",
-                Index, 
-                ( Item->LongValue ),
-                ( Item->LongValue ) - PreviousValue,
-                ( Item->URL   ));
-        
-        else
-            printf( "[%ld] LongValue=%ld  URL=%s\n",
-                Index,
-                ( Item->LongValue ),
-                ( Item->URL   ) );
+    if ( !WriteSortRun( Sorted, Count, URLs, Run.File, &Runs->back(), WriteBytes )) {
+        printf("Failed to write sort run file: %s\n", strerror( errno ));
+        return ( false ); }
 
-            
-        
-        PreviousValue = ( Item->LongValue );
+    return ( true );
+}
+
+
+bool GenerateSortedFile( FILE** FilePtr )
+{
+    const unsigned long     TopBit      = 0x8000000000000000UL;
+    bool                    Descending  = ( ResultSortType == SORT_TYPE_DESCENDING );
+    std::vector<SORT_RUN>   Runs;
+    char*                   RunBuffer   = NULL;
+    SORT_ENTRY*             EntryTop    = NULL;
+    SORT_ENTRY*             Sorted      = NULL;
+    long                    Budget      = 0;
+    long                    RunBytes    = 0;
+    long                    WriteBytes  = 0;
+    long                    URLBytes    = 0;
+    long                    EntryCount  = 0;
+    long                    TotalLinesRead = 0;
+    long                    StartTs     = GetCurrentTimeMs();
+    long                    RunTs       = 0;
+    int                     OutputFile  = -1;
+    bool                    MoreRows    = true;
+    bool                    Status      = false;
+
+    if ( !FilePtr ) return ( false );
+
+    /*  Each run is the budget less what the rest of the  */
+    /*  process needs, the merge uses it for its buffers  */
+    Budget   = ( MemoryLimit ? MemoryLimit : SORT_DEFAULT_MEMORY ) / 100 * MEMORY_BUDGET_PERCENT;
+    RunBytes = std::max( SORT_MIN_RUN_BYTES, 
+                         std::min( SORT_MAX_RUN_BYTES, 
+                                   Budget - std::min( SORT_RESERVED_BYTES, Budget / 2 ))) & ~7L;
+
+    /*  A run's lines are about the size of the run, so a  */
+    /*  small one doesn't need the whole write buffer      */
+    WriteBytes = std::min( SORT_WRITE_BUFFER_SIZE, RunBytes / 2 );
+
+    /*  Below this the input block and buffers alone go over  */
+    if (( MemoryLimit ) && ( MemoryLimit < SORT_MIN_MEMORY ))
+        printf("--memory-limit is below the %ld MB the sort needs at least, "
+               "it will use more than that\n", SORT_MIN_MEMORY >> 20 );
+
+    RunBuffer = ( char* ) malloc( RunBytes );
+    EntryTop  = ( SORT_ENTRY* )( RunBuffer + RunBytes );
+    if ( !RunBuffer ) {
+        printf("Failed to allocate %ld MB for the sort runs\n", RunBytes >> 20 );
+        return ( false ); }
+
+    OutputFile = open( SortOutputFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( OutputFile < 0 ) {
+        printf("Failed to open sort output file: %s\n", SortOutputFileName );
+        goto Cleanup; }
+
+    printf("Sorting in runs of up to %ld MB\n", RunBytes >> 20 );
+    RunTs = GetCurrentTimeMs();
+
+    while ( MoreRows )
+    {
+        MoreRows = ReadRecordBlock( FilePtr, &InputBlock );
+
+        for ( long Row = 0; ( MoreRows ) && ( Row < InputBlock.RowCount ); Row += 1 )
+        {
+            unsigned int    Length  = InputBlock.URLLengths[Row];
+            SORT_ENTRY*     Entry   = NULL;
 
+            if ( InputBlock.Status[Row] != PARSE_OK ) continue;
+
+            /*  Sort a full run and write it to a file of its own  */
+            if ((( URLBytes + Length + 7 ) & ~7L ) + 
+                 ( EntryCount + 1 ) * 2 * ( long ) sizeof( SORT_ENTRY ) > RunBytes )
+            {
+                if ( !EntryCount ) {
+                    printf("Line %ld is too long to sort in %ld MB\n", 
+                            InputBlock.LineNumbers[Row], RunBytes >> 20 );
+                    goto Cleanup; }
+
+                Sorted = SortRunBuffer( RunBuffer, URLBytes, EntryTop, EntryCount );
+                if ( !AddSortRun( &Runs, Sorted, EntryCount, RunBuffer, WriteBytes )) goto Cleanup;
+
+                if ( Verbose )
+                    printf("Sorted run %lu: %ld lines in %ldms\n", 
+                            Runs.size(), EntryCount, GetCurrentTimeMs() - RunTs );
+
+                RunTs       = GetCurrentTimeMs();
+                URLBytes    = 0;
+                EntryCount  = 0;
+            }
+
+            memcpy( RunBuffer + URLBytes, 
+                    InputBlock.Buffer + InputBlock.URLOffsets[Row], Length );
+
+            Entry = EntryTop - ( EntryCount + 1 );
+            Entry -> Low        = InputBlock.LongValues[Row] ^ TopBit;
+            Entry -> High       = ( ValueType == VALUE_TYPE_I128 ) ? 
+                                  ( InputBlock.HighValues[Row] ^ TopBit ) : 0;
+            Entry -> URLOffset  = ( unsigned int ) URLBytes;
+            Entry -> URLLength  = Length;
+
+            /*  Descending is ascending of the inverted keys  */
+            if ( Descending ) {
+                Entry -> Low    = ~Entry->Low;
+                Entry -> High   = ~Entry->High; }
+
+            URLBytes       += Length;
+            EntryCount     += 1;
+            TotalLinesRead += 1;
+        }
     }
 
-    return ( true );
+    Sorted = SortRunBuffer( RunBuffer, URLBytes, EntryTop, EntryCount );
+
+    /*  All of it fit in one run, write it out directly  */
+    if ( Runs.empty() ) {
+        if ( !WriteSortRun( Sorted, EntryCount, RunBuffer, OutputFile, NULL, WriteBytes )) 
+            goto WriteFailed; }
+    else {
+        if (( EntryCount ) && 
+            ( !AddSortRun( &Runs, Sorted, EntryCount, RunBuffer, WriteBytes ))) goto Cleanup;
+
+        /*  The run buffer is the merge's memory now  */
+        free( RunBuffer );
+        RunBuffer = NULL;
+
+        if ( !MergeSortRuns( &Runs, OutputFile, Budget )) goto WriteFailed;
+    }
+
+    printf("\n");
+    printf("Sorted %ld items in %ldms from file: %s\n",
+            TotalLinesRead, 
+            GetCurrentTimeMs() - StartTs, 
+            InputFileName );
+    printf("Wrote them to %s, %s\n", 
+            SortOutputFileName, 
+            Descending ? "DESCENDING" : "ASCENDING" );
+    if ( !Runs.empty() )
+        printf("Merged %lu sorted runs\n", Runs.size() );
+
+    PrintParseErrorSummary();
+    if ( ShowLengthStats ) PrintLengthStats();
+    PrintValueTotals( &ValueTotals );
+
+    Status = true;
+    goto Cleanup;
+
+    WriteFailed:
+        printf("Failed to write the sorted output: %s\n", strerror( errno ));
+        goto Cleanup;
+    Cleanup:
+        for ( SORT_RUN& Run : Runs )
+            if ( Run.File >= 0 ) close( Run.File );
+        if (( OutputFile >= 0 ) && ( close( OutputFile ) != 0 ) && ( Status )) {
+            printf("Failed to write the sorted output: %s\n", strerror( errno ));
+            Status = false; }
+        free( RunBuffer );
+        return ( Status );
 }
 
 
@@ -875,15 +7777,128 @@ long  GetCurrentTimeMs()
      return ( CurrentTimeMs );
 }
 
+long  GetCurrentTimeUs()
+{
+    struct timeval  CurrentTime = { 0 };
+    gettimeofday( &CurrentTime,  NULL );
+
+    return (( CurrentTime.tv_sec * 1000000 ) + CurrentTime.tv_usec );
+}
+
+/*  A size in bytes, with an optional K, M or G suffix  */
+
+static long ParseSizeOption( const char* Option )
+{
+    char*   EndPtr  = NULL;
+    long    Size    = strtol( Option, &EndPtr, 10 );
+
+    if ( EndPtr == Option ) return ( 0 );
+
+    switch ( toupper( *EndPtr ))
+    {
+        case 'G':   Size <<= 10;    // fall through
+        case 'M':   Size <<= 10;    // fall through
+        case 'K':   Size <<= 10;    EndPtr += 1;    break;
+        case '\0':                                 break;
+        default:    return ( 0 );
+    }
+
+    return (( *EndPtr == '\0' ) ? Size : 0 );
+}
+
+/*  --metrics is a comma separated list of value columns,  */
+/*  from 2 to 9, as in "2,3,5"                             */
+
+static bool ParseMetricsOption( const char* Option )
+{
+    const char*     Cursor  = Option;
+    char*           EndPtr  = NULL;
+
+    MetricsOptionText = ( char* ) Option;
+
+    while ( true )
+    {
+        long Column = strtol( Cursor, &EndPtr, 10 );
+
+        if (( EndPtr == Cursor ) || 
+            ( Column < 2 ) || ( Column > EXPRESSION_MAX_COLUMN ) ||
+            ( MetricSlots[ Column ] ) || ( MetricCount == MAX_METRICS ))
+            return ( false );
+
+        MetricColumns[ MetricCount ] = Column;
+        MetricSlots[ Column ]        = MetricCount + 1;
+        MetricMaxColumn              = std::max( MetricMaxColumn, (int) Column );
+        MetricCount += 1;
+
+        if ( *EndPtr == '\0' ) return ( true );
+        if ( *EndPtr != ',' ) return ( false );
+        Cursor = EndPtr + 1;
+    }
+}
+
 /*  I know :) There are lots of arg-parser libs   */
 /*  out there, no need to re-invent the wheel ... */
 
+/*  --input-format is one of the InputFormatNames  */
+
+static bool ParseInputFormatOption( const char* Option )
+{
+    for ( int Format = 0; Format < INPUT_FORMAT_COUNT; Format += 1 )
+        if ( strcmp( Option, InputFormatNames[ Format ] ) == 0 ) {
+            InputFormat         = Format;
+            ParseLineFunction   = LineParsers[ Format ];
+            return ( true ); }
+
+    return ( false );
+}
+
+
+/*  --engine is one of the SelectEngineNames  */
+
+static bool ParseEngineOption( const char* Option )
+{
+    for ( int Engine = 0; Engine < SELECT_ENGINE_COUNT; Engine += 1 )
+        if ( strcmp( Option, SelectEngineNames[ Engine ] ) == 0 ) {
+            SelectEngine = Engine;
+            return ( true ); }
+
+    return ( false );
+}
+
+
+/*  --value-type is one of the ValueTypeNames, and decimal  */
+/*  can be followed by its scale, as in "decimal:4"         */
+
+static bool ParseValueTypeOption( const char* Option )
+{
+    for ( int Type = 0; Type < VALUE_TYPE_COUNT; Type += 1 )
+    {
+        size_t Length = strlen( ValueTypeNames[ Type ] );
+        if ( strncmp( Option, ValueTypeNames[ Type ], Length ) != 0 ) continue;
+
+        if (( Type == VALUE_TYPE_DECIMAL ) && ( Option[ Length ] == ':' )) {
+            DecimalScale = atol( Option + Length + 1 );
+            if (( DecimalScale < 0 ) || ( DecimalScale > 18 )) return ( false ); }
+        else if ( Option[ Length ] != '\0' )
+            continue;
+
+        ValueType           = Type;
+        ParseValueFunction  = ValueParsers[ Type ];
+        return ( true );
+    }
+
+    return ( false );
+}
+
+
 bool  ParseArgs( int argc, char* argv[] )
 {
-    bool Status = false;    
+    bool Status         = false;    
+    int  arg            = 0;
+    bool ValueTypeGiven = false;
     if ( argc < 2 ) return ( false );
 
-    for ( int arg  =  1;
+    for (     arg  =  1;
               arg  <  argc;
               arg  += 1  )
     {
@@ -946,6 +7961,20 @@ bool  ParseArgs( int argc, char* argv[] )
                     else goto MissingValue;
                     break;
             
+                /* CacheDirectory for the result cache */
+                case 'c':
+                    if (( arg + 1) < argc ) {
+                        CacheDirectory = argv[( arg + 1 )]; }
+                    else goto MissingValue;
+                    break;
+
+                /* IncrementalStateFile for incremental mode */
+                case 'r':
+                    if (( arg + 1) < argc ) {
+                        IncrementalStateFile = argv[( arg + 1 )]; }
+                    else goto MissingValue;
+                    break;
+
                 /* Verbose mode */
                 case 'v':
                     Verbose = true;
@@ -960,12 +7989,118 @@ bool  ParseArgs( int argc, char* argv[] )
                     else goto MissingValue;
                     break;
 
+                /* Long options */
+                case '-':
+                    if ( strcmp( argv[arg], "--normalize-urls" ) == 0 ) {
+                        NormalizeURLs = true; }
+                    else if ( strcmp( argv[arg], "--blocklist" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            BlockListFileName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--allowlist" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            AllowListFileName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--join" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            JoinFileName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--join-filter" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            JoinFilterValue = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--join-group" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            JoinGroupColumn = atol( argv[( arg + 1 )] );
+                            if ( JoinGroupColumn <= 0 ) { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--input-format" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            if ( !ParseInputFormatOption( argv[( arg + 1 )] )) 
+                            { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--url-field" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            URLFieldName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--value-field" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            ValueFieldName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--arrow-output" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            ArrowOutputFileName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--sort-output" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            SortOutputFileName = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--value-type" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            if ( !ParseValueTypeOption( argv[( arg + 1 )] )) 
+                            { goto InvalidValue; }
+                            ValueTypeGiven = true; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--metrics" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            if ( !ParseMetricsOption( argv[( arg + 1 )] )) 
+                            { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--engine" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            if ( !ParseEngineOption( argv[( arg + 1 )] )) 
+                            { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--kernels" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            KernelsOption = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--threads" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            ThreadCountOption = atol( argv[( arg + 1 )] );
+                            if ( ThreadCountOption <= 0 ) { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--memory-limit" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            if (( MemoryLimit = ParseSizeOption( argv[( arg + 1 )] )) <= 0 ) 
+                            { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--length-stats" ) == 0 ) {
+                        ShowLengthStats = true; }
+                    else if ( strcmp( argv[arg], "--no-read-ahead" ) == 0 ) {
+                        ReadAhead = false; }
+                    else if ( strcmp( argv[arg], "--distinct" ) == 0 ) {
+                        DistinctURLs = true; }
+                    else if ( strcmp( argv[arg], "--presorted" ) == 0 ) {
+                        PresortedInput = true; }
+                    else if ( strcmp( argv[arg], "--with-ties" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            TieCap = atol( argv[( arg + 1 )] );
+                            if (( TieCap < 0 ) || 
+                                ( !isdigit( argv[( arg + 1 )][0] ))) { goto InvalidValue; }}
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--rank-by" ) == 0 ) {
+                        if (( arg + 1) < argc ) {
+                            RankExpressionText = argv[( arg + 1 )]; }
+                        else goto MissingValue; }
+                    else if ( strcmp( argv[arg], "--build-url-list" ) == 0 ) {
+                        if (( arg + 2) < argc ) {
+                            URLListTextFileName  = argv[( arg + 1 )];
+                            URLListImageFileName = argv[( arg + 2 )]; }
+                        else goto MissingValue; }
+                    else goto UnknownOption;
+                    break;
+
                 default:
                     break;
             }  // end switch
         } // end if
     } // end for
     
+    /*  The results of --rank-by are always doubles  */
+    if (( RankExpressionText ) && ( ValueTypeGiven )) {
+        printf("\n*** --rank-by can't be combined with --value-type ***\n");
+        goto Exit; }
     
     goto Success;
 
@@ -982,6 +8117,10 @@ bool  ParseArgs( int argc, char* argv[] )
         Status = false;
         printf("\n*** Invalid value for argument ***\n");
         goto Exit;
+    UnknownOption:
+        Status = false;
+        printf("\n*** Unknown option: %s ***\n", argv[arg]);
+        goto Exit;
     Exit:
         return ( Status );
 }
@@ -1018,6 +8157,17 @@ void PrintHelp()
     printf("            1 = Random/Sampling mode.\n");
     printf("        Default is 0 / Normal mode.\n");
     printf("\n");
+    printf("  -c    <Result Cache Directory>\n\n");
+    printf("        Applies to Normal mode.  Results are saved in this directory\n");
+    printf("        and reused by later runs of the same query on the same,\n");
+    printf("        unchanged input file.  It is not enabled by default.\n");
+    printf("\n");
+    printf("  -r    <Incremental State File>\n\n");
+    printf("        For files that are only appended to.  The results and the\n");
+    printf("        position reached are saved in this file, and the next run\n");
+    printf("        only reads the lines added since.  If the file was truncated\n");
+    printf("        or rewritten, it is processed from the start again.\n");
+    printf("\n");
     printf("  -g  <Generate Test Data>\n\n");
     printf("      This will generate a Test Data File with random values.\n");
     printf("      '-g 50000' will enable the creation of a test data file\n");
@@ -1026,6 +8176,134 @@ void PrintHelp()
     printf("  -o  <Test Data Output File>\n\n");
     printf("      The name of the Test Data file if you are generating one.\n");
     printf("\n");
+    printf("  --normalize-urls\n\n");
+    printf("      Normalize URLs before selecting, so equivalent URLs compare equal:\n");
+    printf("      requires an http:// or https:// scheme, lowercases the scheme and\n");
+    printf("      host, removes the query string, fragment and default port, and\n");
+    printf("      rejects URLs that are not valid UTF-8.\n");
+    printf("\n");
+    printf("  --input-format <text|json|combined|arrow>\n\n");
+    printf("      Layout of the input lines:\n");
+    printf("            text     = a URL and a value column, separated by whitespace\n");
+    printf("            json     = JSON Lines, one object per line\n");
+    printf("            combined = nginx / Apache access log, combined or common format,\n");
+    printf("                       the URL is the request path\n");
+    printf("            arrow    = Arrow IPC file or stream, with a utf8 URL column\n");
+    printf("                       and an integer or floating point value column\n");
+    printf("      Default is text.\n");
+    printf("\n");
+    printf("  --url-field <Name>\n");
+    printf("  --value-field <Name>\n\n");
+    printf("      Fields of a JSON input line, or columns of Arrow input, with the\n");
+    printf("      URL and the value.  Defaults are url and value.  The value can be\n");
+    printf("      a number, or a string with a number in it.  For combined input,\n");
+    printf("      the value field is bytes (the default), status or time (seconds\n");
+    printf("      since the epoch).\n");
+    printf("\n");
+    printf("  --arrow-output <File>\n\n");
+    printf("      Also write the results to an Arrow IPC file, with a url column and\n");
+    printf("      a value column: int64, uint64 or double, or utf8 for i128 and\n");
+    printf("      decimal values.\n");
+    printf("\n");
+    printf("  --sort-output <File>\n\n");
+    printf("      Instead of the top N, write every line to File as \"URL value\",\n");
+    printf("      ordered by value (-s), with equal values in input order.  Lines\n");
+    printf("      are sorted in runs that fit in the --memory-limit (1G without\n");
+    printf("      one), which are written next to File and merged on all threads.\n");
+    printf("      It needs about 16M at least, a lower limit is warned about.\n");
+    printf("\n");
+    printf("  --value-type <Type>\n\n");
+    printf("      Type of the value column:\n");
+    printf("            i64        = signed 64-bit integer (default)\n");
+    printf("            u64        = unsigned 64-bit integer\n");
+    printf("            f64        = floating point\n");
+    printf("            i128       = signed 128-bit integer\n");
+    printf("            decimal:N  = fixed point with N digits after the point (default 2)\n");
+    printf("\n");
+    printf("  --kernels <scalar|sse2|avx2|avx512>\n\n");
+    printf("      Force a variant of the CPU kernels, for benchmarking.  Default is\n");
+    printf("      the widest one this CPU supports.\n");
+    printf("\n");
+    printf("  --engine <auto|sort|merge|select>\n\n");
+    printf("      How the candidates of each batch are put in order: sort all of\n");
+    printf("      them, sort the new ones and merge them with the kept results, or\n");
+    printf("      nth_element to the Nth and sort the top N.  By default (auto) the\n");
+    printf("      cheapest is picked for each batch from -n and how many lines got\n");
+    printf("      in, and a change is logged.  The others force one, to benchmark\n");
+    printf("      against with the time reported for ordering the batches.\n");
+    printf("\n");
+    printf("  --threads <Count>\n\n");
+    printf("      Number of threads for parallel work.  Default is the CPUs in the\n");
+    printf("      affinity mask, capped by the cgroup v2 CPU quota.\n");
+    printf("\n");
+    printf("  --memory-limit <Size>\n\n");
+    printf("      Memory budget, in bytes or with a K, M or G suffix.  When the\n");
+    printf("      process gets close to it, the batch size is reduced.  Default is\n");
+    printf("      the cgroup v2 memory.max, if there is one.\n");
+    printf("\n");
+    printf("  --no-read-ahead\n\n");
+    printf("      Read the input in the same thread that parses it.  By default, with\n");
+    printf("      more than one CPU, the next chunk of the file is read on another\n");
+    printf("      thread meanwhile.\n");
+    printf("\n");
+    printf("  --length-stats\n\n");
+    printf("      Print histograms of the line and URL lengths, and an estimate of\n");
+    printf("      the memory the results need, to plan for large -n values.\n");
+    printf("\n");
+    printf("  --distinct\n\n");
+    printf("      Show each URL at most once, with its best value, instead of the\n");
+    printf("      top N lines.\n");
+    printf("\n");
+    printf("  --presorted\n\n");
+    printf("      The input is sorted by value, in the order of the results, so\n");
+    printf("      reading stops once no later line can make them, except with -r.\n");
+    printf("      That needs a line ranked below the one before it, a run of equal\n");
+    printf("      values alone doesn't tell the order.  The totals then only cover\n");
+    printf("      the lines read, and -c doesn't cache the results.  A line out of\n");
+    printf("      order before the stop is reported, and the input is read in full,\n");
+    printf("      but the lines after the stop are taken on trust.\n");
+    printf("\n");
+    printf("  --with-ties <Cap>\n\n");
+    printf("      Also keep the items tied with the Nth result, up to Cap more of\n");
+    printf("      them, and report how many items share the boundary value.\n");
+    printf("      Equal values are kept in the order they were read.\n");
+    printf("\n");
+    printf("  --metrics <Column,Column,...>\n\n");
+    printf("      Keep a separate top-N for each of the value columns 2 to 9, all\n");
+    printf("      from one read of the file, for example --metrics 2,3,4 for bytes,\n");
+    printf("      requests and latency.  The columns are of the --value-type.\n");
+    printf("\n");
+    printf("  --rank-by <Expression>\n\n");
+    printf("      Rank by an expression instead of the value column, for example\n");
+    printf("      --rank-by '$2 / $3' for the value divided by a duration in column 3.\n");
+    printf("      Operands are columns $2 to $9 (value = $2), url_length (or len(url))\n");
+    printf("      and numbers, with + - * / and parentheses.  The results are floating\n");
+    printf("      point, and lines where the result is not a number are skipped,\n");
+    printf("      so it can't be combined with --value-type.\n");
+    printf("\n");
+    printf("  --blocklist <URL List File>\n");
+    printf("  --allowlist <URL List File>\n\n");
+    printf("      Exclude the URLs in the list, or only include the URLs in the list.\n");
+    printf("      The list is a text file with one URL per line, or an image file\n");
+    printf("      made with --build-url-list, which loads instantly.\n");
+    printf("\n");
+    printf("  --join <Dimension File>\n\n");
+    printf("      Attaches attributes to the results.  Each line of the dimension\n");
+    printf("      file is a URL followed by its attributes, for example an owner\n");
+    printf("      and a service name.  Like the URL lists, it can be an image file\n");
+    printf("      made with --build-url-list.\n");
+    printf("\n");
+    printf("  --join-filter <Attribute>\n\n");
+    printf("      Only include URLs that have this attribute in the dimension file.\n");
+    printf("\n");
+    printf("  --join-group <Attribute Column>\n\n");
+    printf("      Sum the values per attribute (1 = first attribute column) and show\n");
+    printf("      the top groups instead of the top URLs.\n");
+    printf("\n");
+    printf("  --build-url-list <URL List File> <Image File>\n\n");
+    printf("      Builds a URL list image file from a text list and exits.  Use\n");
+    printf("      --normalize-urls here too if the image is used with it.\n");
+    printf("\n");
     printf("  -v  <Verbose Output>\n\n");
     printf("      Default is non-verbose\n");
 